@@ -6,19 +6,25 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #ifdef Debug
-#include <string.h>
 #include <stdio.h>
 #endif
 
 #include "../palm/allocator.h"
+#include "../util/epoch.h"
 #include "art.h"
 #include "art_node.h"
 
 struct adaptive_radix_tree
 {
   art_node *root;
+  // counters are only written under contention, keep them away from `root`
+  char      padding[64 - sizeof(art_node *)];
+  uint64_t  lock_spins;
+  uint64_t  restarts;
 };
 
 adaptive_radix_tree* new_adaptive_radix_tree()
@@ -26,9 +32,13 @@ adaptive_radix_tree* new_adaptive_radix_tree()
 #ifdef Allocator
   init_allocator();
 #endif
+  init_epoch();
+  init_art_node();
 
   adaptive_radix_tree *art = malloc(sizeof(adaptive_radix_tree));
   art->root = 0;
+  art->lock_spins = 0;
+  art->restarts = 0;
 
   return art;
 }
@@ -38,13 +48,52 @@ void free_adaptive_radix_tree(adaptive_radix_tree *art)
   (void)art;
 }
 
+// add contention this thread has seen to the counters of `art`
+static inline void adaptive_radix_tree_account(adaptive_radix_tree *art, uint64_t restarts)
+{
+  uint64_t spins = art_node_take_lock_spins();
+  if (unlikely(spins))
+    __atomic_add_fetch(&art->lock_spins, spins, __ATOMIC_RELAXED);
+  if (unlikely(restarts))
+    __atomic_add_fetch(&art->restarts, restarts, __ATOMIC_RELAXED);
+}
+
+void adaptive_radix_tree_get_stats(adaptive_radix_tree *art, art_stats *stats)
+{
+  stats->lock_spins = __atomic_load_n(&art->lock_spins, __ATOMIC_RELAXED);
+  stats->restarts = __atomic_load_n(&art->restarts, __ATOMIC_RELAXED);
+}
+
+static void release_art_node(void *an)
+{
+  free_art_node((art_node *)an);
+}
+
+static void release_art_leaf(void *leaf)
+{
+  free_art_leaf((art_node *)leaf);
+}
+
+// return 0 if `leaf` can not hold the key, leaf itself is not touched
+static inline int adaptive_radix_tree_leaf_may_match(art_node *leaf, const void *key, size_t len)
+{
+  return !has_fingerprint(leaf) || get_fingerprint(leaf) == art_key_fingerprint(key, len);
+}
+
+// compare the whole key with leaf since prefix longer than 8 bytes is not verified, return 1 if they are equal
+static inline int adaptive_radix_tree_leaf_match(art_node *leaf, const void *key, size_t len)
+{
+  return adaptive_radix_tree_leaf_may_match(leaf, key, len) &&
+    get_leaf_len(leaf) == len && memcmp(get_leaf_key(leaf), key, len) == 0;
+}
+
 // return  0 on success,
 // return +1 on existed,
 // return -1 on retry
 static int adaptive_radix_tree_replace_leaf(art_node *parent, art_node **ptr, art_node *an,
-  const void *key, size_t len, size_t off)
+  art_node *leaf, size_t off)
 {
-  art_node *new = art_node_replace_leaf_child(an, key, len, off);
+  art_node *new = art_node_replace_leaf_child(an, leaf, off);
   if (likely(new)) {
     if (likely(parent)) {
       if (unlikely(art_node_lock(parent))) {
@@ -60,6 +109,7 @@ static int adaptive_radix_tree_replace_leaf(art_node *parent, art_node **ptr, ar
           free_art_node(new);
           return -1;
         }
+        art_node_set_parent_unsafe(new, parent);
         __atomic_store(ptr, &new, __ATOMIC_RELEASE);
         art_node_unlock(parent);
         return 0;
@@ -80,7 +130,8 @@ static int adaptive_radix_tree_replace_leaf(art_node *parent, art_node **ptr, ar
 // return  0 on success,
 // return +1 on existed,
 // return -1 for retry
-static int _adaptive_radix_tree_put(art_node *parent, art_node **ptr, const void *key, size_t len, size_t off)
+static int _adaptive_radix_tree_put(art_node *parent, art_node **ptr, art_node *leaf, const void *key, size_t len,
+  size_t off)
 {
   art_node *an;
   int first = 1;
@@ -101,8 +152,12 @@ static int _adaptive_radix_tree_put(art_node *parent, art_node **ptr, const void
   // NOTE: __ATOMIC_RELAXED is not ok
   __atomic_load(ptr, &an, __ATOMIC_ACQUIRE);
 
+  // child has been removed by another thread
+  if (unlikely(an == 0))
+    return -1;
+
   if (unlikely(is_leaf(an)))
-    return adaptive_radix_tree_replace_leaf(parent, ptr, an, key, len, off);
+    return adaptive_radix_tree_replace_leaf(parent, ptr, an, leaf, off);
 
   // verify node prefix
   uint64_t v = art_node_get_stable_expand_version(an);
@@ -128,7 +183,7 @@ static int _adaptive_radix_tree_put(art_node *parent, art_node **ptr, const void
       goto begin;
     }
     debug_assert(art_node_version_is_old(art_node_get_version_unsafe(an)) == 0);
-    art_node *new = art_node_expand_and_insert(an, key, len, off, p);
+    art_node *new = art_node_expand_and_insert(an, leaf, off, p);
     parent = art_node_get_locked_parent(an);
     art_node_set_parent_unsafe(an, new);
     if (likely(parent)) {
@@ -143,10 +198,12 @@ static int _adaptive_radix_tree_put(art_node *parent, art_node **ptr, const void
   }
 
   off += p;
-  debug_assert(off < len);
+  debug_assert(off <= len);
 
-  // prefix is matched, we can descend
-  art_node **next = art_node_find_child(an, v, ((unsigned char *)key)[off]);
+  // prefix is matched, we can descend, byte 0 is used when key ends here
+  int advance = off != len;
+  unsigned char byte = advance ? ((unsigned char *)key)[off] : 0;
+  art_node **next = art_node_find_child(an, v, byte);
 
   v = art_node_get_version(an);
 
@@ -156,15 +213,22 @@ static int _adaptive_radix_tree_put(art_node *parent, art_node **ptr, const void
   }
 
   if (next)
-    return _adaptive_radix_tree_put(an, next, key, len, off + 1);
+    return _adaptive_radix_tree_put(an, next, leaf, key, len, off + advance);
 
   if (unlikely(art_node_lock(an))) {
     off -= p;
     goto begin;
   }
 
+  // prefix might have been changed before we acquire the lock, then `off` is stale
+  if (unlikely(art_node_version_compare_expand(v, art_node_get_version_unsafe(an)))) {
+    art_node_unlock(an);
+    off -= p;
+    goto begin;
+  }
+
   art_node *new = 0;
-  next = art_node_add_child(an, ((unsigned char *)key)[off], (art_node *)make_leaf(key), &new);
+  next = art_node_add_child(an, byte, leaf, &new);
   if (unlikely(new)) {
     parent = art_node_get_locked_parent(an);
     if (likely(parent)) {
@@ -177,34 +241,212 @@ static int _adaptive_radix_tree_put(art_node *parent, art_node **ptr, const void
   }
   art_node_unlock(an);
 
+  // `an` has been replaced by a bigger node
+  if (unlikely(new))
+    epoch_retire(an, release_art_node);
+
   // another thread might inserted same byte before we acquire lock
   if (unlikely(next))
-    return _adaptive_radix_tree_put(an, next, key, len, off + 1);
+    return _adaptive_radix_tree_put(an, next, leaf, key, len, off + advance);
 
   return 0;
 }
 
 // return 0 on success
-// return 1 on duplication
-int adaptive_radix_tree_put(adaptive_radix_tree *art, const void *key, size_t len)
+// return 1 on duplication, value is not changed
+int adaptive_radix_tree_put(adaptive_radix_tree *art, const void *key, size_t len, const void *value)
 {
   //print_key(key, len);
 
-  art_node *root = art->root;
-  if (unlikely(root == 0)) { // empty art
-    art_node *leaf = (art_node *)make_leaf(key);
-    if (__atomic_compare_exchange_n(&art->root, &root, leaf, 0 /* weak */, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
-      return 0;
-    // else another thread has replaced empty root
-  }
+  art_node *leaf = new_art_leaf(key, len, value);
+
   int ret;
-  // retry should be rare
-  while (unlikely((ret = _adaptive_radix_tree_put(0 /* parent */, &art->root, key, len, 0 /* off */)) == -1))
-    ;
+  uint64_t restarts = 0;
+  epoch_enter();
+  while (1) {
+    art_node *root;
+    __atomic_load(&art->root, &root, __ATOMIC_ACQUIRE);
+    if (unlikely(root == 0)) { // empty art
+      if (__atomic_compare_exchange_n(&art->root, &root, leaf, 0 /* weak */, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        ret = 0;
+        break;
+      }
+      // else another thread has replaced empty root
+    }
+    // retry should be rare
+    if (likely((ret = _adaptive_radix_tree_put(0 /* parent */, &art->root, leaf, key, len, 0 /* off */)) != -1))
+      break;
+    ++restarts;
+  }
+  epoch_exit();
+  adaptive_radix_tree_account(art, restarts);
+
+  if (unlikely(ret))
+    free_art_leaf(leaf);
   return ret;
 }
 
-static void* _adaptive_radix_tree_get(art_node *parent, art_node **ptr, const void *key, size_t len, size_t off)
+// a subtree of keys in [begin, end) that is built by a loader thread
+typedef struct art_task
+{
+  size_t    begin;
+  size_t    end;
+  size_t    off;
+  art_node *root;
+}art_task;
+
+typedef struct art_loader
+{
+  const void **keys;
+  const size_t *lens;
+  void **values;
+
+  size_t grain;     // key range no larger than this is built as a whole by one thread
+  int    assemble;  // 0: collect tasks, 1: assemble the top of art with built subtrees
+
+  art_task *tasks;
+  size_t    task_count;
+  size_t    task_cap;
+  size_t    next;   // next task to build or to assemble
+}art_loader;
+
+// return the first key in [begin, end) whose byte at `off` is greater than `byte`
+// require: keys in [begin, end) are sorted and all longer than `off`
+static size_t adaptive_radix_tree_upper_bound(art_loader *l, size_t begin, size_t end, size_t off,
+  unsigned char byte)
+{
+  while (begin < end) {
+    size_t mid = begin + (end - begin) / 2;
+    if (((const unsigned char *)l->keys[mid])[off] <= byte)
+      begin = mid + 1;
+    else
+      end = mid;
+  }
+  return begin;
+}
+
+// build subtree of keys in [begin, end) which share their first `off` bytes bottom up, return its root,
+// the top of art (`top` is 1) is split into tasks in collect phase, and assembled after tasks are built
+static art_node* adaptive_radix_tree_build(art_loader *l, size_t begin, size_t end, size_t off, int top)
+{
+  if (top && end - begin <= l->grain) {
+    if (l->assemble)
+      return l->tasks[l->next++].root;
+    if (l->task_count == l->task_cap) {
+      l->task_cap = l->task_cap ? l->task_cap * 2 : 64;
+      l->tasks = (art_task *)realloc(l->tasks, sizeof(art_task) * l->task_cap);
+    }
+    art_task *t = &l->tasks[l->task_count++];
+    t->begin = begin;
+    t->end = end;
+    t->off = off;
+    t->root = 0;
+    return 0;
+  }
+
+  // nothing is created when collecting tasks
+  int create = !top || l->assemble;
+
+  const unsigned char *k1 = (const unsigned char *)l->keys[begin], *k2 = (const unsigned char *)l->keys[end - 1];
+  size_t l1 = l->lens[begin], l2 = l->lens[end - 1], i;
+  // keys are sorted, so common prefix of the first and the last key is shared by all of them
+  for (i = off; i < l1 && i < l2 && k1[i] == k2[i]; ++i)
+    ;
+  // a single key, or duplicated keys and the first one wins
+  if (i == l1 && i == l2)
+    return create ? new_art_leaf(l->keys[begin], l1, l->values[begin]) : 0;
+
+  unsigned char bytes[256];
+  art_node *children[256];
+  int count = 0;
+  for (size_t b = begin; b < end; ++count) {
+    debug_assert(count < 256);
+    size_t e;
+    // key that ends here comes first and uses byte 0
+    if (l->lens[b] == i) {
+      for (e = b + 1; e < end && l->lens[e] == i; ++e)
+        ;
+      bytes[count] = 0;
+      children[count] = create ? new_art_leaf(l->keys[b], i, l->values[b]) : 0;
+    } else {
+      unsigned char byte = ((const unsigned char *)l->keys[b])[i];
+      // byte 0 is taken by the key that ends here
+      debug_assert(count == 0 || byte != 0);
+      e = adaptive_radix_tree_upper_bound(l, b, end, i, byte);
+      bytes[count] = byte;
+      children[count] = adaptive_radix_tree_build(l, b, e, i + 1, top);
+    }
+    b = e;
+  }
+
+  if (!create)
+    return 0;
+  return new_art_node_with_children(k1, off, i - off, bytes, children, count);
+}
+
+static void* adaptive_radix_tree_run_loader(void *arg)
+{
+  art_loader *l = (art_loader *)arg;
+  size_t i;
+  while ((i = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED)) < l->task_count) {
+    art_task *t = &l->tasks[i];
+    t->root = adaptive_radix_tree_build(l, t->begin, t->end, t->off, 0 /* top */);
+  }
+  return 0;
+}
+
+// load `n` sorted keys into an empty art with `threads` threads, keys are copied,
+// subtrees are built without any lock and nodes are created with their final size,
+// value of a duplicated key is the first one
+// return 0 on success
+// return 1 if art is not empty
+// require: no other thread modifies art during loading
+int adaptive_radix_tree_bulk_load(adaptive_radix_tree *art, const void **keys, const size_t *lens, void **values,
+  size_t n, int threads)
+{
+  if (art->root)
+    return 1;
+  if (n == 0)
+    return 0;
+
+  if (threads < 1)
+    threads = 1;
+
+  art_loader l;
+  l.keys = keys;
+  l.lens = lens;
+  l.values = values;
+  // several tasks per thread so that skewed subtrees are balanced
+  l.grain = n / ((size_t)threads * 16);
+  if (l.grain < 1024)
+    l.grain = 1024;
+  l.assemble = 0;
+  l.tasks = 0;
+  l.task_count = 0;
+  l.task_cap = 0;
+  l.next = 0;
+
+  adaptive_radix_tree_build(&l, 0, n, 0, 1 /* top */);
+
+  pthread_t ids[threads];
+  for (int i = 1; i < threads; ++i)
+    assert(pthread_create(&ids[i], 0, adaptive_radix_tree_run_loader, (void *)&l) == 0);
+  adaptive_radix_tree_run_loader((void *)&l);
+  for (int i = 1; i < threads; ++i)
+    assert(pthread_join(ids[i], 0) == 0);
+
+  l.assemble = 1;
+  l.next = 0;
+  art_node *root = adaptive_radix_tree_build(&l, 0, n, 0, 1 /* top */);
+  debug_assert(l.next == l.task_count);
+  free(l.tasks);
+
+  __atomic_store(&art->root, &root, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// return leaf if key exists, 0 if not, 1 for retry
+static art_node* _adaptive_radix_tree_get(art_node *parent, art_node **ptr, const void *key, size_t len, size_t off)
 {
   art_node *an;
 
@@ -220,20 +462,19 @@ static void* _adaptive_radix_tree_get(art_node *parent, art_node **ptr, const vo
     // we need to make sure that `ptr` is still valid because `parent` might changed
     uint64_t pv = art_node_get_version(parent);
     if (art_node_version_is_old(pv))
-      return (void *)1; // return 1 so that we can retry from root
+      return (art_node *)1; // return 1 so that we can retry from root
     // `ptr` is still valid, we can proceed
   }
   __atomic_load(ptr, &an, __ATOMIC_ACQUIRE);
 
+  // child has been removed by another thread
+  if (unlikely(an == 0))
+    return 0;
+
   if (unlikely(is_leaf(an))) {
-    const char *k1 = get_leaf_key(an), *k2 = (const char *)key;
-    size_t l1 = get_leaf_len(an), l2 = len, i;
-    for (i = off; i < l1 && i < l2 && k1[i] == k2[i]; ++i)
-      ;
-    if (i == l1 && i == l2)
-      return (void *)k1; // key exists
+    if (adaptive_radix_tree_leaf_match(an, key, len))
+      return an; // key exists
     // art_node_print(parent);
-    // print_key(k1, l1);
     // printf("off:%lu\n", off);
     return 0;
   }
@@ -244,7 +485,7 @@ static void* _adaptive_radix_tree_get(art_node *parent, art_node **ptr, const vo
   if (unlikely(art_node_version_is_old(v)))
     goto begin;
 
-  int p = art_node_prefix_compare(an, v, key, len, off);
+  int p = art_node_optimistic_prefix_compare(an, v, key, len, off);
 
   uint64_t v1 = art_node_get_version(an);
   if (unlikely(art_node_version_is_old(v1) || art_node_version_compare_expand(v, v1)))
@@ -264,8 +505,10 @@ static void* _adaptive_radix_tree_get(art_node *parent, art_node **ptr, const vo
 
   v1 = art_node_get_version(an);
 
-  if (unlikely(art_node_version_is_old(v1)))
+  if (unlikely(art_node_version_is_old(v1))) {
+    off -= art_node_version_get_prefix_len(v);
     goto begin;
+  }
 
   if (next)
     return _adaptive_radix_tree_get(an, next, key, len, off + advance);
@@ -275,13 +518,506 @@ static void* _adaptive_radix_tree_get(art_node *parent, art_node **ptr, const vo
   return 0;
 }
 
+// require: in critical section
+static inline art_node* adaptive_radix_tree_find_leaf(adaptive_radix_tree *art, const void *key, size_t len)
+{
+  art_node *leaf;
+  uint64_t restarts = 0;
+  while (unlikely((uintptr_t)(leaf = _adaptive_radix_tree_get(0, &art->root, key, len, 0)) == 1))
+    ++restarts;
+  if (unlikely(restarts))
+    adaptive_radix_tree_account(art, restarts);
+  return leaf;
+}
+
+// return value of the key, 0 if key does not exist
 void* adaptive_radix_tree_get(adaptive_radix_tree *art, const void *key, size_t len)
 {
-  void *ret;
+  void *ret = 0;
   if (unlikely(art->root == 0))
     return 0;
-  while (unlikely((uint64_t)(ret = _adaptive_radix_tree_get(0, &art->root, key, len, 0)) == 1))
-    ;
+  epoch_enter();
+  art_node *leaf = adaptive_radix_tree_find_leaf(art, key, len);
+  if (likely(leaf))
+    ret = art_leaf_get_value(leaf);
+  epoch_exit();
+  return ret;
+}
+
+// replace value of the key, old value is stored in `old` if it's not null
+// return 0 on success
+// return 1 on not existed
+int adaptive_radix_tree_update(adaptive_radix_tree *art, const void *key, size_t len, const void *value, void **old)
+{
+  int ret = 1;
+  epoch_enter();
+  art_node *leaf = adaptive_radix_tree_find_leaf(art, key, len);
+  if (likely(leaf)) {
+    void *prev = art_leaf_exchange_value(leaf, value);
+    if (old)
+      *old = prev;
+    ret = 0;
+  }
+  epoch_exit();
+  return ret;
+}
+
+// number of lookups that are interleaved in `adaptive_radix_tree_multi_get`
+#define multi_get_group 8
+
+#define lookup_node 0
+#define lookup_leaf 1
+
+// a lookup that is suspended on a node (or leaf) being prefetched
+typedef struct art_lookup
+{
+  int         stage;
+  size_t      idx;
+  const void *key;
+  size_t      len;
+  size_t      off;
+  art_node   *an;
+}art_lookup;
+
+static inline void adaptive_radix_tree_lookup_start(adaptive_radix_tree *art, art_lookup *l, size_t idx,
+  const void *key, size_t len)
+{
+  l->idx = idx;
+  l->key = key;
+  l->len = len;
+  l->off = 0;
+  __atomic_load(&art->root, &l->an, __ATOMIC_ACQUIRE);
+  l->stage = is_leaf(l->an) ? lookup_leaf : lookup_node;
+}
+
+// advance lookup `l` by one level, then prefetch the child so that it's in cache when we come back,
+// return 1 if the lookup is finished and `value` is set
+// require: in critical section
+static int adaptive_radix_tree_lookup_step(adaptive_radix_tree *art, art_lookup *l, void **value)
+{
+  art_node *an = l->an;
+
+  // art became empty
+  if (unlikely(an == 0)) {
+    *value = 0;
+    return 1;
+  }
+
+  if (l->stage == lookup_leaf) {
+    *value = adaptive_radix_tree_leaf_match(an, l->key, l->len) ? art_leaf_get_value(an) : 0;
+    return 1;
+  }
+
+  uint64_t v = art_node_get_stable_expand_version(an);
+  if (unlikely(art_node_version_get_offset(v) != l->off || art_node_version_is_old(v)))
+    goto fallback;
+
+  int p = art_node_optimistic_prefix_compare(an, v, l->key, l->len, l->off);
+
+  uint64_t v1 = art_node_get_version(an);
+  if (unlikely(art_node_version_is_old(v1) || art_node_version_compare_expand(v, v1)))
+    goto fallback;
+  v = v1;
+
+  if (p != art_node_version_get_prefix_len(v)) {
+    *value = 0;
+    return 1;
+  }
+
+  size_t off = l->off + art_node_version_get_prefix_len(v);
+  debug_assert(off <= l->len);
+
+  int advance = off != l->len;
+  unsigned char byte = advance ? ((unsigned char *)l->key)[off] : 0;
+
+  art_node **next = art_node_find_child(an, v, byte);
+  art_node *child = 0;
+  if (next)
+    __atomic_load(next, &child, __ATOMIC_ACQUIRE);
+
+  if (unlikely(art_node_version_is_old(art_node_get_version(an))))
+    goto fallback;
+
+  if (child == 0) {
+    *value = 0;
+    return 1;
+  }
+
+  l->off = off + advance;
+  l->an = child;
+  if (is_leaf(child)) {
+    if (!adaptive_radix_tree_leaf_may_match(child, l->key, l->len)) {
+      *value = 0;
+      return 1;
+    }
+    __builtin_prefetch(get_leaf(child), 0 /* rw */, 3 /* locality */);
+    l->stage = lookup_leaf;
+  } else {
+    art_node_prefetch(child);
+  }
+  return 0;
+
+  fallback: {
+    // node is being expanded or has been replaced, this is rare so just restart from root
+    art_node *leaf = adaptive_radix_tree_find_leaf(art, l->key, l->len);
+    *value = leaf ? art_leaf_get_value(leaf) : 0;
+    return 1;
+  }
+}
+
+// lookup `n` keys and store their values in `values`, 0 if key does not exist,
+// lookups are interleaved so that cache misses of different keys overlap
+void adaptive_radix_tree_multi_get(adaptive_radix_tree *art, const void **keys, const size_t *lens, size_t n,
+  void **values)
+{
+  if (unlikely(art->root == 0)) {
+    memset(values, 0, sizeof(void *) * n);
+    return ;
+  }
+
+  epoch_enter();
+
+  art_lookup group[multi_get_group];
+  int active = 0;
+  size_t next = 0;
+  for (; active < multi_get_group && next < n; ++active, ++next)
+    adaptive_radix_tree_lookup_start(art, &group[active], next, keys[next], lens[next]);
+
+  while (active) {
+    for (int i = 0; i < active; ) {
+      art_lookup *l = &group[i];
+      if (adaptive_radix_tree_lookup_step(art, l, &values[l->idx]) == 0) {
+        ++i;
+      } else if (next < n) {
+        adaptive_radix_tree_lookup_start(art, l, next, keys[next], lens[next]);
+        ++next;
+        ++i;
+      } else {
+        group[i] = group[--active];
+      }
+    }
+  }
+
+  epoch_exit();
+}
+
+// remove the child at `byte` from `an`, and put the replacement of `an` into its parent if there is one
+// require: `an` is locked, it's unlocked when this function returns
+static void adaptive_radix_tree_remove_child(adaptive_radix_tree *art, art_node *an, unsigned char byte,
+  const void *key)
+{
+  art_node *new;
+  if (likely(art_node_remove_child(an, byte, &new) == 0)) {
+    art_node_unlock(an);
+    return ;
+  }
+
+  // `an` is old now
+  size_t off = art_node_version_get_offset(art_node_get_version_unsafe(an));
+  art_node *parent = art_node_get_locked_parent(an);
+  if (likely(parent)) {
+    debug_assert(off);
+    unsigned char pbyte = ((unsigned char *)key)[off - 1];
+    if (likely(new)) {
+      art_node_replace_child(parent, pbyte, an, new);
+      art_node_unlock(parent);
+    } else {
+      // no child is left, remove `an` from its parent as well
+      adaptive_radix_tree_remove_child(art, parent, pbyte, key);
+    }
+  } else { // this is root
+    __atomic_store(&art->root, &new, __ATOMIC_RELEASE);
+  }
+  art_node_unlock(an);
+
+  epoch_retire(an, release_art_node);
+}
+
+// return  0 on success,
+// return +1 on not existed,
+// return -1 for retry
+static int _adaptive_radix_tree_delete(adaptive_radix_tree *art, art_node *parent, art_node **ptr,
+  const void *key, size_t len, size_t off)
+{
+  art_node *an;
+
+  int first = 1;
+  begin:
+  if (first)  {
+    first = 0;
+  } else if (parent) {
+    uint64_t pv = art_node_get_version(parent);
+    if (art_node_version_is_old(pv))
+      return -1;
+  }
+
+  __atomic_load(ptr, &an, __ATOMIC_ACQUIRE);
+
+  // node has been replaced by a leaf or removed, retry from root
+  if (unlikely(an == 0 || is_leaf(an)))
+    return -1;
+
+  uint64_t v = art_node_get_stable_expand_version(an);
+  if (unlikely(art_node_version_get_offset(v) != off))
+    goto begin;
+  if (unlikely(art_node_version_is_old(v)))
+    goto begin;
+
+  int p = art_node_optimistic_prefix_compare(an, v, key, len, off);
+
+  uint64_t v1 = art_node_get_version(an);
+  if (unlikely(art_node_version_is_old(v1) || art_node_version_compare_expand(v, v1)))
+    goto begin;
+  v = v1;
+
+  if (p != art_node_version_get_prefix_len(v))
+    return 1;
+
+  off += p;
+  debug_assert(off <= len);
+
+  int advance = off != len;
+  unsigned char byte = advance ? ((unsigned char *)key)[off] : 0;
+
+  art_node **next = art_node_find_child(an, v, byte);
+
+  v1 = art_node_get_version(an);
+  if (unlikely(art_node_version_is_old(v1))) {
+    off -= p;
+    goto begin;
+  }
+
+  if (next == 0)
+    return 1;
+
+  art_node *child;
+  __atomic_load(next, &child, __ATOMIC_ACQUIRE);
+  if (unlikely(child == 0))
+    return 1;
+
+  if (!is_leaf(child))
+    return _adaptive_radix_tree_delete(art, an, next, key, len, off + advance);
+
+  if (!adaptive_radix_tree_leaf_match(child, key, len))
+    return 1;
+
+  if (unlikely(art_node_lock(an))) {
+    off -= p;
+    goto begin;
+  }
+
+  // leaf might have been replaced before we acquire the lock
+  art_node *now;
+  __atomic_load(next, &now, __ATOMIC_ACQUIRE);
+  if (unlikely(now != child)) {
+    art_node_unlock(an);
+    off -= p;
+    goto begin;
+  }
+
+  adaptive_radix_tree_remove_child(art, an, byte, key);
+  epoch_retire(child, release_art_leaf);
+  return 0;
+}
+
+// return 0 on success
+// return 1 on not existed
+int adaptive_radix_tree_delete(adaptive_radix_tree *art, const void *key, size_t len)
+{
+  int ret;
+  uint64_t restarts = 0;
+  epoch_enter();
+  while (1) {
+    art_node *root;
+    __atomic_load(&art->root, &root, __ATOMIC_ACQUIRE);
+    if (unlikely(root == 0)) { // empty art
+      ret = 1;
+      break;
+    }
+    if (unlikely(is_leaf(root))) { // art with only one leaf
+      if (!adaptive_radix_tree_leaf_match(root, key, len)) {
+        ret = 1;
+        break;
+      }
+      if (__atomic_compare_exchange_n(&art->root, &root, 0, 0 /* weak */, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        epoch_retire(root, release_art_leaf);
+        ret = 0;
+        break;
+      }
+      continue;
+    }
+    // retry should be rare
+    if (likely((ret = _adaptive_radix_tree_delete(art, 0 /* parent */, &art->root, key, len, 0 /* off */)) != -1))
+      break;
+    ++restarts;
+  }
+  epoch_exit();
+  adaptive_radix_tree_account(art, restarts);
   return ret;
 }
 
+
+typedef struct art_scanner
+{
+  const unsigned char *start; // 0 means no lower bound
+  size_t start_len;
+  int exclusive;              // whether `start` itself is excluded
+  const unsigned char *end;   // 0 means no upper bound, `end` itself is always excluded
+  size_t end_len;
+  const void *last;           // last key visited, scan resumes from here after a conflict
+  size_t last_len;
+  size_t count;
+  art_scan_callback cb;
+  void *arg;
+}art_scanner;
+
+static inline int adaptive_radix_tree_key_compare(const void *k1, size_t l1, const void *k2, size_t l2)
+{
+  size_t len = l1 < l2 ? l1 : l2;
+  int r = memcmp(k1, k2, len);
+  if (r)
+    return r;
+  return l1 < l2 ? -1 : l1 > l2;
+}
+
+// return 0 to continue, 1 to stop
+static int adaptive_radix_tree_scan_leaf(art_scanner *s, art_node *leaf)
+{
+  const char *key = get_leaf_key(leaf);
+  size_t len = get_leaf_len(leaf);
+
+  if (s->start) {
+    int r = adaptive_radix_tree_key_compare(key, len, s->start, s->start_len);
+    if (r < 0 || (r == 0 && s->exclusive))
+      return 0;
+  }
+  if (s->end && adaptive_radix_tree_key_compare(key, len, s->end, s->end_len) >= 0)
+    return 1;
+
+  s->last = key;
+  s->last_len = len;
+  ++s->count;
+  return s->cb(s->arg, key, len, art_leaf_get_value(leaf)) != 0;
+}
+
+// `bounded` means path to `an` equals to `start`, so some children might be skipped
+// return  0 to continue,
+// return +1 to stop,
+// return -1 for retry
+static int _adaptive_radix_tree_scan(art_scanner *s, art_node *an, size_t off, int bounded)
+{
+  uint64_t v = art_node_get_stable_expand_version(an);
+  if (unlikely(art_node_version_is_old(v) || art_node_version_get_offset(v) != off))
+    return -1;
+
+  int prefix_len = art_node_version_get_prefix_len(v);
+  int skip = 0;
+  if (bounded) {
+    const unsigned char *prefix = (const unsigned char *)art_node_get_prefix(an, v);
+    int i = 0;
+    for (; i < prefix_len && off + i < s->start_len && prefix[i] == s->start[off + i]; ++i)
+      ;
+    if (i < prefix_len) {
+      if (off + i < s->start_len && prefix[i] < s->start[off + i])
+        skip = 1;    // every key in this node is smaller than `start`
+      else
+        bounded = 0; // every key in this node is bigger than `start`
+    }
+  }
+
+  int max = art_node_version_get_count(v);
+  unsigned char bytes[max + 1];
+  art_node *children[max + 1];
+  int count = art_node_get_children(an, v, bytes, children, max);
+
+  uint64_t v1 = art_node_get_version(an);
+  if (unlikely(art_node_version_is_old(v1) || art_node_version_compare_expand(v, v1)))
+    return -1;
+
+  if (skip)
+    return 0;
+
+  off += prefix_len;
+  int i = 0;
+  if (bounded) {
+    if (off < s->start_len)
+      for (; i < count && bytes[i] < s->start[off]; ++i)
+        ;
+    else
+      bounded = 0;
+  }
+
+  for (; i < count; ++i) {
+    art_node *child = children[i];
+    int ret;
+    if (is_leaf(child))
+      ret = adaptive_radix_tree_scan_leaf(s, child);
+    else
+      ret = _adaptive_radix_tree_scan(s, child, off + 1, bounded && bytes[i] == s->start[off]);
+    if (ret)
+      return ret;
+  }
+  return 0;
+}
+
+// visit keys in [start, end) in order, `start` or `end` can be 0 which means no bound,
+// keys inserted or deleted during the scan may or may not be visited,
+// `cb` is called inside critical section, so it should not block
+// return number of keys visited
+size_t adaptive_radix_tree_scan(adaptive_radix_tree *art, const void *start, size_t start_len,
+  const void *end, size_t end_len, art_scan_callback cb, void *arg)
+{
+  art_scanner s;
+  s.start = (const unsigned char *)start;
+  s.start_len = start_len;
+  s.exclusive = 0;
+  s.end = (const unsigned char *)end;
+  s.end_len = end_len;
+  s.last = 0;
+  s.last_len = 0;
+  s.count = 0;
+  s.cb = cb;
+  s.arg = arg;
+
+  uint64_t restarts = 0;
+  epoch_enter();
+  while (1) {
+    art_node *root;
+    __atomic_load(&art->root, &root, __ATOMIC_ACQUIRE);
+    if (unlikely(root == 0)) // empty art
+      break;
+    if (unlikely(is_leaf(root))) { // art with only one leaf
+      adaptive_radix_tree_scan_leaf(&s, root);
+      break;
+    }
+    if (likely(_adaptive_radix_tree_scan(&s, root, 0 /* off */, s.start != 0) != -1))
+      break;
+    ++restarts;
+    // node is changed by another thread, resume from last key visited
+    if (s.last) {
+      s.start = (const unsigned char *)s.last;
+      s.start_len = s.last_len;
+      s.exclusive = 1;
+    }
+  }
+  epoch_exit();
+  if (unlikely(restarts))
+    adaptive_radix_tree_account(art, restarts);
+  return s.count;
+}
+
+// visit keys that start with `prefix` in order
+size_t adaptive_radix_tree_prefix_scan(adaptive_radix_tree *art, const void *prefix, size_t len,
+  art_scan_callback cb, void *arg)
+{
+  // keys with `prefix` are smaller than `prefix` with its last non 0xff byte increased
+  unsigned char end[len + 1];
+  memcpy(end, prefix, len);
+  size_t end_len = len;
+  for (; end_len && end[end_len - 1] == 0xff; --end_len)
+    ;
+  if (end_len)
+    ++end[end_len - 1];
+
+  return adaptive_radix_tree_scan(art, prefix, len, end_len ? end : 0, end_len, cb, arg);
+}
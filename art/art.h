@@ -8,12 +8,40 @@
 #define _adaptive_radix_tree_h_
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct adaptive_radix_tree adaptive_radix_tree;
 
 adaptive_radix_tree* new_adaptive_radix_tree();
 void free_adaptive_radix_tree(adaptive_radix_tree *art);
-int adaptive_radix_tree_put(adaptive_radix_tree *art, const void *key, size_t len);
+// key is copied, its length should be no more than 32767
+int adaptive_radix_tree_put(adaptive_radix_tree *art, const void *key, size_t len, const void *value);
+// keys must be sorted, art must be empty
+int adaptive_radix_tree_bulk_load(adaptive_radix_tree *art, const void **keys, const size_t *lens, void **values,
+  size_t n, int threads);
 void* adaptive_radix_tree_get(adaptive_radix_tree *art, const void *key, size_t len);
+// lookup a batch of keys, value of `keys[i]` is stored in `values[i]`, 0 if it does not exist
+void adaptive_radix_tree_multi_get(adaptive_radix_tree *art, const void **keys, const size_t *lens, size_t n,
+  void **values);
+int adaptive_radix_tree_update(adaptive_radix_tree *art, const void *key, size_t len, const void *value,
+  void **old);
+int adaptive_radix_tree_delete(adaptive_radix_tree *art, const void *key, size_t len);
+
+// return non-zero to stop the scan
+typedef int (*art_scan_callback)(void *arg, const void *key, size_t len, void *value);
+
+size_t adaptive_radix_tree_scan(adaptive_radix_tree *art, const void *start, size_t start_len,
+  const void *end, size_t end_len, art_scan_callback cb, void *arg);
+size_t adaptive_radix_tree_prefix_scan(adaptive_radix_tree *art, const void *prefix, size_t len,
+  art_scan_callback cb, void *arg);
+
+// contention counters, they are cumulative since art is created
+typedef struct art_stats
+{
+  uint64_t lock_spins; // times a writer found a node locked and backed off
+  uint64_t restarts;   // times an operation restarted from root because a node on its path became old
+}art_stats;
+
+void adaptive_radix_tree_get_stats(adaptive_radix_tree *art, art_stats *stats);
 
 #endif /* _adaptive_radix_tree_h_ */
@@ -8,7 +8,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
-#include <emmintrin.h>
+#include <sched.h>
+#include <immintrin.h>
 
 #ifdef Debug
 #include <stdio.h>
@@ -27,8 +28,8 @@
 
 /**
  *   node version layout(64 bits)
- *       off               count    prefix_len              type  old  lock insert expand vinsert   vexpand
- *   |    8    |   8    |    8     |    8    |     10     |  2  |  1  |  1  |  1  |  1  |    8    |    8    |
+ *        off          count       prefix_len          type  old  lock insert expand vinsert   vexpand
+ *   |    15    |    9     |     15     |   2   |  2  |  1  |  1  |  1  |  1  |    8    |    8    |
  *
 **/
 
@@ -37,13 +38,14 @@
 #define INSERT_BIT ((uint64_t)1 << 17)
 #define EXPAND_BIT ((uint64_t)1 << 16)
 
-#define set_offset(version, offset)  (((version) & (~(((uint64_t)0xff) << 54))) | ((uint64_t)(offset) << 54))
-#define get_offset(version)          (size_t)(((version) >> 54) & 0xff)
-#define get_prefix_len(version)      (int)(((version) >> 32) & 0xff)
-#define set_prefix_len(version, len) (((version) & (~(((uint64_t)0xff) << 32))) | (((uint64_t)(len)) << 32))
-#define get_count(version)           (int)(((version) >> 40) & 0xff)
-#define set_count(version, count)    (((version) & (~(((uint64_t)0xff) << 40))) | (((uint64_t)(count)) << 40))
+#define set_offset(version, offset)  (((version) & (~(((uint64_t)0x7fff) << 49))) | ((uint64_t)(offset) << 49))
+#define get_offset(version)          (size_t)(((version) >> 49) & 0x7fff)
+#define get_prefix_len(version)      (int)(((version) >> 24) & 0x7fff)
+#define set_prefix_len(version, len) (((version) & (~(((uint64_t)0x7fff) << 24))) | (((uint64_t)(len)) << 24))
+#define get_count(version)           (int)(((version) >> 40) & 0x1ff)
+#define set_count(version, count)    (((version) & (~(((uint64_t)0x1ff) << 40))) | (((uint64_t)(count)) << 40))
 #define incr_count(version)          ((version) + ((uint64_t)1 << 40))
+#define decr_count(version)          ((version) - ((uint64_t)1 << 40))
 #define get_type(version)            (int)((version) & node256)
 #define set_type(version, type)      ((version) | type)
 
@@ -67,6 +69,10 @@
 #define get_vexpand(version)  ((int)((version) & 0xff))
 #define incr_vexpand(version) (((version) & ~((uint64_t)0xff)) | (((version) + 1) & 0xff)) // overflow is handled
 
+// only first 8 bytes of prefix are stored in node, full prefix length is kept in version,
+// prefix bytes beyond 8 are loaded from any leaf under the node when they are needed
+#define max_stored_prefix 8
+
 #define art_node_header \
   uint64_t version;     \
   char prefix[8];       \
@@ -113,6 +119,106 @@ typedef struct art_node256
   char meta[0];
 }art_node256;
 
+// whether avx2 can be used, it's detected at runtime so that the same binary runs everywhere
+static int has_avx2 = 0;
+
+void init_art_node()
+{
+  __builtin_cpu_init();
+  has_avx2 = __builtin_cpu_supports("avx2");
+}
+
+#ifdef Test
+void art_node_set_avx2(int enable)
+{
+  has_avx2 = enable && __builtin_cpu_supports("avx2");
+}
+#endif
+
+// return index of `byte` in the first `count` bytes of `key`, -1 if not found,
+// node4 and node16 share this 128 bit compare, it's safe for node4 since its keys are followed by children
+static inline int art_node_find_index(const unsigned char *key, int count, unsigned char byte)
+{
+  __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(byte), _mm_loadu_si128((__m128i *)key));
+  int bitfield = _mm_movemask_epi8(cmp) & ((1 << count) - 1);
+  return bitfield ? __builtin_ctz(bitfield) : -1;
+}
+
+// bit `i` of `bitmap` is set if there is a child at byte `i`, it saves us from testing 256 slots one by one
+
+static void art_node48_bitmap_sse2(const unsigned char *index, uint64_t *bitmap)
+{
+  __m128i zero = _mm_setzero_si128();
+  for (int i = 0; i < 4; ++i) {
+    uint64_t empty = 0;
+    for (int j = 0; j < 4; ++j) {
+      __m128i cmp = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(index + i * 64 + j * 16)), zero);
+      empty |= (uint64_t)(uint16_t)_mm_movemask_epi8(cmp) << (j * 16);
+    }
+    bitmap[i] = ~empty;
+  }
+}
+
+__attribute__((target("avx2")))
+static void art_node48_bitmap_avx2(const unsigned char *index, uint64_t *bitmap)
+{
+  __m256i zero = _mm256_setzero_si256();
+  for (int i = 0; i < 4; ++i) {
+    __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(index + i * 64)), zero);
+    __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(index + i * 64 + 32)), zero);
+    uint64_t empty = (uint64_t)(uint32_t)_mm256_movemask_epi8(lo) |
+      ((uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32);
+    bitmap[i] = ~empty;
+  }
+}
+
+static void art_node256_bitmap_scalar(art_node **child, uint64_t *bitmap)
+{
+  for (int i = 0; i < 4; ++i) {
+    uint64_t bits = 0;
+    for (int j = 0; j < 64; ++j)
+      bits |= (uint64_t)(child[i * 64 + j] != 0) << j;
+    bitmap[i] = bits;
+  }
+}
+
+__attribute__((target("avx2")))
+static void art_node256_bitmap_avx2(art_node **child, uint64_t *bitmap)
+{
+  __m256i zero = _mm256_setzero_si256();
+  for (int i = 0; i < 4; ++i) {
+    uint64_t empty = 0;
+    for (int j = 0; j < 64; j += 4) {
+      __m256i cmp = _mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i *)(child + i * 64 + j)), zero);
+      empty |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(cmp)) << j;
+    }
+    bitmap[i] = ~empty;
+  }
+}
+
+// children of node256 might be removed in place, so the bitmap is only a hint for concurrent readers,
+// they need to load the child again
+static inline void art_node_get_bitmap(art_node *an, uint64_t version, uint64_t *bitmap)
+{
+  if (get_type(version) == node48) {
+    if (has_avx2)
+      art_node48_bitmap_avx2(((art_node48 *)an)->index, bitmap);
+    else
+      art_node48_bitmap_sse2(((art_node48 *)an)->index, bitmap);
+  } else {
+    debug_assert(get_type(version) == node256);
+    if (has_avx2)
+      art_node256_bitmap_avx2(((art_node256 *)an)->child, bitmap);
+    else
+      art_node256_bitmap_scalar(((art_node256 *)an)->child, bitmap);
+  }
+}
+
+// iterate over bytes that have a child, `byte` is set in each iteration
+#define for_each_byte(bitmap, byte) \
+  for (int _i = 0; _i < 4; ++_i) \
+    for (uint64_t _bits = (bitmap)[_i]; _bits && ((byte) = _i * 64 + __builtin_ctzll(_bits), 1); _bits &= _bits - 1)
+
 inline uint64_t art_node_get_version(art_node *an)
 {
   uint64_t version;
@@ -135,9 +241,16 @@ inline void art_node_set_version_unsafe(art_node *an, uint64_t version)
   an->version = version;
 }
 
+// fetch version, prefix and keys of node4 and node16 (and their children) for read
+inline void art_node_prefetch(art_node *an)
+{
+  __builtin_prefetch((char *)an +  0, 0 /* rw */, 3 /* locality */);
+  __builtin_prefetch((char *)an + 64, 0 /* rw */, 3 /* locality */);
+}
+
 static inline void art_node_set_offset(art_node *an, size_t off)
 {
-  debug_assert(off < 256);
+  debug_assert(off <= art_max_key_len);
   an->version = set_offset(an->version, off);
 }
 
@@ -146,6 +259,11 @@ inline size_t art_node_version_get_offset(uint64_t version)
   return get_offset(version);
 }
 
+inline int art_node_version_get_count(uint64_t version)
+{
+  return get_count(version);
+}
+
 static inline art_node* _new_art_node(size_t size)
 {
   #ifdef Allocator
@@ -194,6 +312,44 @@ art_node* new_art_node()
   return new_art_node4();
 }
 
+// create a node with `count` children in byte order, node type is decided by `count` directly,
+// prefix is `prefix_len` bytes of `key` starting at `off`
+// require: no other thread can see the node or its children
+art_node* new_art_node_with_children(const void *key, size_t off, int prefix_len, const unsigned char *bytes,
+  art_node **children, int count)
+{
+  debug_assert(count > 0 && count <= 256);
+
+  art_node *an;
+  if (count <= 4) {
+    art_node4 *an4 = (art_node4 *)(an = new_art_node4());
+    memcpy(an4->key, bytes, count);
+    memcpy(an4->child, children, sizeof(art_node *) * count);
+  } else if (count <= 16) {
+    art_node16 *an16 = (art_node16 *)(an = new_art_node16());
+    memcpy(an16->key, bytes, count);
+    memcpy(an16->child, children, sizeof(art_node *) * count);
+  } else if (count <= 48) {
+    art_node48 *an48 = (art_node48 *)(an = new_art_node48());
+    for (int i = 0; i < count; ++i)
+      an48->index[bytes[i]] = i + 1;
+    memcpy(an48->child, children, sizeof(art_node *) * count);
+  } else {
+    art_node256 *an256 = (art_node256 *)(an = new_art_node256());
+    for (int i = 0; i < count; ++i)
+      an256->child[bytes[i]] = children[i];
+  }
+
+  for (int i = 0; i < count; ++i)
+    if (!is_leaf(children[i]))
+      children[i]->parent = an;
+
+  art_node_set_offset(an, off);
+  art_node_set_prefix(an, key, off, prefix_len);
+  an->version = set_count(an->version, count);
+  return an;
+}
+
 void free_art_node(art_node *an)
 {
   #ifdef Allocator
@@ -203,37 +359,78 @@ void free_art_node(art_node *an)
   #endif
 }
 
+art_node* new_art_leaf(const void *key, size_t len, const void *value)
+{
+  debug_assert(len <= art_max_key_len);
+  // long key needs 8 more bytes in front of the leaf to store its length
+  size_t extra = len < long_leaf ? 0 : 8;
+  #ifdef Allocator
+  char *ptr = (char *)allocator_alloc_small(extra + sizeof(art_leaf) + len);
+  #else
+  char *ptr = (char *)malloc(extra + sizeof(art_leaf) + len);
+  #endif
+  art_leaf *leaf = (art_leaf *)(ptr + extra);
+  debug_assert(((uintptr_t)leaf & 3) == 0);
+  leaf->value = (void *)value;
+  if (likely(extra == 0)) {
+    leaf->len = (unsigned char)len;
+  } else {
+    leaf->len = long_leaf;
+    ((uint32_t *)leaf)[-1] = (uint32_t)len;
+  }
+  memcpy(leaf->key, key, len);
+  // address with high bits in use can not carry a fingerprint
+  if (unlikely((uintptr_t)leaf & ~fingerprint_mask))
+    return (art_node *)make_leaf(leaf);
+  return (art_node *)make_fingerprint_leaf(leaf, art_key_fingerprint(key, len));
+}
+
+void free_art_leaf(art_node *leaf)
+{
+  debug_assert(is_leaf(leaf));
+  #ifdef Allocator
+  (void)leaf;
+  #else
+  art_leaf *l = get_leaf(leaf);
+  free((void *)((char *)l - (l->len == long_leaf ? 8 : 0)));
+  #endif
+}
+
+void* art_leaf_get_value(art_node *leaf)
+{
+  void *value;
+  __atomic_load(&get_leaf(leaf)->value, &value, __ATOMIC_ACQUIRE);
+  return value;
+}
+
+// return old value
+void* art_leaf_exchange_value(art_node *leaf, const void *value)
+{
+  return __atomic_exchange_n(&get_leaf(leaf)->value, (void *)value, __ATOMIC_ACQ_REL);
+}
+
 art_node** art_node_find_child(art_node *an, uint64_t version, unsigned char byte)
 {
   debug_assert(is_leaf(an) == 0);
 
   switch (get_type(version)) {
-  case node4: {
-    art_node4 *an4 = (art_node4*)an;
-    debug_assert(get_count(version) < 5);
-    for (int i = 0, count = get_count(version); i < count; ++i)
-      if (an4->key[i] == byte) {
-        debug_assert(an4->child[i]);
-        return &(an4->child[i]);
-      }
-  }
-  break;
+  case node4:
   case node16: {
-    art_node16 *an16 = (art_node16 *)an;
+    // node4 and node16 have the same layout except the size of key and child array
+    unsigned char *key;
+    art_node **child;
+    if (get_type(version) == node4) {
+      key = ((art_node4 *)an)->key;
+      child = ((art_node4 *)an)->child;
+    } else {
+      key = ((art_node16 *)an)->key;
+      child = ((art_node16 *)an)->child;
+    }
     debug_assert(get_count(version) < 17);
-    // for (int i = 0, count = get_count(version); i < count; ++i)
-    //  if (an16->key[i] == byte) {
-    //    debug_assert(an16->child[i]);
-    //    return &(an16->child[i]);
-    //  }
-    __m128i key = _mm_set1_epi8(byte);
-    __m128i key2 = _mm_loadu_si128((__m128i *)an16->key);
-    __m128i cmp = _mm_cmpeq_epi8(key, key2);
-    int mask = (1 << get_count(version)) - 1;
-    int bitfield = _mm_movemask_epi8(cmp) & mask;
-    if (bitfield) {
-      debug_assert(an16->child[__builtin_ctz(bitfield)]);
-      return &(an16->child[__builtin_ctz(bitfield)]);
+    int index = art_node_find_index(key, get_count(version), byte);
+    if (index >= 0) {
+      debug_assert(child[index]);
+      return &child[index];
     }
   }
   break;
@@ -259,6 +456,83 @@ art_node** art_node_find_child(art_node *an, uint64_t version, unsigned char byt
   return 0;
 }
 
+// collect at most `max` children of `an` in byte order, return number of children collected,
+// node4 and node16 are not ordered, so we sort them here instead of on every insert
+// caller should validate `version` afterwards
+int art_node_get_children(art_node *an, uint64_t version, unsigned char *bytes, art_node **children, int max)
+{
+  debug_assert(is_leaf(an) == 0);
+
+  int count = 0;
+  switch (get_type(version)) {
+  case node4:
+  case node16: {
+    unsigned char *key;
+    art_node **child;
+    if (get_type(version) == node4) {
+      key = ((art_node4 *)an)->key;
+      child = ((art_node4 *)an)->child;
+    } else {
+      key = ((art_node16 *)an)->key;
+      child = ((art_node16 *)an)->child;
+    }
+    int total = get_count(version);
+    total = total < max ? total : max;
+    // insertion sort is good enough for at most 16 children
+    for (int i = 0; i < total; ++i) {
+      unsigned char byte = key[i];
+      art_node *c = child[i];
+      int j = count++;
+      for (; j && bytes[j - 1] > byte; --j) {
+        bytes[j] = bytes[j - 1];
+        children[j] = children[j - 1];
+      }
+      bytes[j] = byte;
+      children[j] = c;
+    }
+  }
+  break;
+  case node48: {
+    art_node48 *an48 = (art_node48 *)an;
+    uint64_t bitmap[4];
+    art_node_get_bitmap(an, version, bitmap);
+    int i;
+    for_each_byte(bitmap, i) {
+      if (count == max)
+        break;
+      int index = an48->index[i];
+      // index might be changed after bitmap is built
+      if (index) {
+        bytes[count] = (unsigned char)i;
+        children[count++] = an48->child[index - 1];
+      }
+    }
+  }
+  break;
+  case node256: {
+    art_node256 *an256 = (art_node256 *)an;
+    uint64_t bitmap[4];
+    art_node_get_bitmap(an, version, bitmap);
+    int i;
+    for_each_byte(bitmap, i) {
+      if (count == max)
+        break;
+      art_node *child;
+      // child might be removed in place
+      __atomic_load(&an256->child[i], &child, __ATOMIC_ACQUIRE);
+      if (child) {
+        bytes[count] = (unsigned char)i;
+        children[count++] = child;
+      }
+    }
+  }
+  break;
+  default:
+    assert(0);
+  }
+  return count;
+}
+
 static inline void art_node_set_new_node(art_node *old, art_node *new)
 {
   __atomic_store(&old->new, &new, __ATOMIC_RELAXED);
@@ -316,14 +590,16 @@ static art_node* art_node_grow(art_node *an)
     debug_assert(get_count(version) == 48);
     memcpy(an256->prefix, an48->prefix, 8);
     an256->version = set_prefix_len(an256->version, get_prefix_len(version));
-    for (int i = 0; i < 256; ++i) {
+    uint64_t bitmap[4];
+    art_node_get_bitmap(an, version, bitmap);
+    int i;
+    for_each_byte(bitmap, i) {
       int index = an48->index[i];
-      if (index) {
-        an256->child[i] = an48->child[index - 1];
-        if (!is_leaf(an48->child[index - 1]))
-          an48->child[index - 1]->parent = new;
-      }
+      an256->child[i] = an48->child[index - 1];
+      if (!is_leaf(an48->child[index - 1]))
+        an48->child[index - 1]->parent = new;
     }
+    an256->version = set_count(an256->version, 48);
   }
   break;
   default:
@@ -362,8 +638,7 @@ art_node** art_node_add_child(art_node *an, unsigned char byte, art_node *child,
   case node4: {
     art_node4 *an4 = (art_node4 *)an;
     debug_assert(get_count(version) < 4);
-    for (int i = 0, count = get_count(version); i < count; ++i)
-      debug_assert(an4->key[i] != byte);
+    debug_assert(art_node_find_index(an4->key, get_count(version), byte) < 0);
     // no need to be ordered
     int count = get_count(version);
     an4->child[count] = child;
@@ -373,14 +648,7 @@ art_node** art_node_add_child(art_node *an, unsigned char byte, art_node *child,
   break;
   case node16: {
     art_node16 *an16 = (art_node16 *)an;
-    #ifdef Debug
-    __m128i key = _mm_set1_epi8(byte);
-    __m128i key2 = _mm_loadu_si128((__m128i *)an16->key);
-    __m128i cmp = _mm_cmpeq_epi8(key, key2);
-    int mask = (1 << get_count(version)) - 1;
-    int bitfield = _mm_movemask_epi8(cmp) & mask;
-    debug_assert(bitfield == 0);
-    #endif
+    debug_assert(art_node_find_index(an16->key, get_count(version), byte) < 0);
     // no need to be ordered
     int count = get_count(version);
     an16->child[count] = child;
@@ -401,6 +669,7 @@ art_node** art_node_add_child(art_node *an, unsigned char byte, art_node *child,
     art_node256 *an256 = (art_node256 *)an;
     debug_assert(an256->child[byte] == 0);
     an256->child[byte] = child;
+    an256->version = incr_count(version);
   }
   break;
   default:
@@ -429,18 +698,67 @@ inline int art_node_is_full(art_node *an)
 
 void art_node_set_prefix(art_node *an, const void *key, size_t off, int prefix_len)
 {
-  memcpy(an->prefix, (char *)key + off, prefix_len);
+  debug_assert(prefix_len <= art_max_key_len);
+  memcpy(an->prefix, (char *)key + off, prefix_len < max_stored_prefix ? prefix_len : max_stored_prefix);
   an->version = set_prefix_len(an->version, prefix_len);
 }
 
-// return the first offset that differs
+// find any leaf under `an`, all of them share `an`'s prefix
+static art_node* art_node_get_any_leaf(art_node *an)
+{
+  while (!is_leaf(an)) {
+    uint64_t version = art_node_get_version(an);
+    art_node *child = 0;
+    switch (get_type(version)) {
+    case node4:
+      child = ((art_node4 *)an)->child[0];
+    break;
+    case node16:
+      child = ((art_node16 *)an)->child[0];
+    break;
+    case node48:
+      child = ((art_node48 *)an)->child[0];
+    break;
+    case node256: {
+      art_node256 *an256 = (art_node256 *)an;
+      // child might be removed in place
+      for (int i = 0; i < 256 && child == 0; ++i)
+        __atomic_load(&an256->child[i], &child, __ATOMIC_ACQUIRE);
+    }
+    break;
+    default:
+      assert(0);
+    }
+    if (unlikely(child == 0))
+      return 0;
+    an = child;
+  }
+  return an;
+}
+
+// return full prefix of `an`, caller should validate `version` afterwards
+// require: in critical section, since a leaf might be used
+const char* art_node_get_prefix(art_node *an, uint64_t version)
+{
+  if (likely(get_prefix_len(version) <= max_stored_prefix))
+    return an->prefix;
+
+  art_node *leaf = art_node_get_any_leaf(an);
+  // node is being changed, let caller find out by validating version
+  if (unlikely(leaf == 0 || get_leaf_len(leaf) < get_offset(version) + get_prefix_len(version)))
+    return an->prefix;
+  return get_leaf_key(leaf) + get_offset(version);
+}
+
+// return the first offset that differs, full prefix is compared
 int art_node_prefix_compare(art_node *an, uint64_t version, const void *key, size_t len, size_t off)
 {
   debug_assert(off <= len);
 
   int prefix_len = get_prefix_len(version);
-  const char *prefix = an->prefix, *cur = (const char *)key;
-  debug_assert(prefix_len >= 0 && prefix_len <= 8);
+  const char *prefix = art_node_get_prefix(an, version), *cur = (const char *)key;
+  if (unlikely(prefix == an->prefix && prefix_len > max_stored_prefix))
+    prefix_len = max_stored_prefix; // no leaf is found, version check will fail
 
   int i = 0;
   for (; i < prefix_len && off < len; ++i, ++off) {
@@ -451,6 +769,28 @@ int art_node_prefix_compare(art_node *an, uint64_t version, const void *key, siz
   return i;
 }
 
+// only stored prefix is compared, the rest is assumed to be matched and must be verified against the leaf,
+// return the first offset that differs
+int art_node_optimistic_prefix_compare(art_node *an, uint64_t version, const void *key, size_t len, size_t off)
+{
+  debug_assert(off <= len);
+
+  int prefix_len = get_prefix_len(version);
+  int stored = prefix_len < max_stored_prefix ? prefix_len : max_stored_prefix;
+  const char *prefix = an->prefix, *cur = (const char *)key;
+
+  int i = 0;
+  for (; i < stored && off < len; ++i, ++off) {
+    if (prefix[i] != cur[off])
+      return i;
+  }
+  // key might be too short to match the whole prefix
+  if (i == stored && prefix_len > stored)
+    i = len - off < (size_t)(prefix_len - stored) ? stored + (int)(len - off) : prefix_len;
+
+  return i;
+}
+
 // require: node is locked
 unsigned char art_node_truncate_prefix(art_node *an, int off)
 {
@@ -460,15 +800,19 @@ unsigned char art_node_truncate_prefix(art_node *an, int off)
 
   debug_assert(off < get_prefix_len(version));
 
+  // node is locked, so full prefix is stable
+  int prefix_len = get_prefix_len(version);
+  const char *full = art_node_get_prefix(an, version);
+  char buf[max_stored_prefix];
+  int stored = prefix_len - off - 1 < max_stored_prefix ? prefix_len - off - 1 : max_stored_prefix;
+  memcpy(buf, full + off + 1, stored);
+  unsigned char ret = full[off];
+
   // mark expand bit before truncate prefix
   version = set_expand(version);
   art_node_set_version(an, version);
 
-  int prefix_len = get_prefix_len(version);
-  char *prefix = an->prefix;
-  unsigned char ret = prefix[off];
-  for (int i = 0, j = off + 1; j < prefix_len; ++i, ++j)
-    prefix[i] = prefix[j];
+  memcpy(an->prefix, buf, stored);
 
   version = set_prefix_len(version, prefix_len - off - 1);
   off += get_offset(version) + 1;
@@ -516,14 +860,42 @@ inline int art_node_version_compare_expand(uint64_t version1, uint64_t version2)
 //   return is_inserting(version1) != is_inserting(version2) || get_vinsert(version1) != get_vinsert(version2);
 // }
 
+// backoff of a waiter is doubled every time it finds the lock held, until it reaches this limit
+#define max_backoff 1024
+
+// number of times this thread found a node locked since last `art_node_take_lock_spins`
+static __thread uint64_t lock_spins = 0;
+
+uint64_t art_node_take_lock_spins()
+{
+  uint64_t spins = lock_spins;
+  lock_spins = 0;
+  return spins;
+}
+
+// waiters back off so that they don't keep stealing the cache line from lock holder,
+// yield cpu when lock is held for a long time since lock holder might not be running
+static inline void art_node_backoff(int *backoff)
+{
+  ++lock_spins;
+  if (*backoff < max_backoff) {
+    for (int i = 0; i < *backoff; ++i)
+      __asm__ volatile("pause" ::: "memory");
+    *backoff <<= 1;
+  } else {
+    sched_yield();
+  }
+}
+
 // return 0 on success, 1 on failure
 int art_node_lock(art_node *an)
 {
+  int backoff = 1;
   while (1) {
     // must use `acquire` operation to avoid deadlock
     uint64_t version = art_node_get_version(an);
     if (is_locked(version)) {
-      // __asm__ __volatile__ ("pause");
+      art_node_backoff(&backoff);
       continue;
     }
     if (unlikely(is_old(version)))
@@ -535,6 +907,16 @@ int art_node_lock(art_node *an)
   return 0;
 }
 
+// return 0 on success, 1 if node is locked or old, never spin
+static int art_node_try_lock(art_node *an)
+{
+  uint64_t version = art_node_get_version(an);
+  if (is_locked(version) || is_old(version))
+    return 1;
+  return !__atomic_compare_exchange_n(&an->version, &version, set_lock(version),
+    0 /* weak */, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
 static inline art_node* art_node_get_parent(art_node *an)
 {
   art_node *parent;
@@ -550,11 +932,15 @@ inline void art_node_set_parent_unsafe(art_node *an, art_node *parent)
 art_node* art_node_get_locked_parent(art_node *an)
 {
   art_node *parent;
+  int backoff = 1;
   while (1) {
     if ((parent = art_node_get_parent(an)) == 0)
       break;
-    if (unlikely(art_node_lock(parent)))
+    // parent is old, wait for the thread that replaced it to update our parent pointer
+    if (unlikely(art_node_lock(parent))) {
+      art_node_backoff(&backoff);
       continue;
+    }
     if (art_node_get_parent(an) == parent)
       break;
     art_node_unlock(parent);
@@ -586,12 +972,12 @@ int art_node_version_is_old(uint64_t version)
   return is_old(version);
 }
 
-art_node* art_node_replace_leaf_child(art_node *an, const void *key, size_t len, size_t off)
+art_node* art_node_replace_leaf_child(art_node *an, art_node *leaf, size_t off)
 {
-  debug_assert(is_leaf(an));
+  debug_assert(is_leaf(an) && is_leaf(leaf));
 
-  const char *k1 = get_leaf_key(an), *k2 = (const char *)key;
-  size_t l1 = get_leaf_len(an), l2 = len, i;
+  const char *k1 = get_leaf_key(an), *k2 = get_leaf_key(leaf);
+  size_t l1 = get_leaf_len(an), l2 = get_leaf_len(leaf), i;
   for (i = off; i < l1 && i < l2 && k1[i] == k2[i]; ++i)
     ;
   if (unlikely(i == l1 && i == l2))
@@ -600,32 +986,33 @@ art_node* art_node_replace_leaf_child(art_node *an, const void *key, size_t len,
   art_node *new = new_art_node();
   art_node_set_offset(new, off);
   assert(art_node_lock(new) == 0);
-  // TODO: i - off might be bigger than 8
-  assert(i - off <= 8);
   art_node_set_prefix(new, k1, off, i - off);
   off = i;
   unsigned char byte;
   byte = off == l1 ? 0 : k1[off];
   assert(art_node_add_child(new, byte, an, 0) == 0);
   byte = off == l2 ? 0 : k2[off];
-  assert(art_node_add_child(new, byte, (art_node *)make_leaf(k2), 0) == 0);
+  assert(art_node_add_child(new, byte, leaf, 0) == 0);
   art_node_unlock(new);
 
   return new;
 }
 
 // require: node is locked
-art_node* art_node_expand_and_insert(art_node *an, const void *key, size_t len, size_t off, int common)
+art_node* art_node_expand_and_insert(art_node *an, art_node *leaf, size_t off, int common)
 {
   debug_assert(is_locked(an->version));
 
+  const unsigned char *key = (const unsigned char *)get_leaf_key(leaf);
+  size_t len = get_leaf_len(leaf);
+
   art_node* new = new_art_node();
   art_node_set_offset(new, off);
   assert(art_node_lock(new) == 0);
   art_node_set_prefix(new, key, off, common);
   unsigned char byte;
-  byte = (off + common < len) ? ((unsigned char *)key)[off + common] : 0;
-  assert(art_node_add_child(new, byte, (art_node *)make_leaf(key), 0) == 0);
+  byte = (off + common < len) ? key[off + common] : 0;
+  assert(art_node_add_child(new, byte, leaf, 0) == 0);
   byte = art_node_truncate_prefix(an, common);
   assert(art_node_add_child(new, byte, an, 0) == 0);
   art_node_unlock(new);
@@ -645,7 +1032,168 @@ void art_node_replace_child(art_node *parent, unsigned char byte, art_node *old,
   debug_assert(child && *child == old);
 
   __atomic_store(child, &new, __ATOMIC_RELEASE);
-  new->parent = parent;
+  if (likely(!is_leaf(new)))
+    new->parent = parent;
+}
+
+static inline void art_node_copy_child(art_node *new, unsigned char byte, art_node *child)
+{
+  assert(art_node_add_child(new, byte, child, 0) == 0);
+  if (!is_leaf(child))
+    child->parent = new;
+}
+
+// copy all the children of `an` except the one at `byte` to `new`
+// require: node is locked
+static void art_node_copy_except(art_node *an, unsigned char byte, art_node *new)
+{
+  uint64_t version = an->version;
+
+  memcpy(new->prefix, an->prefix, 8);
+  new->version = set_prefix_len(new->version, get_prefix_len(version));
+  art_node_set_offset(new, get_offset(version));
+
+  assert(art_node_lock(new) == 0);
+  switch (get_type(version)) {
+  case node4: {
+    art_node4 *an4 = (art_node4 *)an;
+    for (int i = 0, count = get_count(version); i < count; ++i)
+      if (an4->key[i] != byte)
+        art_node_copy_child(new, an4->key[i], an4->child[i]);
+  }
+  break;
+  case node16: {
+    art_node16 *an16 = (art_node16 *)an;
+    for (int i = 0, count = get_count(version); i < count; ++i)
+      if (an16->key[i] != byte)
+        art_node_copy_child(new, an16->key[i], an16->child[i]);
+  }
+  break;
+  case node48: {
+    art_node48 *an48 = (art_node48 *)an;
+    uint64_t bitmap[4];
+    art_node_get_bitmap(an, version, bitmap);
+    int i;
+    for_each_byte(bitmap, i)
+      if (i != byte)
+        art_node_copy_child(new, (unsigned char)i, an48->child[an48->index[i] - 1]);
+  }
+  break;
+  case node256: {
+    art_node256 *an256 = (art_node256 *)an;
+    uint64_t bitmap[4];
+    art_node_get_bitmap(an, version, bitmap);
+    int i;
+    for_each_byte(bitmap, i)
+      if (i != byte)
+        art_node_copy_child(new, (unsigned char)i, an256->child[i]);
+  }
+  break;
+  default:
+    assert(0);
+  }
+  art_node_unlock(new);
+}
+
+// merge `an`'s prefix and `byte` into its only child's prefix, so that the child can take `an`'s place,
+// return 0 on success, 1 if child is busy or merged prefix length can not be represented
+// require: node is locked
+static int art_node_merge_prefix(art_node *an, unsigned char byte, art_node *child)
+{
+  // lock order is from child to parent, so don't wait here
+  if (art_node_try_lock(child))
+    return 1;
+
+  uint64_t version = child->version;
+  int plen = get_prefix_len(an->version), clen = get_prefix_len(version);
+  if (plen + 1 + clen > art_max_key_len) {
+    art_node_unlock(child);
+    return 1;
+  }
+
+  // mark expand bit before change prefix
+  version = set_expand(version);
+  art_node_set_version(child, version);
+
+  // only first 8 bytes of merged prefix are stored, which are all known here
+  char prefix[max_stored_prefix];
+  int n = plen < max_stored_prefix ? plen : max_stored_prefix;
+  memcpy(prefix, an->prefix, n);
+  if (n < max_stored_prefix)
+    prefix[n++] = byte;
+  for (int i = 0; i < clen && n < max_stored_prefix; ++i)
+    prefix[n++] = child->prefix[i];
+  memcpy(child->prefix, prefix, n);
+
+  version = set_prefix_len(version, plen + 1 + clen);
+  version = set_offset(version, get_offset(an->version));
+  art_node_set_version_unsafe(child, version);
+
+  art_node_unlock(child);
+  return 0;
+}
+
+// remove the child at `byte`, return 0 if it's removed in place,
+// otherwise `an` becomes old and `*new` is set to its replacement, which is a node without this child,
+// `an`'s only child left or 0 if no child is left
+// node256 shrinks to node48 with 37 children, node48 to node16 with 12, node16 to node4 with 3,
+// and node4 with only one child is collapsed into that child
+// require: node is locked
+int art_node_remove_child(art_node *an, unsigned char byte, art_node **new)
+{
+  debug_assert(is_leaf(an) == 0);
+
+  uint64_t version = an->version;
+  debug_assert(is_locked(version));
+
+  // number of children left
+  int count = get_count(version) - 1;
+
+  switch (get_type(version)) {
+  case node4: {
+    art_node4 *an4 = (art_node4 *)an;
+    if (count == 0) {
+      *new = 0;
+      break;
+    }
+    if (count == 1) {
+      int i = an4->key[0] == byte;
+      art_node *child = an4->child[i];
+      // root is only collapsed into a leaf, otherwise a thread holding the child might think the child
+      // is root and put its replacement into the old root, parent is stable since node is locked
+      if (is_leaf(child) || (an->parent && art_node_merge_prefix(an, an4->key[i], child) == 0)) {
+        *new = child;
+        break;
+      }
+    }
+    art_node_copy_except(an, byte, *new = new_art_node4());
+  }
+  break;
+  case node16:
+    art_node_copy_except(an, byte, *new = count <= 3 ? new_art_node4() : new_art_node16());
+  break;
+  case node48:
+    art_node_copy_except(an, byte, *new = count <= 12 ? new_art_node16() : new_art_node48());
+  break;
+  case node256: {
+    if (count <= 37) {
+      art_node_copy_except(an, byte, *new = new_art_node48());
+      break;
+    }
+    art_node256 *an256 = (art_node256 *)an;
+    debug_assert(an256->child[byte]);
+    art_node *empty = 0;
+    __atomic_store(&an256->child[byte], &empty, __ATOMIC_RELEASE);
+    an256->version = decr_count(version);
+    return 0;
+  }
+  default:
+    assert(0);
+  }
+
+  art_node_set_new_node(an, *new);
+  art_node_set_version(an, set_old(version));
+  return 1;
 }
 
 #ifdef Debug
@@ -663,7 +1211,7 @@ void art_node_print(art_node *an)
   printf("is_old:  %u\n", !!is_old(version));
   printf("is_expand:  %u  vexpand:  %u\n", !!is_expanding(version), get_vexpand(version));
   printf("prefix_len: %d\n", get_prefix_len(version));
-  for (int i = 0; i < get_prefix_len(version); ++i) {
+  for (int i = 0; i < get_prefix_len(version) && i < max_stored_prefix; ++i) {
     printf("%d ", (unsigned char)an->prefix[i]);
   }
   printf("\n");
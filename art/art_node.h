@@ -8,6 +8,8 @@
 #define _art_node_h_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #ifdef Debug
 #include <assert.h>
@@ -23,20 +25,69 @@
 
 typedef struct art_node art_node;
 
-#define is_leaf(ptr) ((uintptr_t)(ptr) & 1)
-#define make_leaf(ptr) ((uintptr_t)((const char *)(ptr) - 1) | 1)
-#define get_leaf_key(ptr) (((const char *)((uintptr_t)(ptr) & (~(uintptr_t)1))) + 1)
-#define get_leaf_len(ptr) ((size_t)*(char *)((uintptr_t)(ptr) & (~(uintptr_t)1)))
+// limited by bits of offset and prefix length in node version
+#define art_max_key_len 32767
 
+// leaf is owned by art, it's 8 bytes aligned so that the lowest bit of its address can be used as a tag,
+// length of a key with at least 255 bytes is stored in 4 bytes right before the leaf
+typedef struct art_leaf
+{
+  void          *value;
+  unsigned char  len;
+  char           key[];
+}art_leaf;
+
+#define long_leaf 0xff
+
+// bit 0 of a leaf pointer is the leaf tag, if bit 1 is also set, the unused high 16 bits of the pointer
+// hold a fingerprint of the leaf's key, so that most mismatched leaves are rejected without touching them
+#define leaf_tag          ((uintptr_t)1)
+#define fingerprint_tag   ((uintptr_t)2)
+#define fingerprint_shift 48
+#define fingerprint_mask  (((uintptr_t)1 << fingerprint_shift) - 1)
+
+#define is_leaf(ptr) ((uintptr_t)(ptr) & leaf_tag)
+#define make_leaf(ptr) ((uintptr_t)(ptr) | leaf_tag)
+#define make_fingerprint_leaf(ptr, fp) \
+  ((uintptr_t)(ptr) | leaf_tag | fingerprint_tag | ((uintptr_t)(fp) << fingerprint_shift))
+#define has_fingerprint(ptr) ((uintptr_t)(ptr) & fingerprint_tag)
+#define get_fingerprint(ptr) ((uint16_t)((uintptr_t)(ptr) >> fingerprint_shift))
+#define get_leaf(ptr) \
+  ((art_leaf *)((uintptr_t)(ptr) & (has_fingerprint(ptr) ? fingerprint_mask : ~(uintptr_t)0) & ~(uintptr_t)3))
+#define get_leaf_key(ptr) ((const char *)get_leaf(ptr)->key)
+#define get_leaf_len(ptr) \
+  (likely(get_leaf(ptr)->len != long_leaf) ? (size_t)get_leaf(ptr)->len : (size_t)((uint32_t *)get_leaf(ptr))[-1])
+
+// keys that reach the same leaf share their leading bytes, so only length and the last 8 bytes are hashed
+static inline uint16_t art_key_fingerprint(const void *key, size_t len)
+{
+  uint64_t tail = 0;
+  if (likely(len >= 8))
+    memcpy(&tail, (const char *)key + len - 8, 8);
+  else
+    memcpy(&tail, key, len);
+  return (uint16_t)(((tail ^ len) * 0x9e3779b97f4a7c15ULL) >> 48);
+}
+
+void init_art_node();
 art_node* new_art_node();
+art_node* new_art_node_with_children(const void *key, size_t off, int prefix_len, const unsigned char *bytes,
+  art_node **children, int count);
 void free_art_node(art_node *an);
+art_node* new_art_leaf(const void *key, size_t len, const void *value);
+void free_art_leaf(art_node *leaf);
+void* art_leaf_get_value(art_node *leaf);
+void* art_leaf_exchange_value(art_node *leaf, const void *value);
 art_node** art_node_add_child(art_node *an, unsigned char byte, art_node *child, art_node **new);
 art_node** art_node_find_child(art_node *an, uint64_t version, unsigned char byte);
+int art_node_get_children(art_node *an, uint64_t version, unsigned char *bytes, art_node **children, int max);
 int art_node_is_full(art_node *an);
 void art_node_set_prefix(art_node *an, const void *key, size_t off, int prefix_len);
-const char* art_node_get_prefix(art_node *an);
+const char* art_node_get_prefix(art_node *an, uint64_t version);
 int art_node_prefix_compare(art_node *an, uint64_t version, const void *key, size_t len, size_t off);
+int art_node_optimistic_prefix_compare(art_node *an, uint64_t version, const void *key, size_t len, size_t off);
 unsigned char art_node_truncate_prefix(art_node *an, int off);
+void art_node_prefetch(art_node *an);
 uint64_t art_node_get_version(art_node *an);
 uint64_t art_node_get_version_unsafe(art_node *an);
 uint64_t art_node_get_stable_expand_version(art_node *an);
@@ -45,14 +96,21 @@ int art_node_version_get_prefix_len(uint64_t version);
 int art_node_version_compare_expand(uint64_t version1, uint64_t version2);
 // int art_node_version_compare_insert(uint64_t version1, uint64_t version2);
 int art_node_lock(art_node *an);
+uint64_t art_node_take_lock_spins();
 art_node* art_node_get_locked_parent(art_node *an);
 void art_node_set_parent_unsafe(art_node *an, art_node *parent);
 void art_node_unlock(art_node *an);
 int art_node_version_is_old(uint64_t version);
-art_node* art_node_replace_leaf_child(art_node *an, const void *key, size_t len, size_t off);
+art_node* art_node_replace_leaf_child(art_node *an, art_node *leaf, size_t off);
 void art_node_replace_child(art_node *parent, unsigned char byte, art_node *old, art_node *new);
-art_node* art_node_expand_and_insert(art_node *an, const void *key, size_t len, size_t off, int common);
+int art_node_remove_child(art_node *an, unsigned char byte, art_node **new);
+art_node* art_node_expand_and_insert(art_node *an, art_node *leaf, size_t off, int common);
 size_t art_node_version_get_offset(uint64_t version);
+int art_node_version_get_count(uint64_t version);
+
+#ifdef Test
+void art_node_set_avx2(int enable);
+#endif
 
 #ifdef Debug
 void art_node_print(art_node *an);
@@ -13,28 +13,77 @@
 #include <endian.h>
 #endif
 #include <stdio.h>
+#include <sched.h>
+#include <immintrin.h>
+#if defined(Futex) && defined(__linux__)
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif // Futex
 
 #include "mass_node.h"
+#include "../util/epoch.h"
 
 #ifdef Allocator
 #include "../palm/allocator.h"
 #endif // Allocator
 
-#define max_key_count  15
-
 #define magic_unstable ((uint8_t)0x10)
 #define magic_link     ((uint8_t)0x20)
+#define magic_u64      ((uint8_t)0x40) // keyslice is the whole key and value is in `lv`, there is no suffix
+
+// only a key whose `keylen` is a slice length has a suffix in the bag
+#define has_suffix(keylen) ((keylen) <= sizeof(uint64_t))
+
+// `permutation` holds key count in the lowest `index_bits` bits, followed by slot of each key in key order
+#ifdef Wide
+typedef unsigned __int128 permutation_t;
+#define index_bits 5
+// slot `i` is at position `i`
+#define sequential_permutation \
+  ((((permutation_t)0x17b56939460f7358) << 64) | (permutation_t)0xb525073148310400)
+#else
+typedef uint64_t permutation_t;
+#define index_bits 4
+#define sequential_permutation ((permutation_t)0xedcba98765432100)
+#endif // Wide
 
-// `permutation` is uint64_t
-#define get_count(permutation) ((int)(permutation & 0xf))
-#define get_index(permutation, index) ((int)((permutation >> (((index) + 1) * 4)) & 0xf))
+#define index_mask ((1 << index_bits) - 1)
+
+#define get_count(permutation) ((int)((permutation) & index_mask))
+#define get_index(permutation, index) ((int)(((permutation) >> (((index) + 1) * index_bits)) & index_mask))
 #define update_permutation(permutation, index, value) { \
-  uint64_t mask = (((uint64_t)1) << (((index) + 1) * 4)) - 1; \
-  permutation = ((permutation & (~mask)) << 4) | (((uint64_t)(value)) << (((index) + 1) * 4)) | ((permutation & mask) + 1); \
+  permutation_t mask = (((permutation_t)1) << (((index) + 1) * index_bits)) - 1; \
+  permutation = ((permutation & (~mask)) << index_bits) | \
+    (((permutation_t)(value)) << (((index) + 1) * index_bits)) | ((permutation & mask) + 1); \
+}
+
+#define remove_permutation(permutation, index) { \
+  permutation_t mask = (((permutation_t)1) << (((index) + 1) * index_bits)) - 1; \
+  permutation = ((permutation >> index_bits) & (~mask)) | ((permutation & mask) - 1); \
 }
 
 #define set_sequential_permutation(permutation, count) \
-  (permutation = ((uint64_t)0xedcba98765432100) | (count))
+  (permutation = sequential_permutation | (count))
+
+// border mass_node moves keys from this position on to its new sibling when it splits
+#define border_split_point ((max_key_count + 1) / 2)
+// interior mass_node moves key at this position up to its parent when it splits
+#define interior_split_point (max_key_count / 2)
+
+// prefetch these cache lines of a mass_node to get its keyslices and children,
+// and these cache lines of a border mass_node to get its suffixes, lvs and values
+#ifdef Wide
+#define node_prefetch_lines   7
+#define border_prefetch_begin 256
+#define border_prefetch_lines 10
+#else
+#define node_prefetch_lines   4
+#define border_prefetch_begin 256
+#define border_prefetch_lines 4
+#endif // Wide
 
 // this is a little bit tricky, since both `interior_mass_node` and `border_mass_node`
 // start with `version` field, we can convert them to `mass_node` so that coding is easier
@@ -42,8 +91,8 @@ struct mass_node
 {
   uint32_t version;
   uint32_t removed;     // indicate empty slot
-  uint64_t permutation;
-  uint64_t keyslice[15];
+  permutation_t permutation;
+  uint64_t keyslice[max_key_count];
 
   struct mass_node *parent; // interior mass_node
 };
@@ -54,43 +103,57 @@ typedef struct interior_mass_node
   /* public fields */
   uint32_t version;
   uint32_t removed;
-  uint64_t permutation; // this field is uint8_t in the paper,
-                        // but it will generate too many intermediate states,
-                        // so I changed it to uint64_t, same as in border_mass_node
-  uint64_t keyslice[15];
+  permutation_t permutation; // this field is uint8_t in the paper,
+                             // but it will generate too many intermediate states,
+                             // so I changed it to uint64_t, same as in border_mass_node
+  uint64_t keyslice[max_key_count];
   mass_node *parent;
 
   /* private fields */
-  mass_node    *child[16];
+  mass_node    *child[max_key_count + 1];
 }interior_mass_node;
 
+// bytes of key suffixes in a border mass_node, each border mass_node has an inline bag right after it,
+// a bigger bag is allocated when it's full, and the old one is retired since readers might be using it
+typedef struct suffix_bag
+{
+  uint32_t size; // capacity of `data`
+  uint32_t used;
+  char     data[];
+}suffix_bag;
+
+#define inline_bag_size 128
+
 // see Mass Tree paper figure 2 for detail, mass_node structure is reordered for easy coding
 typedef struct border_mass_node
 {
   /* public fields */
   uint32_t version;
   uint32_t removed;
-  uint64_t permutation;
-  uint64_t keyslice[15];
+  permutation_t permutation;
+  uint64_t keyslice[max_key_count];
   mass_node *parent;
 
   /* private fields */
 
   uint8_t  padding; // for alignment
-  uint8_t  keylen[15];
+  uint8_t  keylen[max_key_count];
 
-  // TODO: memory usage optimization
-  // currently `suffix` stores the whole key,
+  // `suffix` points to key bytes after this keyslice in `bag`,
   // and if `lv` is not a link to next layer, it stores the length of the key in the first 4 bytes,
-  // and the offset in the next 4 bytes
-  void *suffix[15];
-  void *lv[15];
+  // and the offset in the next 4 bytes, in a `u64` mass tree `lv` is the value and there is no suffix
+  void *suffix[max_key_count];
+  void *lv[max_key_count];
+  void *value[max_key_count]; // value of the key, it's swapped atomically by update
 
   struct border_mass_node *prev;
   struct border_mass_node *next;
+
+  suffix_bag *bag;
 }border_mass_node;
 
-static int mass_node_get_count(mass_node *n);
+#define get_inline_bag(bn) ((suffix_bag *)((char *)(bn) + sizeof(border_mass_node)))
+
 
 static interior_mass_node* new_interior_mass_node()
 {
@@ -120,26 +183,30 @@ static void free_border_mass_node(border_mass_node *bn)
 #ifdef Allocator
   (void)bn;
 #else
-  int count = mass_node_get_count((mass_node *)bn);
+  permutation_t permutation = bn->permutation;
+  int count = get_count(permutation);
 
+  // slots are not continuous after split or remove
   for (int i = 0; i < count; ++i) {
-    assert(bn->keylen[i] != magic_unstable);
-    if (bn->keylen[i] == magic_link)
-      free_mass_node(bn->lv[i]);
-    else
-      free(bn->suffix[i]);
+    int index = get_index(permutation, i);
+    assert(bn->keylen[index] != magic_unstable);
+    if (bn->keylen[index] == magic_link)
+      free_mass_node(bn->lv[index]);
   }
 
+  if (bn->bag != get_inline_bag(bn))
+    free((void *)bn->bag);
   free((void *)bn);
 #endif // Allocator
 }
 
 static border_mass_node* new_border_mass_node()
 {
+  size_t size = sizeof(border_mass_node) + sizeof(suffix_bag) + inline_bag_size;
 #ifdef Allocator
-  border_mass_node *bn = (border_mass_node *)allocator_alloc(sizeof(border_mass_node));
+  border_mass_node *bn = (border_mass_node *)allocator_alloc(size);
 #else
-  border_mass_node *bn = (border_mass_node *)malloc(sizeof(border_mass_node));
+  border_mass_node *bn = (border_mass_node *)malloc(size);
 #endif // Allocator
 
   uint32_t version = 0;
@@ -153,26 +220,112 @@ static border_mass_node* new_border_mass_node()
 
   bn->parent = 0;
 
-  // set `bn->padding` and `bn->keylen[15]` to 0
-  memset(&bn->padding, 0, 16);
+  // set `bn->padding` and `bn->keylen` to 0
+  memset(&bn->padding, 0, 1 + max_key_count);
 
   // `bn->suffix` and `bn->lv` does not need initialization
 
   bn->prev = 0;
   bn->next = 0;
 
+  bn->bag = get_inline_bag(bn);
+  bn->bag->size = inline_bag_size;
+  bn->bag->used = 0;
+
   return bn;
 }
 
+static void release_suffix_bag(void *bag)
+{
+#ifdef Allocator
+  (void)bag;
+#else
+  free(bag);
+#endif // Allocator
+}
+
+static inline uint32_t border_mass_node_suffix_len(border_mass_node *bn, int index)
+{
+  uint32_t len = *(uint32_t *)&(bn->lv[index]);
+  uint32_t off = *((uint32_t *)&(bn->lv[index]) + 1);
+  return len - off;
+}
+
+// move suffixes of keys in `bn` to a new bag that has at least `need` free bytes, removed keys are dropped,
+// new bag might be smaller than the old one
+// require: `bn` is locked
+static void border_mass_node_grow_bag(border_mass_node *bn, uint32_t need)
+{
+  permutation_t permutation = bn->permutation;
+  int count = get_count(permutation);
+
+  uint32_t live = 0;
+  for (int i = 0; i < count; ++i) {
+    int index = get_index(permutation, i);
+    if (has_suffix(bn->keylen[index]))
+      live += border_mass_node_suffix_len(bn, index);
+  }
+
+  // size depends only on live suffixes, so that a bag shrinks back after keys are removed,
+  // half of it is left free so that it is not moved again soon
+  uint32_t size = inline_bag_size;
+  while (size < 2 * (live + need))
+    size *= 2;
+
+#ifdef Allocator
+  suffix_bag *bag = (suffix_bag *)allocator_alloc(sizeof(suffix_bag) + size);
+#else
+  suffix_bag *bag = (suffix_bag *)malloc(sizeof(suffix_bag) + size);
+#endif // Allocator
+  bag->size = size;
+  bag->used = 0;
+
+  // readers might still use the old bag, both have the same bytes
+  for (int i = 0; i < count; ++i) {
+    int index = get_index(permutation, i);
+    if (!has_suffix(bn->keylen[index]))
+      continue;
+    uint32_t len = border_mass_node_suffix_len(bn, index);
+    char *suffix = bag->data + bag->used;
+    memcpy(suffix, bn->suffix[index], len);
+    bag->used += len;
+    __atomic_store_n(&bn->suffix[index], (void *)suffix, __ATOMIC_RELEASE);
+  }
+
+  suffix_bag *old = bn->bag;
+  __atomic_store_n(&bn->bag, bag, __ATOMIC_RELEASE);
+  if (old != get_inline_bag(bn))
+    epoch_retire((void *)old, release_suffix_bag);
+}
+
+// copy `len1` bytes of `s1` followed by `len2` bytes of `s2` into bag of `bn`, return where they are,
+// slot that gets this suffix must not be visible yet or must be a link
+// require: `bn` is locked
+static void* border_mass_node_store_suffix(border_mass_node *bn, const void *s1, uint32_t len1, const void *s2,
+  uint32_t len2)
+{
+  uint32_t len = len1 + len2;
+  if (unlikely(bn->bag->used + len > bn->bag->size))
+    border_mass_node_grow_bag(bn, len);
+
+  char *suffix = bn->bag->data + bn->bag->used;
+  memcpy(suffix, s1, len1);
+  memcpy(suffix + len1, s2, len2);
+  bn->bag->used += len;
+  return (void *)suffix;
+}
+
 static void free_interior_mass_node(interior_mass_node *in)
 {
 #ifdef Allocator
   (void)in;
 #else
-  int count = mass_node_get_count((mass_node *)in);
+  permutation_t permutation = in->permutation;
+  int count = get_count(permutation);
 
+  free_mass_node(in->child[0]);
   for (int i = 0; i < count; ++i)
-    free_mass_node(in->child[i]);
+    free_mass_node(in->child[get_index(permutation, i) + 1]);
 
   free((void *)in);
 #endif // Allocator
@@ -198,10 +351,8 @@ inline void mass_node_prefetch(mass_node *n)
 {
   // 0 means for read,
   // 0 means mass_node has a low degree of temporal locality to stay in all levels of cache if possible
-  __builtin_prefetch((char *)n +   0, 0 /* rw */, 0 /* locality */);
-  __builtin_prefetch((char *)n +  64, 0 /* rw */, 0 /* locality */);
-  __builtin_prefetch((char *)n + 128, 0 /* rw */, 0 /* locality */);
-  __builtin_prefetch((char *)n + 192, 0 /* rw */, 0 /* locality */);
+  for (int i = 0; i < node_prefetch_lines; ++i)
+    __builtin_prefetch((char *)n + i * 64, 0 /* rw */, 0 /* locality */);
 }
 
 // fetch border mass_node `suffix` and `lv` for write
@@ -209,17 +360,17 @@ inline void border_mass_node_prefetch_write(mass_node *n)
 {
   // 0 means for read, 1 means for write
   // 0 means mass_node has a low degree of temporal locality to stay in all levels of cache if possible
-  __builtin_prefetch((char *)n + 256, 1 /* rw */, 0 /* locality */);
-  __builtin_prefetch((char *)n + 320, 1 /* rw */, 0 /* locality */);
+  for (int i = 0; i < border_prefetch_lines; ++i)
+    __builtin_prefetch((char *)n + border_prefetch_begin + i * 64, 1 /* rw */, 0 /* locality */);
 }
 
-// fetch border mass_node `suffix` and `lv` for read
+// fetch border mass_node `suffix`, `lv` and `value` for read
 inline void border_mass_node_prefetch_read(mass_node *n)
 {
   // 0 means for read, 1 means for write
   // 0 means mass_node has a low degree of temporal locality to stay in all levels of cache if possible
-  __builtin_prefetch((char *)n + 256, 0 /* rw */, 0 /* locality */);
-  __builtin_prefetch((char *)n + 320, 0 /* rw */, 0 /* locality */);
+  for (int i = 0; i < border_prefetch_lines; ++i)
+    __builtin_prefetch((char *)n + border_prefetch_begin + i * 64, 0 /* rw */, 0 /* locality */);
 }
 
 inline uint32_t mass_node_get_version(mass_node *n)
@@ -244,37 +395,63 @@ static inline void mass_node_set_version_unsafe(mass_node *n, uint32_t version)
   n->version = version;
 }
 
-static inline uint64_t mass_node_get_permutation(mass_node *n)
+#ifdef Wide
+
+// there is no plain 128 bit atomic load or store, but aligned 16 byte sse loads and stores are atomic
+// on processors that support avx, so readers never see half of a new permutation, `init_mass_node`
+// refuses to run on other processors
+static inline permutation_t mass_node_get_permutation(mass_node *n)
 {
-  uint64_t permutation;
-  __atomic_load(&n->permutation, &permutation, __ATOMIC_ACQUIRE);
+  __m128i v = _mm_load_si128((const __m128i *)&n->permutation);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  permutation_t permutation;
+  memcpy(&permutation, &v, sizeof(permutation));
   return permutation;
 }
 
-static inline uint64_t mass_node_get_permutation_unsafe(mass_node *n)
+static inline void mass_node_set_permutation(mass_node *n, permutation_t permutation)
 {
-  return n->permutation;
+  __m128i v;
+  memcpy(&v, &permutation, sizeof(permutation));
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  _mm_store_si128((__m128i *)&n->permutation, v);
 }
 
-static inline void mass_node_set_permutation(mass_node *n, uint64_t permutation)
+#else
+
+static inline permutation_t mass_node_get_permutation(mass_node *n)
+{
+  permutation_t permutation;
+  __atomic_load(&n->permutation, &permutation, __ATOMIC_ACQUIRE);
+  return permutation;
+}
+
+static inline void mass_node_set_permutation(mass_node *n, permutation_t permutation)
 {
   __atomic_store(&n->permutation, &permutation, __ATOMIC_RELEASE);
 }
 
-static inline void mass_node_set_permutation_unsafe(mass_node *n, uint64_t permutation)
+#endif // Wide
+
+static inline permutation_t mass_node_get_permutation_unsafe(mass_node *n)
+{
+  return n->permutation;
+}
+
+static inline void mass_node_set_permutation_unsafe(mass_node *n, permutation_t permutation)
 {
   n->permutation = permutation;
 }
 
-static inline int mass_node_get_count(mass_node *n)
+inline int mass_node_get_count(mass_node *n)
 {
-  uint64_t permutation = mass_node_get_permutation(n);
+  permutation_t permutation = mass_node_get_permutation(n);
   return get_count(permutation);
 }
 
 static inline int mass_node_get_count_unsafe(mass_node *n)
 {
-  uint64_t permutation = mass_node_get_permutation_unsafe(n);
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
   return get_count(permutation);
 }
 
@@ -285,7 +462,7 @@ inline mass_node* mass_node_get_parent(mass_node *n)
   return parent;
 }
 
-static inline void mass_node_set_parent(mass_node *n, mass_node *p)
+inline void mass_node_set_parent(mass_node *n, mass_node *p)
 {
   __atomic_store(&n->parent, &p, __ATOMIC_RELEASE);
 }
@@ -297,10 +474,72 @@ inline mass_node* mass_node_get_next(mass_node *n)
   return (mass_node *)next;
 }
 
+inline mass_node* mass_node_get_prev(mass_node *n)
+{
+  border_mass_node *prev;
+  __atomic_load(&((border_mass_node *)n)->prev, &prev, __ATOMIC_ACQUIRE);
+  return (mass_node *)prev;
+}
+
+// backoff of a waiter is doubled every time it finds `n` unchanged, until it reaches this limit
+#define max_backoff 1024
+
+// with `Futex`, a waiter sleeps at most this long in nanoseconds before it checks again, since a writer
+// might clear `WAIT_BIT` with a plain store and nobody would wake it up
+#define futex_timeout 100000
+
+// contention this thread has seen since last `mass_node_take_stats`
+static __thread mass_stats local_stats;
+
+// add contention this thread has seen to `stats` and reset it, return 0 if there is none
+int mass_node_take_stats(mass_stats *stats)
+{
+  if (likely(local_stats.lock_spins == 0 && local_stats.stable_waits == 0))
+    return 0;
+  stats->lock_spins   = local_stats.lock_spins;
+  stats->stable_waits = local_stats.stable_waits;
+  stats->stable_spins = local_stats.stable_spins;
+  stats->sleeps       = local_stats.sleeps;
+  memset(&local_stats, 0, sizeof(local_stats));
+  return 1;
+}
+
+// waiters back off so that they don't keep stealing the cache line from the thread modifying `n`,
+// which might be its hyperthread sibling, then yield cpu or sleep since that thread might not be running
+static void mass_node_backoff(mass_node *n, uint32_t version, int *backoff)
+{
+  if (*backoff < max_backoff) {
+    for (int i = 0; i < *backoff; ++i)
+      __asm__ volatile("pause" ::: "memory");
+    *backoff <<= 1;
+    return ;
+  }
+#if defined(Futex) && defined(__linux__)
+  // unlock wakes us up if it sees `WAIT_BIT`
+  if ((version & WAIT_BIT) || __atomic_compare_exchange_n(&n->version, &version, version | WAIT_BIT,
+    0 /* weak */, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    struct timespec timeout = {0, futex_timeout};
+    ++local_stats.sleeps;
+    syscall(SYS_futex, &n->version, FUTEX_WAIT_PRIVATE, version | WAIT_BIT, &timeout, 0, 0);
+  }
+#else
+  (void)n;
+  (void)version;
+  sched_yield();
+#endif // Futex
+}
+
 uint32_t mass_node_get_stable_version(mass_node *n)
 {
-  uint32_t version;
+  uint32_t version = mass_node_get_version(n);
+  if (likely(!is_inserting(version) && !is_spliting(version)))
+    return version;
+
+  ++local_stats.stable_waits;
+  int backoff = 1;
   do {
+    ++local_stats.stable_spins;
+    mass_node_backoff(n, version, &backoff);
     version = mass_node_get_version(n);
   } while (is_inserting(version) || is_spliting(version));
   return version;
@@ -340,11 +579,13 @@ void mass_node_unlock_unsafe(mass_node *n)
 
 void mass_node_lock(mass_node *n)
 {
+  int backoff = 1;
   while (1) {
     // must use `acquire` operation to avoid deadlock
     uint32_t version = mass_node_get_version(n);
     if (is_locked(version)) {
-      // __asm__ __volatile__ ("pause");
+      ++local_stats.lock_spins;
+      mass_node_backoff(n, version, &backoff);
       continue;
     }
     if (__atomic_compare_exchange_n(&n->version, &version, set_lock(version),
@@ -369,7 +610,14 @@ void mass_node_unlock(mass_node *n)
     version = unset_split(version);
   }
 
+#if defined(Futex) && defined(__linux__)
+  // `WAIT_BIT` might be set after we read `version`
+  uint32_t old = __atomic_exchange_n(&n->version, unset_wait(unset_lock(version)), __ATOMIC_RELEASE);
+  if (unlikely(old & WAIT_BIT))
+    syscall(SYS_futex, &n->version, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+#else
   mass_node_set_version(n, unset_lock(version));
+#endif // Futex
 }
 
 mass_node* mass_node_get_locked_parent(mass_node *n)
@@ -386,6 +634,42 @@ mass_node* mass_node_get_locked_parent(mass_node *n)
   return parent;
 }
 
+// `prev` pointer of a border mass_node is protected by the lock of its predecessor, lock order among
+// siblings is from right to left
+mass_node* mass_node_get_locked_prev(mass_node *n)
+{
+  mass_node *prev;
+  while (1) {
+    if ((prev = mass_node_get_prev(n)) == 0)
+      break;
+    mass_node_lock(prev);
+    if (mass_node_get_prev(n) == prev)
+      break;
+    mass_node_unlock(prev);
+  }
+  return prev;
+}
+
+// require: `n` is locked
+void mass_node_set_deleted(mass_node *n)
+{
+  mass_node_set_version(n, set_delete(mass_node_get_version_unsafe(n)));
+}
+
+// remove border mass_node `n` from the linked list, `n` keeps its links so that readers can still move on
+// require: `n` and its predecessor are locked
+void mass_node_unlink(mass_node *n)
+{
+  border_mass_node *bn = (border_mass_node *)n;
+  border_mass_node *prev = bn->prev, *next = bn->next;
+  assert(prev && is_locked(mass_node_get_version_unsafe((mass_node *)prev)));
+
+  __atomic_store(&prev->next, &next, __ATOMIC_RELEASE);
+  // `next->prev` is protected by the lock of `n`
+  if (next)
+    __atomic_store(&next->prev, &prev, __ATOMIC_RELEASE);
+}
+
 // require: `n` is locked
 inline int mass_node_is_full(mass_node *n)
 {
@@ -397,6 +681,158 @@ inline int mass_compare_key(uint64_t k1, uint64_t k2)
   return (k1 > k2) - (k2 > k1);
 }
 
+// whether avx2 can be used, it's detected at runtime so that the same binary runs everywhere,
+// -1 means not detected yet
+static int has_avx2 = -1;
+
+void init_mass_node()
+{
+  if (has_avx2 != -1)
+    return ;
+  __builtin_cpu_init();
+#ifdef Wide
+  // a torn permutation is silently wrong, so do not go on without atomic 16 byte loads and stores
+  if (!__builtin_cpu_supports("avx")) {
+    fprintf(stderr, "mass tree built with `Wide` requires a processor that supports avx\n");
+    abort();
+  }
+  has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2") ? 1 : 0;
+#else
+  has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif // Wide
+}
+
+#ifdef Test
+void mass_node_set_avx2(int enable)
+{
+  __builtin_cpu_init();
+  has_avx2 = enable && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+}
+#endif
+
+static inline int mass_node_lower_bound_scalar(const uint64_t *keyslice, permutation_t permutation, uint64_t cur,
+  int *index)
+{
+  int low = 0, high = get_count(permutation) - 1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    int i = get_index(permutation, mid);
+    int r = mass_compare_key(keyslice[i], cur);
+    if (r < 0) {
+      low  = mid + 1;
+    } else if (r > 0) {
+      high = mid - 1;
+    } else {
+      *index = i;
+      return mid;
+    }
+  }
+  *index = -1;
+  return low;
+}
+
+#ifdef Wide
+
+// spread bit `i` of `mask` to byte `i`, which is 0xff if it's set
+__attribute__((target("avx2")))
+static inline __m256i mass_node_mask_to_bytes(uint32_t mask)
+{
+  __m256i bit = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+  __m256i spread = _mm256_shuffle_epi8(_mm256_set1_epi32((int)mask),
+    _mm256_set_epi64x(0x0303030303030303LL, 0x0202020202020202LL, 0x0101010101010101LL, 0));
+  return _mm256_cmpeq_epi8(_mm256_and_si256(spread, bit), bit);
+}
+
+// byte shuffle does not cross 128 bit lanes, so look up slots lower than 16 and the others separately
+__attribute__((target("avx2")))
+static inline uint32_t mass_node_mask_in_key_order(uint32_t mask, __m256i slot, __m256i high)
+{
+  __m256i flag = mass_node_mask_to_bytes(mask);
+  __m256i lo = _mm256_shuffle_epi8(_mm256_permute2x128_si256(flag, flag, 0x00), slot);
+  __m256i hi = _mm256_shuffle_epi8(_mm256_permute2x128_si256(flag, flag, 0x11), slot);
+  return (uint32_t)_mm256_movemask_epi8(_mm256_blendv_epi8(lo, hi, high));
+}
+
+// compare `cur` with all 24 slots at once, there is no unsigned 64 bit compare, so flip the sign bit of
+// both sides to make a signed compare work, then shuffle the result into key order by `permutation`
+__attribute__((target("avx2,bmi2,popcnt")))
+static int mass_node_lower_bound_avx2(const uint64_t *keyslice, permutation_t permutation, uint64_t cur, int *index)
+{
+  __m256i bias = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+  __m256i key = _mm256_xor_si256(_mm256_set1_epi64x((long long)cur), bias);
+  uint32_t less = 0, equal = 0;
+  for (int i = 0; i < max_key_count; i += 4) {
+    __m256i ks = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keyslice + i)), bias);
+    less  |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(key, ks))) << i;
+    equal |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(key, ks))) << i;
+  }
+
+  // byte `i` is the slot of `i`th key, each 8 slots of 5 bits are deposited into 8 bytes
+  uint64_t spread = 0x1f1f1f1f1f1f1f1fULL;
+  __m256i slot = _mm256_set_epi64x(0,
+    (long long)_pdep_u64((uint64_t)(permutation >> (17 * index_bits)), spread),
+    (long long)_pdep_u64((uint64_t)(permutation >> (9 * index_bits)), spread),
+    (long long)_pdep_u64((uint64_t)(permutation >> index_bits), spread));
+  __m256i high = _mm256_cmpgt_epi8(slot, _mm256_set1_epi8(15));
+
+  uint32_t valid = ((uint32_t)1 << get_count(permutation)) - 1;
+  less  = mass_node_mask_in_key_order(less, slot, high) & valid;
+  equal = mass_node_mask_in_key_order(equal, slot, high) & valid;
+
+  *index = equal ? get_index(permutation, __builtin_ctz(equal)) : -1;
+  return __builtin_popcount(less);
+}
+
+#else
+
+// spread bit `i` of `mask` to byte `i`, which is 0xff if it's set
+__attribute__((target("avx2")))
+static inline __m128i mass_node_mask_to_bytes(uint32_t mask)
+{
+  __m128i bit = _mm_set1_epi64x((long long)0x8040201008040201ULL);
+  __m128i spread = _mm_shuffle_epi8(_mm_cvtsi32_si128((int)mask), _mm_set_epi64x(0x0101010101010101LL, 0));
+  return _mm_cmpeq_epi8(_mm_and_si128(spread, bit), bit);
+}
+
+// compare `cur` with all 15 slots at once, there is no unsigned 64 bit compare, so flip the sign bit of
+// both sides to make a signed compare work, then shuffle the result into key order by `permutation`,
+// slot 15 does not exist, it reads the field right after `keyslice` and is never in `permutation`
+__attribute__((target("avx2,popcnt")))
+static int mass_node_lower_bound_avx2(const uint64_t *keyslice, permutation_t permutation, uint64_t cur, int *index)
+{
+  __m256i bias = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+  __m256i key = _mm256_xor_si256(_mm256_set1_epi64x((long long)cur), bias);
+  uint32_t less = 0, equal = 0;
+  for (int i = 0; i < 16; i += 4) {
+    __m256i ks = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keyslice + i)), bias);
+    less  |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(key, ks))) << i;
+    equal |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(key, ks))) << i;
+  }
+
+  // byte `i` is the slot of `i`th key
+  __m128i nibble = _mm_cvtsi64_si128((long long)(permutation >> 4));
+  __m128i low = _mm_set1_epi8(0x0f);
+  __m128i slot = _mm_unpacklo_epi8(_mm_and_si128(nibble, low), _mm_and_si128(_mm_srli_epi16(nibble, 4), low));
+
+  uint32_t valid = ((uint32_t)1 << get_count(permutation)) - 1;
+  less  = (uint32_t)_mm_movemask_epi8(_mm_shuffle_epi8(mass_node_mask_to_bytes(less), slot)) & valid;
+  equal = (uint32_t)_mm_movemask_epi8(_mm_shuffle_epi8(mass_node_mask_to_bytes(equal), slot)) & valid;
+
+  *index = equal ? get_index(permutation, __builtin_ctz(equal)) : -1;
+  return __builtin_popcount(less);
+}
+
+#endif // Wide
+
+// return position in `permutation` of the first key not less than `cur`,
+// `index` is set to slot of the key equal to `cur`, -1 if there isn't one
+static inline int mass_node_lower_bound(mass_node *n, permutation_t permutation, uint64_t cur, int *index)
+{
+  if (has_avx2 == 1)
+    return mass_node_lower_bound_avx2(n->keyslice, permutation, cur, index);
+  return mass_node_lower_bound_scalar(n->keyslice, permutation, cur, index);
+}
+
 inline uint64_t get_next_keyslice(const void *key, uint32_t len, uint32_t off)
 {
   uint64_t cur = 0;
@@ -442,16 +878,27 @@ static inline uint64_t get_next_keyslice_and_advance_and_record(const void *key,
   return htobe64(cur);
 }
 
-// require: `n` is border mass_node
+// require: `n` is border mass_node and has a predecessor
 int mass_node_include_key(mass_node *n, uint64_t cur)
 {
-  int index = get_index(mass_node_get_permutation(n), 0);
-  // lower key must be at index 0
-  assert(index == 0);
-
+  // lower key is always at slot 0, even if it has been removed
   return mass_compare_key(n->keyslice[0], cur) <= 0;
 }
 
+// lower key of `n`, it's meaningless for the first border mass_node of a layer
+uint64_t mass_node_get_lower_key(mass_node *n)
+{
+  return n->keyslice[0];
+}
+
+// require: `n` is interior mass_node
+inline mass_node* mass_node_get_first_child(mass_node *n)
+{
+  mass_node *c;
+  __atomic_load(&((interior_mass_node *)n)->child[0], &c, __ATOMIC_ACQUIRE);
+  return c;
+}
+
 // require: `n` is locked and is interior mass_node
 inline void mass_node_set_first_child(mass_node *n, mass_node *c)
 {
@@ -464,14 +911,16 @@ inline void mass_node_set_first_child(mass_node *n, mass_node *c)
 }
 
 // require: `n` is locked and is border mass_node
-int mass_node_get_conflict_key_index(mass_node *n, const void *key, uint32_t len, uint32_t off, void **ckey, uint32_t *clen)
+// `csuffix` is set to bytes of the conflict key after this keyslice
+int mass_node_get_conflict_key_index(mass_node *n, const void *key, uint32_t len, uint32_t off, void **csuffix,
+  uint32_t *clen, void **cval)
 {
   uint32_t version = mass_node_get_version_unsafe(n);
   assert(is_locked(version) && is_border(version));
 
   uint64_t cur = get_next_keyslice(key, len, off);
 
-  uint64_t permutation = mass_node_get_permutation_unsafe(n);
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
   int count = get_count(permutation);
 
   assert(count);
@@ -488,8 +937,9 @@ int mass_node_get_conflict_key_index(mass_node *n, const void *key, uint32_t len
   assert(i != count);
 
   border_mass_node *bn = (border_mass_node *)n;
-  *ckey = bn->suffix[index];
+  *csuffix = bn->suffix[index];
   *clen = *(uint32_t *)&(bn->lv[index]);
+  *cval = bn->value[index];
 
   return index;
 }
@@ -518,19 +968,37 @@ void mass_node_replace_at_index(mass_node *n, int index, mass_node *n1)
   __atomic_store(&bn->keylen[index], &link, __ATOMIC_RELEASE);
 }
 
-// require: `n` is locked and is border mass_node
+// `c1` takes place of child `c`, they cover the same key range
+// require: `n` is locked
 void mass_node_swap_child(mass_node *n, mass_node *c, mass_node *c1)
 {
   uint32_t version = mass_node_get_version_unsafe(n);
-  assert(is_locked(version) && is_border(version));
+  assert(is_locked(version));
 
-  uint64_t permutation = mass_node_get_permutation_unsafe(n);
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
   int count = get_count(permutation);
 
-  assert(count);
-
   // just do a linear search
   int i = 0, index;
+  if (is_interior(version)) {
+    interior_mass_node *in = (interior_mass_node *)n;
+    index = 0;
+    if (in->child[0] != c) {
+      for (; i < count; ++i)
+        if (in->child[get_index(permutation, i) + 1] == c)
+          break;
+      // must have this child
+      assert(i != count);
+      index = get_index(permutation, i) + 1;
+    }
+    mass_node_set_parent(c1, n);
+    // readers might get either of them
+    __atomic_store(&in->child[index], &c1, __ATOMIC_RELEASE);
+    return ;
+  }
+
+  assert(count);
+
   border_mass_node *bn = (border_mass_node *)n;
   for (; i < count; ++i) {
     index = get_index(permutation, i);
@@ -550,25 +1018,13 @@ mass_node* mass_node_descend(mass_node *n, uint64_t cur)
   uint32_t version = mass_node_get_version_unsafe(n);
   assert(is_interior(version));
 
-  uint64_t permutation = mass_node_get_permutation(n);
-
-  int first = 0, count = get_count(permutation);
-  while (count > 0) {
-    int half = count >> 1;
-    int middle = first + half;
-
-    int index = get_index(permutation, middle);
+  permutation_t permutation = mass_node_get_permutation(n);
 
-    int r = mass_compare_key(n->keyslice[index], cur);
-    if (r <= 0) {
-      first = middle + 1;
-      count -= half + 1;
-    } else {
-      count = half;
-    }
-  }
+  // number of keys not bigger than `cur`
+  int index, first = mass_node_lower_bound(n, permutation, cur, &index);
+  if (index >= 0) ++first;
 
-  int index = likely(first) ? (get_index(permutation, first - 1) + 1) : 0;
+  index = likely(first) ? (get_index(permutation, first - 1) + 1) : 0;
 
   return ((interior_mass_node *)n)->child[index];
 }
@@ -579,24 +1035,14 @@ void interior_mass_node_insert(mass_node *n, uint64_t key, mass_node *child)
   uint32_t version = mass_node_get_version_unsafe(n);
   assert(is_locked(version) && is_interior(version));
 
-  uint64_t permutation = mass_node_get_permutation_unsafe(n);
-  int low = 0, count = get_count(permutation), high = count - 1;
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
+  int count = get_count(permutation);
   assert(count < max_key_count);
 
-  while (low <= high) {
-    int mid = (low + high) / 2;
-
-    int index = get_index(permutation, mid);
-
-    int r = mass_compare_key(n->keyslice[index], key);
-    assert(r);
-    if (r < 0)
-      low  = mid + 1;
-    else // r > 0
-      high = mid - 1;
-  }
-
   int index;
+  int low = mass_node_lower_bound(n, permutation, key, &index);
+  assert(index == -1);
+
   // now get physical slot
   if (n->removed) {
     index = ffs(n->removed) - 1;
@@ -621,6 +1067,29 @@ void interior_mass_node_insert(mass_node *n, uint64_t key, mass_node *child)
 // if existed, return 0;
 // if need to go to a deeper layer, return that layer's pointer;
 // if need to create a new layer, return -1
+// get a physical slot for keyslice `cur`, return -1 if there is none
+// require: `bn` is locked and has less than `max_key_count` keys
+static inline int border_mass_node_get_slot(border_mass_node *bn, uint32_t version, uint64_t cur, int count)
+{
+  mass_node *n = (mass_node *)bn;
+  int index;
+  uint32_t removed = n->removed;
+  // slot 0 keeps lower key of a border mass_node with a predecessor, only the same keyslice can reuse it
+  if (bn->prev && n->keyslice[0] != cur)
+    removed &= ~(uint32_t)1;
+  if (removed) {
+    index = ffs(removed) - 1;
+    n->removed &= ~((uint32_t)(1 << index));
+    mass_node_set_version(n, set_insert(version));
+  } else {
+    index = count + __builtin_popcount(n->removed);
+    // only slot 0 is empty
+    if (index == max_key_count)
+      return -1;
+  }
+  return index;
+}
+
 void* border_mass_node_insert(mass_node *n, const void *key, uint32_t len, uint32_t off, const void *val, int is_link)
 {
   uint32_t version = mass_node_get_version_unsafe(n);
@@ -631,36 +1100,26 @@ void* border_mass_node_insert(mass_node *n, const void *key, uint32_t len, uint3
   uint8_t keylen;
   uint64_t cur = get_next_keyslice_and_advance_and_record(key, len, &off, &keylen);
 
-  uint64_t permutation = mass_node_get_permutation_unsafe(n);
-  int low = 0, count = get_count(permutation), high = count - 1;
-
-  while (low <= high) {
-    int mid = (low + high) / 2;
-
-    int index = get_index(permutation, mid);
-
-    int r = mass_compare_key(n->keyslice[index], cur);
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
+  int count = get_count(permutation);
 
-    if (r < 0) {
-      low  = mid + 1;
-    } else if (r > 0) {
-      high = mid - 1;
+  int index;
+  int low = mass_node_lower_bound(n, permutation, cur, &index);
+  if (index >= 0) {
+    uint8_t status = bn->keylen[index];
+    assert(status != magic_unstable);
+    if (status == magic_link) {
+      // need to go to a deeper layer
+      return bn->lv[index];
     } else {
-      uint8_t status = bn->keylen[index];
-      assert(status != magic_unstable);
-      if (status == magic_link) {
-        // need to go to a deeper layer
-        return bn->lv[index];
-      } else {
-        uint32_t clen = *(uint32_t *)&(bn->lv[index]);
-        uint32_t coff = *((uint32_t *)&(bn->lv[index]) + 1);
-        assert(coff == off);
-        if (clen == len && !memcmp((char *)key + off, (char *)(bn->suffix[index]) + off, len - off))
-          // key existed
-          return (void *)0;
-        // need to create a deeper layer
-        return (void *)-1;
-      }
+      uint32_t clen = *(uint32_t *)&(bn->lv[index]);
+      uint32_t coff = *((uint32_t *)&(bn->lv[index]) + 1);
+      assert(coff == off);
+      if (clen == len && !memcmp((char *)key + off, bn->suffix[index], len - off))
+        // key existed
+        return (void *)0;
+      // need to create a deeper layer
+      return (void *)-1;
     }
   }
 
@@ -668,21 +1127,16 @@ void* border_mass_node_insert(mass_node *n, const void *key, uint32_t len, uint3
   if (count == max_key_count)
     return (void *)-2;
 
-  // now get physical slot
-  int index;
-  if (n->removed) {
-    index = ffs(n->removed) - 1;
-    n->removed &= ~((uint32_t)(1 << index));
-    mass_node_set_version(n, set_insert(version));
-  } else {
-    index = count;
-  }
+  index = border_mass_node_get_slot(bn, version, cur, count);
+  if (index < 0)
+    return (void *)-2;
 
   bn->keyslice[index] = cur;
 
   if (likely(is_link == 0)) {
     bn->keylen[index] = keylen;
-    bn->suffix[index] = (void *)key;
+    bn->suffix[index] = border_mass_node_store_suffix(bn, (char *)key + off, len - off, 0, 0);
+    bn->value[index] = (void *)val;
     uint32_t *len_ptr = (uint32_t *)&(bn->lv[index]);
     uint32_t *off_ptr = len_ptr + 1;
     *len_ptr = len;
@@ -702,82 +1156,431 @@ void* border_mass_node_insert(mass_node *n, const void *key, uint32_t len, uint3
 }
 
 // require: `n` is border mass_node
-void* mass_node_search(mass_node *n, uint64_t cur, void **value)
+void* mass_node_search(mass_node *n, uint64_t cur, void **suffix, void **value)
 {
   uint32_t version = mass_node_get_version_unsafe(n);
   assert(is_border(version));
 
-  *value = 0;
+  *suffix = 0;
 
-  uint64_t permutation = mass_node_get_permutation(n);
+  permutation_t permutation = mass_node_get_permutation(n);
 
-  int low = 0, high = get_count(permutation) - 1;
-  while (low <= high) {
-    int mid = (low + high) / 2;
+  int index;
+  mass_node_lower_bound(n, permutation, cur, &index);
+  if (index < 0)
+    return 0;
 
-    int index = get_index(permutation, mid);
+  border_mass_node *bn = (border_mass_node *)n;
+  uint8_t status;
+  __atomic_load(&bn->keylen[index], &status, __ATOMIC_ACQUIRE);
+  if (unlikely(status == magic_unstable))
+    // has intermediate state, need to retry
+    return (void *)1;
+  if (status != magic_link) {
+    // NOTE: if we put key info within suffix, things will be easier
+    *suffix = bn->suffix[index];
+    __atomic_load(&bn->value[index], value, __ATOMIC_ACQUIRE);
+  }
+  return bn->lv[index];
+}
 
-    int r = mass_compare_key(n->keyslice[index], cur);
+// copy keys of border mass_node `n` in key order, `suffix[i]` is 0 if it's a link and `lv[i]` is the
+// deeper layer, otherwise `lv[i]` holds key length and offset and `value[i]` is its value;
+// return number of keys, -1 if a key is being modified
+// NOTE: caller must validate version of `n` after this call
+int border_mass_node_get_keys(mass_node *n, uint64_t *keyslice, void **suffix, void **lv, void **value)
+{
+  assert(is_border(mass_node_get_version_unsafe(n)));
 
-    if (r < 0) {
-      low  = mid + 1;
-    } else if (r > 0) {
-      high = mid - 1;
-    } else {
-      border_mass_node *bn = (border_mass_node *)n;
-      uint8_t status;
-      __atomic_load(&bn->keylen[index], &status, __ATOMIC_ACQUIRE);
-      if (unlikely(status == magic_unstable))
-        // has intermediate state, need to retry
-        return (void *)1;
-      if (status != magic_link)
-        // NOTE: if we put key info within suffix, things will be easier
-        *value = bn->suffix[index];
-      return bn->lv[index];
-    }
+  border_mass_node *bn = (border_mass_node *)n;
+  permutation_t permutation = mass_node_get_permutation(n);
+  int count = get_count(permutation);
+
+  for (int i = 0; i < count; ++i) {
+    int index = get_index(permutation, i);
+    uint8_t status;
+    __atomic_load(&bn->keylen[index], &status, __ATOMIC_ACQUIRE);
+    if (unlikely(status == magic_unstable))
+      return -1;
+    keyslice[i] = n->keyslice[index];
+    suffix[i] = status == magic_link ? 0 : bn->suffix[index];
+    lv[i] = bn->lv[index];
+    __atomic_load(&bn->value[index], &value[i], __ATOMIC_ACQUIRE);
+  }
+  return count;
+}
+
+// find `key` in border mass_node `n`, return its position, -1 if it does not exist,
+// `link` is set if need to go to a deeper layer
+// require: `n` is locked and is border mass_node
+static int border_mass_node_find(mass_node *n, const void *key, uint32_t len, uint32_t off, void **link)
+{
+  border_mass_node *bn = (border_mass_node *)n;
+
+  uint64_t cur = get_next_keyslice_and_advance(key, len, &off);
+
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
+
+  int index;
+  int i = mass_node_lower_bound(n, permutation, cur, &index);
+  if (index < 0)
+    return -1;
+
+  uint8_t status = bn->keylen[index];
+  assert(status != magic_unstable);
+  if (status == magic_link) {
+    *link = bn->lv[index];
+    return -1;
+  }
+  uint32_t clen = *(uint32_t *)&(bn->lv[index]);
+  if (clen != len || memcmp((char *)key + off, bn->suffix[index], len - off))
+    return -1;
+  return i;
+}
+
+// require: `n` is locked and is border mass_node
+// if key is removed, return 1, its suffix is dropped when bag grows;
+// if key does not exist, return 0;
+// if need to go to a deeper layer, return that layer's pointer
+void* border_mass_node_remove(mass_node *n, const void *key, uint32_t len, uint32_t off)
+{
+  uint32_t version = mass_node_get_version_unsafe(n);
+  assert(is_locked(version) && is_border(version));
+
+  void *link = 0;
+  int i = border_mass_node_find(n, key, len, off, &link);
+  if (link)
+    return link;
+  if (i < 0)
+    return (void *)0;
+
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
+  int index = get_index(permutation, i);
+
+  // slot might be reused, readers must notice it
+  mass_node_set_version(n, set_insert(version));
+  remove_permutation(permutation, i);
+  mass_node_set_permutation(n, permutation);
+  n->removed |= (uint32_t)1 << index;
+  return (void *)1;
+}
+
+// require: `n` is locked and is border mass_node
+// if value is replaced, return 1 and `old` is set to previous value if it's not null;
+// if key does not exist, return 0;
+// if need to go to a deeper layer, return that layer's pointer
+void* border_mass_node_update(mass_node *n, const void *key, uint32_t len, uint32_t off, const void *val,
+  void **old)
+{
+  assert(is_locked(mass_node_get_version_unsafe(n)) && is_border(mass_node_get_version_unsafe(n)));
+
+  void *link = 0;
+  int i = border_mass_node_find(n, key, len, off, &link);
+  if (link)
+    return link;
+  if (i < 0)
+    return (void *)0;
+
+  border_mass_node *bn = (border_mass_node *)n;
+  int index = get_index(mass_node_get_permutation_unsafe(n), i);
+
+  // readers get either old value or new value, so version is not changed and they don't need to retry
+  void *prev = __atomic_exchange_n(&bn->value[index], (void *)val, __ATOMIC_ACQ_REL);
+  if (old)
+    *old = prev;
+  return (void *)1;
+}
+
+// require: `n` is locked and is border mass_node of a `u64` mass tree
+// return 1 if `key` is inserted, 0 if it existed, -2 if `n` is full
+int border_mass_node_insert_u64(mass_node *n, uint64_t key, const void *val)
+{
+  uint32_t version = mass_node_get_version_unsafe(n);
+  assert(is_locked(version) && is_border(version));
+
+  border_mass_node *bn = (border_mass_node *)n;
+
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
+  int count = get_count(permutation);
+
+  int index;
+  int low = mass_node_lower_bound(n, permutation, key, &index);
+  if (index >= 0)
+    return 0;
+
+  if (count == max_key_count)
+    return -2;
+
+  index = border_mass_node_get_slot(bn, version, key, count);
+  if (index < 0)
+    return -2;
+
+  bn->keyslice[index] = key;
+  bn->keylen[index] = magic_u64;
+  bn->suffix[index] = 0;
+  bn->lv[index] = (void *)val;
+
+  update_permutation(permutation, low, index);
+  mass_node_set_permutation(n, permutation);
+
+  return 1;
+}
+
+// require: `n` is border mass_node of a `u64` mass tree
+// return 1 and set `value` if `key` exists, otherwise return 0
+// NOTE: caller must validate version of `n` after this call
+int mass_node_search_u64(mass_node *n, uint64_t key, void **value)
+{
+  assert(is_border(mass_node_get_version_unsafe(n)));
+
+  permutation_t permutation = mass_node_get_permutation(n);
+
+  int index;
+  mass_node_lower_bound(n, permutation, key, &index);
+  if (index < 0)
+    return 0;
+
+  __atomic_load(&((border_mass_node *)n)->lv[index], value, __ATOMIC_ACQUIRE);
+  return 1;
+}
+
+// require: `n` is locked and is border mass_node of a `u64` mass tree
+// return 1 if `key` is removed, 0 if it does not exist
+int border_mass_node_remove_u64(mass_node *n, uint64_t key)
+{
+  uint32_t version = mass_node_get_version_unsafe(n);
+  assert(is_locked(version) && is_border(version));
+
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
+
+  int index;
+  int i = mass_node_lower_bound(n, permutation, key, &index);
+  if (index < 0)
+    return 0;
+
+  // slot might be reused, readers must notice it
+  mass_node_set_version(n, set_insert(version));
+  remove_permutation(permutation, i);
+  mass_node_set_permutation(n, permutation);
+  n->removed |= (uint32_t)1 << index;
+  return 1;
+}
+
+// require: `n` is locked and is border mass_node of a `u64` mass tree
+// return 1 if value is replaced and `old` is set to previous value if it's not null, 0 if `key` does not exist
+int border_mass_node_update_u64(mass_node *n, uint64_t key, const void *val, void **old)
+{
+  assert(is_locked(mass_node_get_version_unsafe(n)) && is_border(mass_node_get_version_unsafe(n)));
+
+  int index;
+  mass_node_lower_bound(n, mass_node_get_permutation_unsafe(n), key, &index);
+  if (index < 0)
+    return 0;
+
+  // readers get either old value or new value, so version is not changed and they don't need to retry
+  void *prev = __atomic_exchange_n(&((border_mass_node *)n)->lv[index], (void *)val, __ATOMIC_ACQ_REL);
+  if (old)
+    *old = prev;
+  return 1;
+}
+
+// require: `n` is locked and is border mass_node
+static int border_mass_node_find_link(border_mass_node *bn, mass_node *child, int *index)
+{
+  permutation_t permutation = mass_node_get_permutation_unsafe((mass_node *)bn);
+  int count = get_count(permutation);
+
+  int i = 0;
+  for (; i < count; ++i) {
+    *index = get_index(permutation, i);
+    if (bn->keylen[*index] == magic_link && bn->lv[*index] == (void *)child)
+      break;
   }
+
+  // must have this child
+  assert(i != count);
+  return i;
+}
+
+// remove the link to `child`, which is an empty layer
+// require: `n` is locked and is border mass_node
+void border_mass_node_remove_link(mass_node *n, mass_node *child)
+{
+  uint32_t version = mass_node_get_version_unsafe(n);
+  assert(is_locked(version) && is_border(version));
+
+  int index;
+  int i = border_mass_node_find_link((border_mass_node *)n, child, &index);
+
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
+  mass_node_set_version(n, set_insert(version));
+  remove_permutation(permutation, i);
+  mass_node_set_permutation(n, permutation);
+  n->removed |= (uint32_t)1 << index;
+}
+
+// replace the link to `child`, which is a layer with only one key, with that key,
+// return 0 on success, 1 if that key is also a link
+// require: `n` and `child` are locked and are border mass_node
+int border_mass_node_replace_link(mass_node *n, mass_node *child)
+{
+  uint32_t version = mass_node_get_version_unsafe(n);
+  assert(is_locked(version) && is_border(version));
+
+  border_mass_node *cbn = (border_mass_node *)child;
+  permutation_t cpermutation = mass_node_get_permutation_unsafe(child);
+  assert(get_count(cpermutation) == 1);
+  int cindex = get_index(cpermutation, 0);
+  if (cbn->keylen[cindex] == magic_link)
+    return 1;
+
+  border_mass_node *bn = (border_mass_node *)n;
+  int index;
+  border_mass_node_find_link(bn, child, &index);
+
+  uint32_t clen = *(uint32_t *)&(cbn->lv[cindex]);
+  uint32_t coff = *((uint32_t *)&(cbn->lv[cindex]) + 1);
+
+  // suffix in this layer is keyslice in `child` followed by suffix in `child`
+  uint64_t slice = htobe64(child->keyslice[cindex]);
+  void *suffix = border_mass_node_store_suffix(bn, &slice, cbn->keylen[cindex], cbn->suffix[cindex], clen - coff);
+
+  // a reader that has seen the link might read the new `lv` as a layer root, it must retry
+  mass_node_set_version(n, set_insert(version));
+
+  uint8_t unstable = magic_unstable;
+  __atomic_store(&bn->keylen[index], &unstable, __ATOMIC_RELEASE);
+
+  bn->suffix[index] = suffix;
+  bn->value[index] = cbn->value[cindex];
+  uint32_t *len_ptr = (uint32_t *)&(bn->lv[index]);
+  uint32_t *off_ptr = len_ptr + 1;
+  *len_ptr = clen;
+  // key has a whole keyslice in this layer, it ends where keyslice in `child` starts
+  *off_ptr = coff - cbn->keylen[cindex];
+
+  uint8_t keylen = sizeof(uint64_t);
+  __atomic_store(&bn->keylen[index], &keylen, __ATOMIC_RELEASE);
   return 0;
 }
 
+// remove `child` and its lower key, its key range is merged into its left sibling, if `child` is the first
+// child, the second child becomes the first one and its lower key is removed, key range of `child` is merged
+// into the left neighbour of `n` in this case, caller must have replaced lower key of `n` in its ancestor
+// require: `n` is locked and is interior mass_node and has more than one child
+void interior_mass_node_remove(mass_node *n, mass_node *child)
+{
+  uint32_t version = mass_node_get_version_unsafe(n);
+  assert(is_locked(version) && is_interior(version));
+
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
+  int count = get_count(permutation);
+  assert(count);
+
+  interior_mass_node *in = (interior_mass_node *)n;
+  int i = 0, index;
+  if (in->child[0] == child) {
+    // a reader that has descended from an ancestor before the lower key of `n` changed must not go on,
+    // it might be on the left of the second child
+    mass_node_set_version(n, set_split(version));
+    index = get_index(permutation, 0);
+    __atomic_store(&in->child[0], &in->child[index + 1], __ATOMIC_RELEASE);
+  } else {
+    for (; i < count; ++i) {
+      index = get_index(permutation, i);
+      if (in->child[index + 1] == child)
+        break;
+    }
+
+    // must have this child
+    assert(i != count);
+
+    mass_node_set_version(n, set_insert(version));
+  }
+  remove_permutation(permutation, i);
+  mass_node_set_permutation(n, permutation);
+  n->removed |= (uint32_t)1 << index;
+}
+
+// replace lower key of `child` which is not the first child with `key`, it's still between its neighbours
+// require: `n` is locked and is interior mass_node
+void interior_mass_node_replace_key(mass_node *n, mass_node *child, uint64_t key)
+{
+  uint32_t version = mass_node_get_version_unsafe(n);
+  assert(is_locked(version) && is_interior(version));
+
+  permutation_t permutation = mass_node_get_permutation_unsafe(n);
+  int count = get_count(permutation);
+
+  interior_mass_node *in = (interior_mass_node *)n;
+  int i = 0, index;
+  for (; i < count; ++i) {
+    index = get_index(permutation, i);
+    if (in->child[index + 1] == child)
+      break;
+  }
+
+  // must have this child
+  assert(i != count);
+
+  mass_node_set_version(n, set_insert(version));
+  n->keyslice[index] = key;
+}
+
 // require: `bn` and `bn1` is locked
 static uint64_t border_mass_node_split(border_mass_node *bn, border_mass_node *bn1)
 {
-  uint64_t permutation = mass_node_get_permutation_unsafe((mass_node *)bn);
+  permutation_t permutation = mass_node_get_permutation_unsafe((mass_node *)bn);
+  int count = get_count(permutation);
 
-  assert(get_count(permutation) == max_key_count);
+  // all slots are used, except that slot 0 might be kept for lower key
+  assert(bn->removed == 0 || (bn->removed == 1 && bn->prev));
+  assert(count + __builtin_popcount(bn->removed) == max_key_count);
 
   // make sure lower key is where we want it to be
-  assert(get_index(permutation, 0) == 0 || bn->prev == 0);
+  assert(get_index(permutation, 0) == 0 || bn->prev == 0 || bn->removed);
 
-  assert(bn->removed == 0);
+  // make room for suffixes first, since `bn1` is empty
+  uint32_t total = 0;
+  for (int i = border_split_point; i < count; ++i) {
+    int index = get_index(permutation, i);
+    if (has_suffix(bn->keylen[index]))
+      total += border_mass_node_suffix_len(bn, index);
+  }
+  if (unlikely(total > bn1->bag->size))
+    border_mass_node_grow_bag(bn1, total);
 
   // move half higher key to new mass_node
-  for (int i = 8, j = 0; i < max_key_count; ++i, ++j) {
+  for (int i = border_split_point, j = 0; i < count; ++i, ++j) {
     int index = get_index(permutation, i);
     bn1->keyslice[j] = bn->keyslice[index];
     bn1->keylen[j]   = bn->keylen[index];
-    bn1->suffix[j]   = bn->suffix[index];
+    if (has_suffix(bn->keylen[index]))
+      bn1->suffix[j] = border_mass_node_store_suffix(bn1, bn->suffix[index], border_mass_node_suffix_len(bn, index), 0, 0);
+    else
+      bn1->suffix[j] = 0;
     bn1->lv[j]       = bn->lv[index];
+    bn1->value[j]    = bn->value[index];
     if (unlikely(bn1->keylen[j] == magic_link))
       mass_node_set_parent((mass_node *)bn1->lv[j], (mass_node *)bn1);
     bn->removed |= (1 << index); // record empty slot
   }
 
   // update new mass_node's permutation
-  uint64_t npermutation;
-  set_sequential_permutation(npermutation, 7);
+  permutation_t npermutation;
+  set_sequential_permutation(npermutation, count - border_split_point);
   // it's ok to use `unsafe` opeartion,
   mass_node_set_permutation_unsafe((mass_node *)bn1, npermutation);
   // due to this `release` operation
   // update old mass_node's permutation
-  permutation -= 7;
+  permutation -= count - border_split_point;
   mass_node_set_permutation((mass_node *)bn, permutation);
 
   // finally modify `next` and `prev` pointer
   border_mass_node *old_next = bn->next;
   bn1->prev = bn;
   bn1->next = old_next;
-  if (old_next) old_next->prev = bn1;
+  if (old_next) __atomic_store(&old_next->prev, &bn1, __ATOMIC_RELEASE);
   // `__ATOMIC_RELEASE` will make sure all link operations above been seen by other threads
   __atomic_store(&bn->next, &bn1, __ATOMIC_RELEASE);
 
@@ -787,19 +1590,19 @@ static uint64_t border_mass_node_split(border_mass_node *bn, border_mass_node *b
 // require: `in` and `in1` is locked
 static uint64_t interior_mass_node_split(interior_mass_node *in, interior_mass_node *in1)
 {
-  uint64_t permutation = mass_node_get_permutation_unsafe((mass_node *)in);
+  permutation_t permutation = mass_node_get_permutation_unsafe((mass_node *)in);
   assert(get_count(permutation) == max_key_count);
 
   assert(in->removed == 0);
 
-  int index = get_index(permutation, 7);
+  int index = get_index(permutation, interior_split_point);
   uint64_t fence = in->keyslice[index];
   in1->child[0] = in->child[index + 1];
   mass_node_set_parent(in1->child[0], (mass_node *)in1);
   in->removed |= (1 << index);
 
   // move half higher key to new mass_node
-  for (int i = 8, j = 0; i < max_key_count; ++i, ++j) {
+  for (int i = interior_split_point + 1, j = 0; i < max_key_count; ++i, ++j) {
     int index = get_index(permutation, i);
     in1->keyslice[j] = in->keyslice[index];
     in1->child[j + 1] = in->child[index + 1];
@@ -808,13 +1611,13 @@ static uint64_t interior_mass_node_split(interior_mass_node *in, interior_mass_n
   }
 
   // update new mass_node's permutation
-  uint64_t npermutation;
-  set_sequential_permutation(npermutation, 7);
+  permutation_t npermutation;
+  set_sequential_permutation(npermutation, max_key_count - interior_split_point - 1);
   // it's ok to use `unsafe` opeartion,
   mass_node_set_permutation_unsafe((mass_node *)in1, npermutation);
   // due to this `release` operation
   // update old mass_node's permutation
-  permutation -= 8;
+  permutation -= max_key_count - interior_split_point;
   mass_node_set_permutation((mass_node *)in, permutation);
 
   return fence;
@@ -843,20 +1646,32 @@ mass_node* mass_node_split(mass_node *n, uint64_t *fence)
   return n1;
 }
 
-#ifdef Test
-
+// free `n` itself, its keys and children are not touched
 void free_mass_node_raw(mass_node *n)
 {
+#ifdef Allocator
+  (void)n;
+#else
+  if (is_border(n->version)) {
+    border_mass_node *bn = (border_mass_node *)n;
+    if (bn->bag != get_inline_bag(bn))
+      free((void *)bn->bag);
+  }
   free((void *)n);
+#endif // Allocator
 }
 
+#ifdef Test
+
 static void border_mass_node_print_at_index(border_mass_node *bn, int index)
 {
   assert(bn->keylen[index] != magic_unstable);
-  if (bn->keylen[index] != magic_link) {
+  if (bn->keylen[index] == magic_u64) {
+    printf("value: %p\n", bn->lv[index]);
+  } else if (bn->keylen[index] != magic_link) {
     char buf[256];
-    uint32_t len = *(uint32_t *)&(bn->lv[index]);
     uint32_t off = *((uint32_t *)&(bn->lv[index]) + 1);
+    uint32_t len = border_mass_node_suffix_len(bn, index);
     memcpy(buf, bn->suffix[index], len);
     buf[len] = 0;
     printf("slicelen: %u offset: %u  %s\n", bn->keylen[index], off, buf);
@@ -881,7 +1696,7 @@ static void interior_mass_node_print_at_index(interior_mass_node *in, int index)
 void mass_node_print(mass_node *n)
 {
   uint32_t version = mass_node_get_version(n);
-  uint64_t permutation = mass_node_get_permutation(n);
+  permutation_t permutation = mass_node_get_permutation(n);
   int count = get_count(permutation);
 
   printf("%p\n", n);
@@ -915,7 +1730,7 @@ void mass_node_print(mass_node *n)
 static void validate(mass_node *n)
 {
   uint32_t version = mass_node_get_version(n);
-  uint64_t permutation = mass_node_get_permutation(n);
+  permutation_t permutation = mass_node_get_permutation(n);
   int count = get_count(permutation);
 
   if (count > 2) {
@@ -931,17 +1746,21 @@ static void validate(mass_node *n)
     }
   }
 
+  // mass_node that has been emptied by remove
+  if (count == 0)
+    return ;
+
   uint64_t my_first = n->keyslice[get_index(permutation, 0)];
   uint64_t my_last = n->keyslice[get_index(permutation, count - 1)];
   if (is_border(version)) {
     border_mass_node *bn = (border_mass_node *)n;
-    if (bn->prev) {
-      uint64_t ppermutation = mass_node_get_permutation((mass_node *)bn->prev);
+    if (bn->prev && mass_node_get_count((mass_node *)bn->prev)) {
+      permutation_t ppermutation = mass_node_get_permutation((mass_node *)bn->prev);
       uint64_t their_last = bn->prev->keyslice[get_index(ppermutation, get_count(ppermutation) - 1)];
       assert(mass_compare_key(their_last, my_first) < 0);
     }
-    if (bn->next) {
-      uint64_t npermutation = mass_node_get_permutation((mass_node *)bn->next);
+    if (bn->next && mass_node_get_count((mass_node *)bn->next)) {
+      permutation_t npermutation = mass_node_get_permutation((mass_node *)bn->next);
       uint64_t their_first = bn->next->keyslice[get_index(npermutation, 0)];
 
       int r = mass_compare_key(my_last, their_first);
@@ -961,12 +1780,13 @@ static void validate(mass_node *n)
     }
   } else {
     interior_mass_node *in = (interior_mass_node *)n;
-    uint64_t fpermutation = mass_node_get_permutation(in->child[0]);
-    uint64_t lpermutation = mass_node_get_permutation(in->child[get_index(permutation, get_count(permutation) - 1) + 1]);
+    mass_node *last = in->child[get_index(permutation, count - 1) + 1];
+    permutation_t fpermutation = mass_node_get_permutation(in->child[0]);
+    permutation_t lpermutation = mass_node_get_permutation(last);
     uint64_t their_last = in->child[0]->keyslice[get_index(fpermutation, get_count(fpermutation) - 1)];
-    uint64_t their_first = in->child[get_index(permutation, get_count(permutation) - 1) + 1]->keyslice[get_index(lpermutation, 0)];
+    uint64_t their_first = last->keyslice[get_index(lpermutation, 0)];
 
-    int r = mass_compare_key(their_last, my_first);
+    int r = get_count(fpermutation) ? mass_compare_key(their_last, my_first) : -1;
     if (r >= 0) {
       char buf1[9];
       memcpy(buf1, &their_last, sizeof(uint64_t));
@@ -979,7 +1799,7 @@ static void validate(mass_node *n)
       mass_node_print(in->child[0]);
     }
     assert(r < 0);
-    r = mass_compare_key(my_last, their_first);
+    r = get_count(lpermutation) ? mass_compare_key(my_last, their_first) : 0;
     if (r > 0) {
       char buf1[9];
       memcpy(buf1, &my_last, sizeof(uint64_t));
@@ -989,7 +1809,7 @@ static void validate(mass_node *n)
       buf2[8] = 0;
       printf("%s %s\n", buf1, buf2);
       // mass_node_print(n);
-      mass_node_print(in->child[count]);
+      mass_node_print(last);
     }
     assert(r <= 0); // equal is possible
   }
@@ -999,10 +1819,41 @@ void mass_node_validate(mass_node *n)
 {
   validate(n);
   if (is_interior(mass_node_get_version(n))) {
-    int count = mass_node_get_count(n);
-    for (int i = 0; i <= count; ++i)
-      mass_node_validate(((interior_mass_node *)n)->child[i]);
+    permutation_t permutation = mass_node_get_permutation(n);
+    int count = get_count(permutation);
+    mass_node_validate(((interior_mass_node *)n)->child[0]);
+    for (int i = 0; i < count; ++i)
+      mass_node_validate(((interior_mass_node *)n)->child[get_index(permutation, i) + 1]);
   }
 }
 
+// number of mass_nodes in the tree whose root is `n`, mass_nodes in deeper layers are included
+uint32_t mass_node_get_node_count(mass_node *n)
+{
+  permutation_t permutation = mass_node_get_permutation(n);
+  int count = get_count(permutation);
+  uint32_t total = 1;
+  if (is_border(mass_node_get_version(n))) {
+    border_mass_node *bn = (border_mass_node *)n;
+    for (int i = 0; i < count; ++i) {
+      int index = get_index(permutation, i);
+      if (bn->keylen[index] == magic_link)
+        total += mass_node_get_node_count((mass_node *)bn->lv[index]);
+    }
+  } else {
+    interior_mass_node *in = (interior_mass_node *)n;
+    total += mass_node_get_node_count(in->child[0]);
+    for (int i = 0; i < count; ++i)
+      total += mass_node_get_node_count(in->child[get_index(permutation, i) + 1]);
+  }
+  return total;
+}
+
+// size of the suffix bag of border mass_node `n`
+uint32_t mass_node_get_bag_size(mass_node *n)
+{
+  assert(is_border(mass_node_get_version(n)));
+  return ((border_mass_node *)n)->bag->size;
+}
+
 #endif /* Test */
@@ -18,8 +18,8 @@
 
 /**
  *   layout of a mass_node's version (32 bit):
- *       lock   insert  split   delete   root   border  not-used    vsplit      vinsert
- *     |   1   |  1   |   1   |   1   |   1   |   1   |    2    |     8     |     16     |
+ *       lock   insert  split   delete   root   border   wait   not-used    vsplit      vinsert
+ *     |   1   |  1   |   1   |   1   |   1   |   1   |   1   |    1    |     8     |     16     |
  *
 **/
 
@@ -29,6 +29,7 @@
 #define DELETE_BIT ((uint32_t)1 << 28)
 #define ROOT_BIT   ((uint32_t)1 << 27)
 #define BORDER_BIT ((uint32_t)1 << 26)
+#define WAIT_BIT   ((uint32_t)1 << 25) // some thread sleeps on this version, only used with `Futex`
 
 // `vsplit` is a 8 bit field
 #define get_vsplit(n)  ((uint32_t)(((n) >> 16) & 0xff))
@@ -49,6 +50,7 @@
 #define unset_insert(n) ((n) & (~INSERT_BIT))
 #define unset_split(n)  ((n) & (~SPLIT_BIT))
 #define unset_root(n)  ((n) & (~ROOT_BIT))
+#define unset_wait(n)  ((n) & (~WAIT_BIT))
 
 #define is_locked(n)    ((n) & LOCK_BIT)
 #define is_inserting(n) ((n) & INSERT_BIT)
@@ -58,10 +60,30 @@
 #define is_border(n)    ((n) & BORDER_BIT)
 #define is_interior(n)  (!is_border(n))
 
+// max number of keys in a mass_node, it's limited by the width of `permutation`,
+// `Wide` uses a 128 bit permutation that holds 24 slots of 5 bits and a 5 bit count, it needs avx
+#ifdef Wide
+#define max_key_count 24
+#else
+#define max_key_count 15
+#endif // Wide
+
 typedef struct mass_node mass_node;
 
+// contention counters
+typedef struct mass_stats
+{
+  uint64_t lock_spins;   // backoff rounds of threads that found a mass_node locked
+  uint64_t stable_waits; // times a thread found a mass_node being modified and waited for a stable version
+  uint64_t stable_spins; // backoff rounds of those waits, this is how long they waited
+  uint64_t sleeps;       // times a long wait fell back to futex, always 0 without `Futex`
+}mass_stats;
+
+void init_mass_node();
+int mass_node_take_stats(mass_stats *stats);
 mass_node* new_mass_node(int type);
 void free_mass_node(mass_node *n);
+void free_mass_node_raw(mass_node *n);
 void mass_node_prefetch(mass_node *n);
 void border_mass_node_prefetch_write(mass_node *n);
 void border_mass_node_prefetch_read(mass_node *n);
@@ -76,19 +98,41 @@ uint32_t mass_node_get_version_unsafe(mass_node *n);
 uint32_t mass_node_get_stable_version(mass_node *n);
 void mass_node_set_version(mass_node *n, uint32_t version);
 mass_node* mass_node_get_next(mass_node *n);
+mass_node* mass_node_get_prev(mass_node *n);
 mass_node* mass_node_get_parent(mass_node *n);
+void mass_node_set_parent(mass_node *n, mass_node *p);
 mass_node* mass_node_get_locked_parent(mass_node *n);
+mass_node* mass_node_get_locked_prev(mass_node *n);
+void mass_node_set_deleted(mass_node *n);
+void mass_node_unlink(mass_node *n);
+int mass_node_get_count(mass_node *n);
+mass_node* mass_node_get_first_child(mass_node *n);
 void mass_node_set_first_child(mass_node *n, mass_node *c);
 int mass_node_is_full(mass_node *n);
 int mass_node_include_key(mass_node *n, uint64_t off);
-int mass_node_get_conflict_key_index(mass_node *n, const void *key, uint32_t len, uint32_t off, void **ckey, uint32_t *clen);
+uint64_t mass_node_get_lower_key(mass_node *n);
+int mass_node_get_conflict_key_index(mass_node *n, const void *key, uint32_t len, uint32_t off, void **csuffix,
+  uint32_t *clen, void **cval);
 void mass_node_replace_at_index(mass_node *n, int index, mass_node *n1);
 void mass_node_swap_child(mass_node *n, mass_node *c, mass_node *c1);
 mass_node* mass_node_descend(mass_node *n, uint64_t cur);
 void* border_mass_node_insert(mass_node *n, const void *key, uint32_t len, uint32_t off, const void *val, int is_link);
 void interior_mass_node_insert(mass_node *n, uint64_t key, mass_node *child);
 mass_node* mass_node_split(mass_node *n, uint64_t *fence);
-void* mass_node_search(mass_node *n, uint64_t cur, void **value);
+void* mass_node_search(mass_node *n, uint64_t cur, void **suffix, void **value);
+int border_mass_node_get_keys(mass_node *n, uint64_t *keyslice, void **suffix, void **lv, void **value);
+void* border_mass_node_remove(mass_node *n, const void *key, uint32_t len, uint32_t off);
+void* border_mass_node_update(mass_node *n, const void *key, uint32_t len, uint32_t off, const void *val,
+  void **old);
+void border_mass_node_remove_link(mass_node *n, mass_node *child);
+int border_mass_node_replace_link(mass_node *n, mass_node *child);
+void interior_mass_node_remove(mass_node *n, mass_node *child);
+void interior_mass_node_replace_key(mass_node *n, mass_node *child, uint64_t key);
+
+int border_mass_node_insert_u64(mass_node *n, uint64_t key, const void *val);
+int mass_node_search_u64(mass_node *n, uint64_t key, void **value);
+int border_mass_node_remove_u64(mass_node *n, uint64_t key);
+int border_mass_node_update_u64(mass_node *n, uint64_t key, const void *val, void **old);
 
 int mass_compare_key(uint64_t k1, uint64_t k2);
 uint64_t get_next_keyslice(const void *key, uint32_t len, uint32_t off);
@@ -107,9 +151,11 @@ uint64_t get_next_keyslice_and_advance(const void *key, uint32_t len, uint32_t *
 
 #ifdef Test
 
-void free_mass_node_raw(mass_node *n);
 void mass_node_print(mass_node *n);
 void mass_node_validate(mass_node *n);
+void mass_node_set_avx2(int enable);
+uint32_t mass_node_get_node_count(mass_node *n);
+uint32_t mass_node_get_bag_size(mass_node *n);
 
 #endif /* Test */
 
@@ -12,6 +12,7 @@
 #include <stdio.h>
 
 #include "../palm/allocator.h"
+#include "../util/epoch.h"
 #include "mass_tree.h"
 
 mass_tree* new_mass_tree()
@@ -20,13 +21,47 @@ mass_tree* new_mass_tree()
   init_allocator();
 #endif
 
+  init_epoch();
+  init_mass_node();
+
   mass_tree *mt = (mass_tree *)malloc(sizeof(mass_tree));
 
   mass_node *r = new_mass_node(Border);
   mass_node_set_root_unsafe(r);
 
   mt->root = r;
+  mt->removals = 0;
+  mt->u64 = 0;
+  memset(&mt->stats, 0, sizeof(mt->stats));
+
+  return mt;
+}
+
+// add contention this thread has seen to the counters of `mt`
+static inline void mass_tree_account(mass_tree *mt)
+{
+  mass_stats stats;
+  if (likely(mass_node_take_stats(&stats) == 0))
+    return ;
+  __atomic_add_fetch(&mt->stats.lock_spins, stats.lock_spins, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&mt->stats.stable_waits, stats.stable_waits, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&mt->stats.stable_spins, stats.stable_spins, __ATOMIC_RELAXED);
+  if (stats.sleeps)
+    __atomic_add_fetch(&mt->stats.sleeps, stats.sleeps, __ATOMIC_RELAXED);
+}
+
+void mass_tree_get_stats(mass_tree *mt, mass_stats *stats)
+{
+  stats->lock_spins   = __atomic_load_n(&mt->stats.lock_spins, __ATOMIC_RELAXED);
+  stats->stable_waits = __atomic_load_n(&mt->stats.stable_waits, __ATOMIC_RELAXED);
+  stats->stable_spins = __atomic_load_n(&mt->stats.stable_spins, __ATOMIC_RELAXED);
+  stats->sleeps       = __atomic_load_n(&mt->stats.sleeps, __ATOMIC_RELAXED);
+}
 
+mass_tree* new_mass_tree_u64()
+{
+  mass_tree *mt = new_mass_tree();
+  mt->u64 = 1;
   return mt;
 }
 
@@ -118,17 +153,23 @@ static mass_node* find_border_mass_node(mass_node *r, uint64_t cur, uint32_t *ve
 // create a subtree lazily and then insert kv into it, at last replace kv with this subtree
 static void create_new_layer(mass_node *n, const void *key, uint32_t len, uint32_t off, const void *val)
 {
-  void *ckey;
+  void *csuffix, *cval;
   uint32_t clen;
-  int idx = mass_node_get_conflict_key_index(n, key, len, off, &ckey, &clen);
+  int idx = mass_node_get_conflict_key_index(n, key, len, off, &csuffix, &clen, &cval);
 
   // advance key offset that causes this conflict
   off += sizeof(uint64_t);
 
+  // rebuild conflict key, it shares prefix with `key` up to `off`
+  char *ckey = (char *)malloc(clen);
+  memcpy(ckey, key, off);
+  memcpy(ckey + off, csuffix, clen - off);
+
   // these 2 key can still be have mutiple common prefix keyslice, we need to loop and create
   // subtree until they don't
   mass_node *head = 0, *parent = 0;
-  uint64_t lks;
+  // offset of the keyslice that links `parent` to its child layer
+  uint32_t loff = 0;
   uint32_t noff = off + sizeof(uint64_t);
   while (noff <= clen && noff <= len) {
     uint64_t ks1 = get_next_keyslice(ckey, clen, off);
@@ -141,10 +182,10 @@ static void create_new_layer(mass_node *n, const void *key, uint32_t len, uint32
     if (head == 0) head = bn;
     if (parent) {
       mass_node_lock_unsafe(parent);
-      assert((uint64_t)border_mass_node_insert(parent, &lks, sizeof(uint64_t), 0 /* off */, bn, 1 /* is_link */) == 1);
+      assert((uint64_t)border_mass_node_insert(parent, ckey, clen, loff, bn, 1 /* is_link */) == 1);
       mass_node_unlock_unsafe(parent);
     }
-    lks = ks1;
+    loff = off;
     parent = bn;
     off += sizeof(uint64_t);
     noff = off + sizeof(uint64_t);
@@ -154,13 +195,13 @@ static void create_new_layer(mass_node *n, const void *key, uint32_t len, uint32
   mass_node *bn = new_mass_node(Border);
   mass_node_set_root_unsafe(bn);
   mass_node_lock_unsafe(bn);
-  assert((uint64_t)border_mass_node_insert(bn, ckey, clen, off, 0, 0 /* is_link */) == 1);
+  assert((uint64_t)border_mass_node_insert(bn, ckey, clen, off, cval, 0 /* is_link */) == 1);
   assert((uint64_t)border_mass_node_insert(bn, key, len, off, val, 0 /* is_link */) == 1);
   mass_node_unlock_unsafe(bn);
 
   if (parent) {
     mass_node_lock_unsafe(parent);
-    assert((uint64_t)border_mass_node_insert(parent, &lks, sizeof(uint64_t), 0 /* off */, bn, 1 /* is_link */) == 1);
+    assert((uint64_t)border_mass_node_insert(parent, ckey, clen, loff, bn, 1 /* is_link */) == 1);
     mass_node_unlock_unsafe(parent);
   }
 
@@ -169,6 +210,8 @@ static void create_new_layer(mass_node *n, const void *key, uint32_t len, uint32
     mass_node_replace_at_index(n, idx, bn);
   else
     mass_node_replace_at_index(n, idx, head);
+
+  free((void *)ckey);
 }
 
 // require: `n` and `n1` is locked
@@ -217,23 +260,16 @@ static void mass_tree_promote_split_mass_node(mass_tree *mt, mass_node *n, uint6
   }
 }
 
-int mass_tree_put(mass_tree *mt, const void *key, uint32_t len, const void *val)
+// find the border mass_node that includes `cur` in the layer whose root is `r` and lock it,
+// return 0 if the mass_node has been removed, its layer might be gone as well, caller should restart
+static mass_node* mass_tree_lock_border(mass_node *r, uint64_t cur)
 {
-  uint32_t off = 0, v;
-  uint64_t cur;
-  // it's ok to use stale root
-  mass_node *r = mt->root, *n;
-
-  again:
-  cur = get_next_keyslice(key, len, off);
-  n = find_border_mass_node(r, cur, &v);
+  uint32_t v;
+  mass_node *n = find_border_mass_node(r, cur, &v);
 
   forward:
-  if (unlikely(is_deleted(v))) {
-    // NOTE: remove this if we ever implement `mass_tree_delete`
-    assert(0);
-    goto again;
-  }
+  if (unlikely(is_deleted(v)))
+    return 0;
 
   // before we write this mass_node, a lock must be obtained
   mass_node_lock(n);
@@ -256,18 +292,153 @@ int mass_tree_put(mass_tree *mt, const void *key, uint32_t len, const void *val)
   }
 
   border_mass_node_prefetch_write(n);
+  return n;
+}
+
+mass_cursor* new_mass_cursor(mass_tree *mt)
+{
+  mass_cursor *c = (mass_cursor *)malloc(sizeof(mass_cursor));
+
+  c->mt = mt;
+  c->removals = 0;
+  c->root = 0;
+  c->off = 0;
+  c->prefix_cap = 64;
+  c->prefix = (char *)malloc(c->prefix_cap);
+  c->border = 0;
+
+  return c;
+}
+
+void free_mass_cursor(mass_cursor *c)
+{
+  free((void *)c->prefix);
+  free((void *)c);
+}
+
+// whether `key` belongs to the layer of the hint, mass_nodes of the hint are still alive
+// if no mass_node has been removed since the hint is recorded
+static inline int mass_cursor_match(mass_cursor *c, const void *key, uint32_t len, uint64_t removals)
+{
+  return c->root && c->removals == removals && len >= c->off && !memcmp(c->prefix, key, c->off);
+}
+
+// whether `cur` is in key range of border mass_node `n`, lower key of a border mass_node never changes,
+// a split of `n` or removal of its successor changes `next`
+static inline int mass_cursor_include_key(mass_node *n, uint64_t cur)
+{
+  mass_node *next = mass_node_get_next(n);
+  return (mass_node_get_prev(n) == 0 || mass_node_include_key(n, cur)) &&
+    (next == 0 || !mass_node_include_key(next, cur));
+}
+
+// return border mass_node of the hint and record its stable version if it still includes `cur`,
+// key range is read within that version, a later split is handled by moving right as usual
+static mass_node* mass_cursor_find_border(mass_cursor *c, uint64_t cur, uint32_t *version)
+{
+  mass_node *n = c->border;
+  if (n == 0)
+    return 0;
+
+  uint32_t v = mass_node_get_stable_version(n);
+  if (is_deleted(v) || !mass_cursor_include_key(n, cur))
+    return 0;
+
+  uint32_t diff = mass_node_get_version(n) ^ v;
+  if (diff != LOCK_BIT && diff != 0)
+    return 0;
 
+  *version = v;
+  return n;
+}
+
+// lock border mass_node of the hint if it still includes `cur`, otherwise return 0
+static mass_node* mass_cursor_lock_border(mass_cursor *c, uint64_t cur)
+{
+  uint32_t v;
+  mass_node *n = mass_cursor_find_border(c, cur, &v);
+  if (n == 0)
+    return 0;
+
+  mass_node_lock(n);
+
+  // key range of a locked mass_node does not change, split or removal might have happened before we lock it
+  if (is_deleted(mass_node_get_version_unsafe(n)) || !mass_cursor_include_key(n, cur)) {
+    mass_node_unlock(n);
+    return 0;
+  }
+
+  border_mass_node_prefetch_write(n);
+  return n;
+}
+
+// remember that `key` is in border mass_node `n` of the layer whose root is `r` and key offset is `off`
+static void mass_cursor_record(mass_cursor *c, mass_node *r, uint32_t off, const void *key, mass_node *n,
+  uint64_t removals)
+{
+  if (unlikely(off > c->prefix_cap)) {
+    while (c->prefix_cap < off)
+      c->prefix_cap *= 2;
+    c->prefix = (char *)realloc(c->prefix, c->prefix_cap);
+    assert(c->prefix);
+  }
+  memcpy(c->prefix, key, off);
+  c->off = off;
+  c->root = r;
+  c->removals = removals;
+  c->border = n;
+}
+
+// if `upsert` is set, value of existed key is replaced and previous value is stored in `old`,
+// `c` can be 0, otherwise its hint is tried first and updated at last
+static int _mass_tree_put(mass_tree *mt, mass_cursor *c, const void *key, uint32_t len, const void *val,
+  int upsert, void **old)
+{
+  uint32_t off;
+  mass_node *r, *n;
+  uint64_t removals = 0;
+
+  assert(mt->u64 == 0);
+
+  if (c) {
+    removals = __atomic_load_n(&mt->removals, __ATOMIC_SEQ_CST);
+    if (mass_cursor_match(c, key, len, removals)) {
+      off = c->off;
+      r = c->root;
+      n = mass_cursor_lock_border(c, get_next_keyslice(key, len, off));
+      if (n)
+        goto insert;
+      goto again;
+    }
+  }
+
+  restart:
+  off = 0;
+  // it's ok to use stale root
+  r = mt->root;
+
+  again:
+  n = mass_tree_lock_border(r, get_next_keyslice(key, len, off));
+  if (unlikely(n == 0))
+    goto restart;
+
+  insert: ;
   void *ret = border_mass_node_insert(n, key, len, off, val, 0 /* is_link */);
   switch ((uint64_t)ret) {
     case 0: // key existed
+      if (upsert)
+        assert((uint64_t)border_mass_node_update(n, key, len, off, val, old) == 1);
       mass_node_unlock(n);
+      if (c) mass_cursor_record(c, r, off, key, n, removals);
       return 0;
     case 1: // key inserted
       mass_node_unlock(n);
+      if (c) mass_cursor_record(c, r, off, key, n, removals);
       return 1;
     case -1: { // need to create a deeper layer
       create_new_layer(n, key, len, off, val);
       mass_node_unlock(n);
+      if (c) mass_cursor_record(c, r, off, key, n, removals);
       return 1;
     }
     case -2: { // mass_node is full, need to split and promote
@@ -276,12 +447,14 @@ int mass_tree_put(mass_tree *mt, const void *key, uint32_t len, const void *val)
       assert(fence);
       uint64_t cur = get_next_keyslice(key, len, off);
       // equal is not possible
-      if (mass_compare_key(cur, fence) < 0)
+      int left = mass_compare_key(cur, fence) < 0;
+      if (left)
         assert((uint64_t)border_mass_node_insert(n, key, len, off, val, 0 /* is_link */) == 1);
       else
         assert((uint64_t)border_mass_node_insert(n1, key, len, off, val, 0 /* is_link */) == 1);
 
       mass_tree_promote_split_mass_node(mt, n, fence, n1);
+      if (c) mass_cursor_record(c, r, off, key, left ? n : n1, removals);
       return 1;
     }
     default: // need to go to a deeper layer
@@ -293,28 +466,114 @@ int mass_tree_put(mass_tree *mt, const void *key, uint32_t len, const void *val)
   }
 }
 
-void* mass_tree_get(mass_tree *mt, const void *key, uint32_t len)
+// return 1 if key is inserted, 0 if key existed and value is not changed,
+// key is copied into mass tree, so caller keeps ownership of `key`
+int mass_tree_put(mass_tree *mt, const void *key, uint32_t len, const void *val)
 {
-  uint32_t off = 0, v;
+  epoch_enter();
+  int ret = _mass_tree_put(mt, 0 /* cursor */, key, len, val, 0 /* upsert */, 0 /* old */);
+  epoch_exit();
+  mass_tree_account(mt);
+  return ret;
+}
+
+// return 1 if key is inserted, 0 if key existed and its value is replaced, previous value is stored
+// in `old` if it's not null
+int mass_tree_upsert(mass_tree *mt, const void *key, uint32_t len, const void *val, void **old)
+{
+  epoch_enter();
+  int ret = _mass_tree_put(mt, 0 /* cursor */, key, len, val, 1 /* upsert */, old);
+  epoch_exit();
+  mass_tree_account(mt);
+  return ret;
+}
+
+static int _mass_tree_update(mass_tree *mt, const void *key, uint32_t len, const void *val, void **old)
+{
+  uint32_t off;
+  mass_node *r, *n;
+
+  assert(mt->u64 == 0);
+
+  restart:
+  off = 0;
+  // it's ok to use stale root
+  r = mt->root;
+
+  again:
+  n = mass_tree_lock_border(r, get_next_keyslice(key, len, off));
+  if (unlikely(n == 0))
+    goto restart;
+
+  // lock only serializes writers, readers are not blocked
+  void *ret = border_mass_node_update(n, key, len, off, val, old);
+  mass_node_unlock(n);
+  switch ((uint64_t)ret) {
+    case 0: // key does not exist
+      return 0;
+    case 1: // value replaced
+      return 1;
+    default: // need to go to a deeper layer
+      r = (mass_node *)ret;
+      off += sizeof(uint64_t);
+      goto again;
+  }
+}
+
+// replace value of the key, previous value is stored in `old` if it's not null,
+// return 1 on success, 0 if key does not exist
+int mass_tree_update(mass_tree *mt, const void *key, uint32_t len, const void *val, void **old)
+{
+  epoch_enter();
+  int ret = _mass_tree_update(mt, key, len, val, old);
+  epoch_exit();
+  mass_tree_account(mt);
+  return ret;
+}
+
+// `c` can be 0, otherwise its hint is tried first and updated at last
+static void* _mass_tree_get(mass_tree *mt, mass_cursor *c, const void *key, uint32_t len)
+{
+  uint32_t off, loff, v;
   uint64_t cur;
+  mass_node *r, *n;
+  uint64_t removals = 0;
+
+  assert(mt->u64 == 0);
+
+  if (c) {
+    removals = __atomic_load_n(&mt->removals, __ATOMIC_SEQ_CST);
+    if (mass_cursor_match(c, key, len, removals)) {
+      loff = off = c->off;
+      r = c->root;
+      cur = get_next_keyslice_and_advance(key, len, &off);
+      n = mass_cursor_find_border(c, cur, &v);
+      if (n)
+        goto forward;
+      goto find;
+    }
+  }
+
+  restart:
+  off = 0;
   // it's ok to use stale root
-  mass_node *r = mt->root, *n;
+  r = mt->root;
 
   again:
+  loff = off;
   cur = get_next_keyslice_and_advance(key, len, &off);
+  find:
   n = find_border_mass_node(r, cur, &v);
 
   forward:
-  if (is_deleted(v)) {
-    // NOTE: remove this if we ever implement `mass_tree_delete`
-    assert(0);
-    goto again;
-  }
+  // mass_node has been removed, its layer might be gone as well
+  if (unlikely(is_deleted(v)))
+    goto restart;
 
   border_mass_node_prefetch_read(n);
 
-  void *suffix;
-  void *lv = mass_node_search(n, cur, &suffix);
+  void *suffix, *value;
+  void *lv = mass_node_search(n, cur, &suffix, &value);
 
   uint32_t diff = mass_node_get_version(n) ^ v;
   if (diff != LOCK_BIT && diff != 0) {
@@ -337,8 +596,10 @@ void* mass_tree_get(mass_tree *mt, const void *key, uint32_t len)
     uint32_t coff = (uint32_t)((uint64_t)lv >> 32);
     assert(coff == off);
     // case 2: key exists
-    if (clen == len && !memcmp((char *)key + off, (char *)suffix + off, len - off))
-      return suffix;
+    if (clen == len && !memcmp((char *)key + off, suffix, len - off)) {
+      if (c) mass_cursor_record(c, r, loff, key, n, removals);
+      return value;
+    }
   } else if (lv) {
     // case 3: goto a deeper layer
     r = (mass_node *)lv;
@@ -347,5 +608,751 @@ void* mass_tree_get(mass_tree *mt, const void *key, uint32_t len)
   }
 
   // case 4: key does not exist
+  if (c) mass_cursor_record(c, r, loff, key, n, removals);
+  return 0;
+}
+
+void* mass_tree_get(mass_tree *mt, const void *key, uint32_t len)
+{
+  epoch_enter();
+  void *ret = _mass_tree_get(mt, 0 /* cursor */, key, len);
+  epoch_exit();
+  mass_tree_account(mt);
+  return ret;
+}
+
+// same as `mass_tree_put`, but starts from where last key of `c` was put or found
+int mass_cursor_put(mass_cursor *c, const void *key, uint32_t len, const void *val)
+{
+  epoch_enter();
+  int ret = _mass_tree_put(c->mt, c, key, len, val, 0 /* upsert */, 0 /* old */);
+  epoch_exit();
+  mass_tree_account(c->mt);
+  return ret;
+}
+
+// same as `mass_tree_get`, but starts from where last key of `c` was put or found
+void* mass_cursor_get(mass_cursor *c, const void *key, uint32_t len)
+{
+  epoch_enter();
+  void *ret = _mass_tree_get(c->mt, c, key, len);
+  epoch_exit();
+  mass_tree_account(c->mt);
+  return ret;
+}
+
+static void release_mass_node(void *n)
+{
+  free_mass_node_raw((mass_node *)n);
+}
+
+// require: `n` is unlinked
+// `removals` is bumped before `n` is retired, so a cursor that sees the old count after it enters
+// its critical section can still touch `n`
+static void mass_tree_retire(mass_tree *mt, mass_node *n)
+{
+  __atomic_add_fetch(&mt->removals, 1, __ATOMIC_SEQ_CST);
+  epoch_retire(n, release_mass_node);
+}
+
+static void mass_tree_shrink(mass_tree *mt, mass_node *n);
+
+// `r` is an interior root of a layer that has only one child `c` left, `c` becomes the root,
+// a child is locked before its parent, so `r` is not locked when this function is called
+static void mass_tree_collapse_root(mass_tree *mt, mass_node *c)
+{
+  mass_node_lock(c);
+  mass_node *r = mass_node_get_locked_parent(c);
+  // another thread might have put a key into `r` or collapsed it
+  if (r == 0 || is_border(mass_node_get_version_unsafe(r)) || !is_root(mass_node_get_version_unsafe(r)) ||
+    mass_node_get_count(r)) {
+    if (r) mass_node_unlock(r);
+    mass_node_unlock(c);
+    return ;
+  }
+  assert(mass_node_get_first_child(r) == c);
+
+  // it's a border mass_node in parent layer, or 0 for the first layer
+  mass_node *p = mass_node_get_locked_parent(r);
+  mass_node_set_root_unsafe(c);
+  if (p) {
+    mass_node_swap_child(p, r, c);
+  } else {
+    mass_node_set_parent(c, 0);
+    mt->root = c;
+  }
+  // a reader that starts from stale root `r` still gets to `c`
+  mass_node_set_deleted(r);
+  mass_node_unlock(r);
+  if (p) mass_node_unlock(p);
+  mass_tree_retire(mt, r);
+
+  if (is_border(mass_node_get_version_unsafe(c))) {
+    // it might have only one key left
+    mass_tree_shrink(mt, c);
+  } else if (mass_node_get_count(c) == 0) {
+    mass_node *c1 = mass_node_get_first_child(c);
+    mass_node_unlock(c);
+    mass_tree_collapse_root(mt, c1);
+  } else {
+    mass_node_unlock(c);
+  }
+}
+
+// interior mass_node `p` has lost a child, it's replaced by its first child if that is the only one left
+// require: `p` is locked, it's unlocked when this function returns
+static void mass_tree_shrink_interior(mass_tree *mt, mass_node *p)
+{
+  if (mass_node_get_count(p)) {
+    mass_node_unlock(p);
+    return ;
+  }
+
+  mass_node *c = mass_node_get_first_child(p);
+  if (is_root(mass_node_get_version_unsafe(p))) {
+    mass_node_unlock(p);
+    mass_tree_collapse_root(mt, c);
+    return ;
+  }
+
+  mass_node *g = mass_node_get_locked_parent(p);
+  assert(g && is_interior(mass_node_get_version_unsafe(g)));
+  mass_node_swap_child(g, p, c);
+  mass_node_set_deleted(p);
+  mass_node_unlock(p);
+  mass_node_unlock(g);
+  mass_tree_retire(mt, p);
+}
+
+// border mass_node `n` is the first child of `p` and is going to be removed, its key range is merged into
+// its predecessor which is under another ancestor, so lower key of the subtree that starts with `n` is
+// replaced by `fence` in that ancestor, it's done before `n` is removed so that a reader never gets to
+// a mass_node on the right of its key
+// require: `p` is locked
+static void mass_tree_replace_fence(mass_node *p, uint64_t fence)
+{
+  // ancestors stay locked on the way up so that their first child does not change
+  mass_node *c = p, *a;
+  while (1) {
+    a = mass_node_get_locked_parent(c);
+    // `n` has a predecessor, so the subtree is not the first one in this layer
+    assert(a && is_interior(mass_node_get_version_unsafe(a)));
+    if (mass_node_get_first_child(a) != c)
+      break;
+    // a reader only validates the parent of a mass_node, one that has descended through `a` with the old
+    // fence must retry from root instead of getting to `p`
+    mass_node_set_version(a, set_split(mass_node_get_version_unsafe(a)));
+    c = a;
+  }
+
+  interior_mass_node_replace_key(a, c, fence);
+
+  for (c = mass_node_get_parent(p); c != a; ) {
+    mass_node *next = mass_node_get_parent(c);
+    mass_node_unlock(c);
+    c = next;
+  }
+  mass_node_unlock(a);
+}
+
+// a key has been removed from border mass_node `n`, remove `n` if it's empty, a layer with only one key
+// left is collapsed into its parent layer, this might go up through several layers
+// require: `n` is locked, it's unlocked when this function returns
+static void mass_tree_shrink(mass_tree *mt, mass_node *n)
+{
+  while (1) {
+    uint32_t v = mass_node_get_version_unsafe(n);
+    int count = mass_node_get_count(n);
+
+    if (is_root(v)) {
+      // root of the first layer is never removed
+      if (count > 1 || mass_node_get_parent(n) == 0)
+        break;
+      mass_node *p = mass_node_get_locked_parent(n);
+      assert(p && is_border(mass_node_get_version_unsafe(p)));
+      if (count == 1) {
+        // the only key is a link to another layer, keep it
+        if (border_mass_node_replace_link(p, n)) {
+          mass_node_unlock(p);
+          break;
+        }
+        mass_node_set_deleted(n);
+        mass_node_unlock(n);
+        mass_node_unlock(p);
+        mass_tree_retire(mt, n);
+        return ;
+      }
+      border_mass_node_remove_link(p, n);
+      mass_node_set_deleted(n);
+      mass_node_unlock(n);
+      mass_tree_retire(mt, n);
+      // `p` has lost a key as well
+      n = p;
+      continue;
+    }
+
+    if (count)
+      break;
+
+    // first border mass_node of a layer is never removed
+    mass_node *prev = mass_node_get_locked_prev(n);
+    if (prev == 0)
+      break;
+
+    mass_node *p = mass_node_get_locked_parent(n);
+    assert(p && is_interior(mass_node_get_version_unsafe(p)));
+    // lower key of the second child is lower key of the successor of `n`
+    if (mass_node_get_first_child(p) == n)
+      mass_tree_replace_fence(p, mass_node_get_lower_key(mass_node_get_next(n)));
+    interior_mass_node_remove(p, n);
+    mass_node_set_deleted(n);
+    mass_node_unlink(n);
+    mass_node_unlock(prev);
+    mass_node_unlock(n);
+    mass_tree_retire(mt, n);
+    mass_tree_shrink_interior(mt, p);
+    return ;
+  }
+  mass_node_unlock(n);
+}
+
+static int _mass_tree_delete(mass_tree *mt, const void *key, uint32_t len)
+{
+  uint32_t off;
+  mass_node *r, *n;
+
+  assert(mt->u64 == 0);
+
+  restart:
+  off = 0;
+  // it's ok to use stale root
+  r = mt->root;
+
+  again:
+  n = mass_tree_lock_border(r, get_next_keyslice(key, len, off));
+  if (unlikely(n == 0))
+    goto restart;
+
+  void *ret = border_mass_node_remove(n, key, len, off);
+  switch ((uint64_t)ret) {
+    case 0: // key does not exist
+      mass_node_unlock(n);
+      return 0;
+    case 1: // key removed
+      mass_tree_shrink(mt, n);
+      return 1;
+    default: // need to go to a deeper layer
+      mass_node_unlock(n);
+      r = (mass_node *)ret;
+      off += sizeof(uint64_t);
+      goto again;
+  }
+}
+
+// return 1 if key is removed, 0 if key does not exist
+int mass_tree_delete(mass_tree *mt, const void *key, uint32_t len)
+{
+  epoch_enter();
+  int ret = _mass_tree_delete(mt, key, len);
+  epoch_exit();
+  mass_tree_account(mt);
+  return ret;
+}
+
+static int _mass_tree_put_u64(mass_tree *mt, uint64_t key, const void *val, int upsert, void **old)
+{
+  mass_node *n;
+
+  assert(mt->u64);
+
+  restart:
+  // it's ok to use stale root
+  n = mass_tree_lock_border(mt->root, key);
+  if (unlikely(n == 0))
+    goto restart;
+
+  switch (border_mass_node_insert_u64(n, key, val)) {
+    case 0: // key existed
+      if (upsert)
+        assert(border_mass_node_update_u64(n, key, val, old) == 1);
+      mass_node_unlock(n);
+      return 0;
+    case 1: // key inserted
+      mass_node_unlock(n);
+      return 1;
+    default: { // mass_node is full, need to split and promote
+      uint64_t fence = 0;
+      mass_node *n1 = mass_node_split(n, &fence);
+      assert(fence);
+      // equal is not possible
+      if (mass_compare_key(key, fence) < 0)
+        assert(border_mass_node_insert_u64(n, key, val) == 1);
+      else
+        assert(border_mass_node_insert_u64(n1, key, val) == 1);
+
+      mass_tree_promote_split_mass_node(mt, n, fence, n1);
+      return 1;
+    }
+  }
+}
+
+// return 1 if key is inserted, 0 if key existed and value is not changed
+int mass_tree_put_u64(mass_tree *mt, uint64_t key, const void *val)
+{
+  epoch_enter();
+  int ret = _mass_tree_put_u64(mt, key, val, 0 /* upsert */, 0 /* old */);
+  epoch_exit();
+  mass_tree_account(mt);
+  return ret;
+}
+
+// return 1 if key is inserted, 0 if key existed and its value is replaced, previous value is stored
+// in `old` if it's not null
+int mass_tree_upsert_u64(mass_tree *mt, uint64_t key, const void *val, void **old)
+{
+  epoch_enter();
+  int ret = _mass_tree_put_u64(mt, key, val, 1 /* upsert */, old);
+  epoch_exit();
+  mass_tree_account(mt);
+  return ret;
+}
+
+// replace value of the key, previous value is stored in `old` if it's not null,
+// return 1 on success, 0 if key does not exist
+int mass_tree_update_u64(mass_tree *mt, uint64_t key, const void *val, void **old)
+{
+  assert(mt->u64);
+
+  epoch_enter();
+  mass_node *n;
+  while ((n = mass_tree_lock_border(mt->root, key)) == 0)
+    ;
+  // lock only serializes writers, readers are not blocked
+  int ret = border_mass_node_update_u64(n, key, val, old);
+  mass_node_unlock(n);
+  epoch_exit();
+  mass_tree_account(mt);
+  return ret;
+}
+
+static void* _mass_tree_get_u64(mass_tree *mt, uint64_t key)
+{
+  uint32_t v;
+  mass_node *n;
+
+  assert(mt->u64);
+
+  restart:
+  // it's ok to use stale root
+  n = find_border_mass_node(mt->root, key, &v);
+
+  forward:
+  // mass_node has been removed
+  if (unlikely(is_deleted(v)))
+    goto restart;
+
+  border_mass_node_prefetch_read(n);
+
+  void *value;
+  int found = mass_node_search_u64(n, key, &value);
+
+  uint32_t diff = mass_node_get_version(n) ^ v;
+  if (diff != LOCK_BIT && diff != 0) {
+    v = mass_node_get_stable_version(n);
+    mass_node *next = mass_node_get_next(n);
+    // there might be inserts or inserts happened, traverse through the link
+    while (!is_deleted(v) && next && mass_node_include_key(next, key)) {
+      n = next;
+      v = mass_node_get_stable_version(n);
+      next = mass_node_get_next(n);
+    }
+    goto forward;
+  }
+
+  return found ? value : 0;
+}
+
+void* mass_tree_get_u64(mass_tree *mt, uint64_t key)
+{
+  epoch_enter();
+  void *ret = _mass_tree_get_u64(mt, key);
+  epoch_exit();
+  mass_tree_account(mt);
+  return ret;
+}
+
+// return 1 if key is removed, 0 if key does not exist
+int mass_tree_delete_u64(mass_tree *mt, uint64_t key)
+{
+  assert(mt->u64);
+
+  epoch_enter();
+  mass_node *n;
+  while ((n = mass_tree_lock_border(mt->root, key)) == 0)
+    ;
+  int ret = border_mass_node_remove_u64(n, key);
+  if (ret)
+    mass_tree_shrink(mt, n);
+  else
+    mass_node_unlock(n);
+  epoch_exit();
+  mass_tree_account(mt);
+  return ret;
+}
+
+typedef struct mass_scanner
+{
+  const void *start;      // 0 means no bound
+  uint32_t    start_len;
+  int         exclusive;  // whether `start` itself is excluded
+  int         reverse;
+  char       *key;        // key being visited, rebuilt from keyslices of each layer and its suffix
+  uint32_t    key_cap;
+  char       *last;       // last key visited, scan resumes from here after a conflict
+  uint32_t    last_cap;
+  uint32_t    last_len;
+  char       *resume;     // `start` after a conflict
+  uint32_t    resume_cap;
+  uint32_t    count;
+  uint32_t    limit;      // 0 means no limit
+  mass_scan_callback cb;
+  void       *arg;
+}mass_scanner;
+
+static inline void mass_scanner_reserve(char **buf, uint32_t *cap, uint32_t len)
+{
+  if (likely(len <= *cap))
+    return ;
+  while (*cap < len)
+    *cap *= 2;
+  *buf = (char *)realloc(*buf, *cap);
+  assert(*buf);
+}
+
+// append keyslice at offset `off` of key being visited
+static inline void mass_scanner_set_keyslice(mass_scanner *s, uint64_t keyslice, uint32_t off, uint32_t len)
+{
+  mass_scanner_reserve(&s->key, &s->key_cap, off + sizeof(uint64_t));
+  uint64_t slice = htobe64(keyslice);
+  memcpy(s->key + off, &slice, len);
+}
+
+// compare key bytes after `off`, bytes before `off` are equal
+static inline int mass_tree_key_compare(const void *k1, uint32_t l1, const void *k2, uint32_t l2, uint32_t off)
+{
+  uint32_t len = (l1 < l2 ? l1 : l2) - off;
+  int r = memcmp((const char *)k1 + off, (const char *)k2 + off, len);
+  if (r)
+    return r;
+  return l1 < l2 ? -1 : l1 > l2;
+}
+
+// rebuild key whose keyslice is at offset `off` into `s->key`, return its length
+static uint32_t mass_scanner_build_key(mass_scanner *s, uint64_t keyslice, void *suffix, void *lv, uint32_t off)
+{
+  uint32_t len = (uint32_t)(uint64_t)lv;
+  uint32_t coff = (uint32_t)((uint64_t)lv >> 32);
+  mass_scanner_set_keyslice(s, keyslice, off, coff - off);
+  mass_scanner_reserve(&s->key, &s->key_cap, len);
+  memcpy(s->key + coff, suffix, len - coff);
+  return len;
+}
+
+// return 0 to continue, 1 to stop
+static int mass_tree_scan_key(mass_scanner *s, uint32_t len, void *value)
+{
+  mass_scanner_reserve(&s->last, &s->last_cap, len);
+  memcpy(s->last, s->key, len);
+  s->last_len = len;
+  ++s->count;
+  if (s->cb(s->arg, s->key, len, value))
+    return 1;
+  return s->limit && s->count == s->limit;
+}
+
+// scan the layer whose root is `r` from left to right, or from right to left for reverse scan,
+// `bounded` means keys in this layer share first `off` bytes with `start`
+// return  0 to continue,
+// return +1 to stop,
+// return -1 for retry
+static int mass_tree_scan_layer(mass_scanner *s, mass_node *r, uint32_t off, int bounded)
+{
+  uint64_t cur = bounded ? get_next_keyslice(s->start, s->start_len, off) : (s->reverse ? ~(uint64_t)0 : 0);
+  // whether `start` has bytes in deeper layers
+  int deeper = bounded && s->start_len >= off + sizeof(uint64_t);
+
+  uint32_t v;
+  mass_node *n = find_border_mass_node(r, cur, &v), *from = 0;
+
+  uint64_t keyslice[max_key_count];
+  void *suffix[max_key_count], *lv[max_key_count], *value[max_key_count];
+  while (n) {
+    if (unlikely(is_deleted(v)))
+      return -1;
+
+    int count = border_mass_node_get_keys(n, keyslice, suffix, lv, value);
+    mass_node *next = s->reverse ? mass_node_get_prev(n) : mass_node_get_next(n);
+    // when moving backward, the predecessor we got might have split, keys moved to its new sibling
+    // would be missed
+    int adjacent = !from || mass_node_get_next(n) == from;
+
+    uint32_t diff = mass_node_get_version(n) ^ v;
+    if (unlikely(count < 0 || (diff != LOCK_BIT && diff != 0) || !adjacent))
+      return -1;
+
+    for (int j = 0; j < count; ++j) {
+      int i = s->reverse ? count - 1 - j : j;
+      int ret;
+      if (bounded) {
+        int c = mass_compare_key(keyslice[i], cur);
+        if (s->reverse ? c > 0 : c < 0)
+          continue;
+        bounded = 0;
+        if (c == 0) {
+          if (suffix[i]) {
+            uint32_t len = mass_scanner_build_key(s, keyslice[i], suffix[i], lv[i], off);
+            c = mass_tree_key_compare(s->key, len, s->start, s->start_len, off);
+            if ((s->reverse ? c > 0 : c < 0) || (c == 0 && s->exclusive))
+              continue;
+            ret = mass_tree_scan_key(s, len, value[i]);
+          } else if (deeper) {
+            mass_scanner_set_keyslice(s, keyslice[i], off, sizeof(uint64_t));
+            ret = mass_tree_scan_layer(s, (mass_node *)lv[i], off + sizeof(uint64_t), 1 /* bounded */);
+          } else if (s->reverse) {
+            // keys in deeper layer are longer than `start`
+            continue;
+          } else {
+            mass_scanner_set_keyslice(s, keyslice[i], off, sizeof(uint64_t));
+            ret = mass_tree_scan_layer(s, (mass_node *)lv[i], off + sizeof(uint64_t), 0 /* bounded */);
+          }
+          if (ret)
+            return ret;
+          continue;
+        }
+      }
+      if (suffix[i]) {
+        ret = mass_tree_scan_key(s, mass_scanner_build_key(s, keyslice[i], suffix[i], lv[i], off), value[i]);
+      } else {
+        mass_scanner_set_keyslice(s, keyslice[i], off, sizeof(uint64_t));
+        ret = mass_tree_scan_layer(s, (mass_node *)lv[i], off + sizeof(uint64_t), 0 /* bounded */);
+      }
+      if (ret)
+        return ret;
+    }
+
+    if (s->reverse)
+      from = n;
+    n = next;
+    if (n)
+      v = mass_node_get_stable_version(n);
+  }
+  return 0;
+}
+
+static uint32_t mass_tree_scan_range(mass_tree *mt, const void *start, uint32_t len, uint32_t limit,
+  mass_scan_callback cb, void *arg, int reverse)
+{
+  assert(mt->u64 == 0);
+
+  mass_scanner s;
+  s.start = start;
+  s.start_len = len;
+  s.exclusive = 0;
+  s.reverse = reverse;
+  s.key_cap = s.last_cap = s.resume_cap = 64;
+  s.key = (char *)malloc(s.key_cap);
+  s.last = (char *)malloc(s.last_cap);
+  s.resume = (char *)malloc(s.resume_cap);
+  s.last_len = 0;
+  s.count = 0;
+  s.limit = limit;
+  s.cb = cb;
+  s.arg = arg;
+
+  epoch_enter();
+  // it's ok to use stale root
+  while (mass_tree_scan_layer(&s, mt->root, 0 /* off */, s.start != 0) == -1) {
+    // mass_node is changed by another thread, resume from last key visited
+    if (s.count) {
+      char *tmp = s.resume;
+      uint32_t cap = s.resume_cap;
+      s.resume = s.last;
+      s.resume_cap = s.last_cap;
+      s.last = tmp;
+      s.last_cap = cap;
+      s.start = s.resume;
+      s.start_len = s.last_len;
+      s.exclusive = 1;
+    }
+  }
+  epoch_exit();
+  mass_tree_account(mt);
+
+  free((void *)s.key);
+  free((void *)s.last);
+  free((void *)s.resume);
+  return s.count;
+}
+
+// keys inserted or deleted during the scan may or may not be visited,
+// `cb` is called inside critical section, so it should not block
+// return number of keys visited
+uint32_t mass_tree_scan(mass_tree *mt, const void *start, uint32_t len, uint32_t limit, mass_scan_callback cb,
+  void *arg)
+{
+  return mass_tree_scan_range(mt, start, len, limit, cb, arg, 0 /* reverse */);
+}
+
+uint32_t mass_tree_reverse_scan(mass_tree *mt, const void *start, uint32_t len, uint32_t limit,
+  mass_scan_callback cb, void *arg)
+{
+  return mass_tree_scan_range(mt, start, len, limit, cb, arg, 1 /* reverse */);
+}
+
+// number of lookups that are interleaved in `mass_tree_multi_get`
+#define multi_get_group 8
+
+#define lookup_root   0
+#define lookup_child  1
+#define lookup_border 2
+
+// a lookup that is suspended on a mass_node being prefetched
+typedef struct mass_lookup
+{
+  int         stage;
+  uint32_t    idx;
+  const void *key;
+  uint32_t    len;
+  uint32_t    off;
+  uint32_t    v;     // stable version of `n`
+  uint64_t    cur;   // current keyslice
+  mass_node  *n;
+  mass_node  *child;
+}mass_lookup;
+
+// start to search in a layer whose root is `r`
+static inline void mass_tree_lookup_layer(mass_lookup *l, mass_node *r)
+{
+  l->cur = get_next_keyslice_and_advance(l->key, l->len, &l->off);
+  l->n = r;
+  l->stage = lookup_root;
+  mass_node_prefetch(r);
+}
+
+static inline void mass_tree_lookup_start(mass_tree *mt, mass_lookup *l, uint32_t idx, const void *key,
+  uint32_t len)
+{
+  l->idx = idx;
+  l->key = key;
+  l->len = len;
+  l->off = 0;
+  // it's ok to use stale root
+  mass_tree_lookup_layer(l, mt->root);
+}
+
+// advance lookup `l` by one mass_node, then prefetch the next mass_node so that it's in cache
+// when we come back, return 1 if the lookup is finished and `value` is set
+static int mass_tree_lookup_step(mass_tree *mt, mass_lookup *l, void **value)
+{
+  mass_node *n = l->n;
+  uint32_t diff;
+
+  switch (l->stage) {
+    case lookup_root: {
+      uint32_t v = mass_node_get_stable_version(n);
+      // it's possible that a root has split
+      if (!is_root(v)) {
+        l->n = mass_node_get_parent(n);
+        mass_node_prefetch(l->n);
+        return 0;
+      }
+      l->v = v;
+      break;
+    }
+    case lookup_child: {
+      // this is a crucial step, child version must be read before parent is validated
+      uint32_t v1 = mass_node_get_stable_version(l->child);
+      diff = mass_node_get_version(n) ^ l->v;
+      if (diff != LOCK_BIT && diff != 0)
+        goto fallback;
+      l->n = n = l->child;
+      l->v = v1;
+      break;
+    }
+    case lookup_border: {
+      void *suffix, *val;
+      void *lv = mass_node_search(n, l->cur, &suffix, &val);
+      diff = mass_node_get_version(n) ^ l->v;
+      if ((diff != LOCK_BIT && diff != 0) || unlikely((uint64_t)lv == 1))
+        goto fallback;
+      if (suffix) {
+        uint32_t clen = (uint32_t)((uint64_t)lv);
+        uint32_t off = l->off;
+        if (clen == l->len && !memcmp((char *)l->key + off, suffix, l->len - off))
+          *value = val;
+        else
+          *value = 0;
+        return 1;
+      }
+      if (lv) {
+        mass_tree_lookup_layer(l, (mass_node *)lv);
+        return 0;
+      }
+      *value = 0;
+      return 1;
+    }
+  }
+
+  if (is_deleted(l->v))
+    goto fallback;
+
+  // `n` is stable and in cache now
+  if (is_border(l->v)) {
+    border_mass_node_prefetch_read(n);
+    l->stage = lookup_border;
+  } else {
+    l->child = mass_node_descend(n, l->cur);
+    assert(l->child);
+    mass_node_prefetch(l->child);
+    l->stage = lookup_child;
+  }
   return 0;
+
+  fallback:
+  // concurrent insert or split happened, this is rare so just do a normal lookup
+  *value = mass_tree_get(mt, l->key, l->len);
+  return 1;
+}
+
+// lookup `n` keys and store their values in `values`, 0 if key does not exist,
+// lookups are interleaved so that cache misses of different keys overlap
+void mass_tree_multi_get(mass_tree *mt, const void **keys, const uint32_t *lens, uint32_t n, void **values)
+{
+  assert(mt->u64 == 0);
+
+  mass_lookup group[multi_get_group];
+  int active = 0;
+  uint32_t next = 0;
+
+  epoch_enter();
+
+  for (; active < multi_get_group && next < n; ++active, ++next)
+    mass_tree_lookup_start(mt, &group[active], next, keys[next], lens[next]);
+
+  while (active) {
+    for (int i = 0; i < active; ) {
+      mass_lookup *l = &group[i];
+      if (mass_tree_lookup_step(mt, l, &values[l->idx]) == 0) {
+        ++i;
+      } else if (next < n) {
+        mass_tree_lookup_start(mt, l, next, keys[next], lens[next]);
+        ++next;
+        ++i;
+      } else {
+        group[i] = group[--active];
+      }
+    }
+  }
+  epoch_exit();
+  mass_tree_account(mt);
 }
@@ -11,13 +11,62 @@
 
 typedef struct mass_tree
 {
-  mass_node *root;
+  mass_node  *root;
+  uint64_t    removals; // number of mass_node removed, a cursor hint is dropped when it changes
+  uint32_t    u64;      // keys are uint64_t, see `new_mass_tree_u64`
+  // counters are only written under contention, keep them away from `root`
+  char        padding[64 - sizeof(mass_node *) - sizeof(uint64_t) - sizeof(uint32_t)];
+  mass_stats  stats;
 }mass_tree;
 
+// a cursor remembers where last key was found, a key close to it starts from there instead of root,
+// a cursor is owned by one thread
+typedef struct mass_cursor
+{
+  mass_tree  *mt;
+  uint64_t    removals; // `mt->removals` when the hint is recorded
+  mass_node  *root;     // root of the layer that holds last key, 0 means no hint
+  uint32_t    off;      // key offset of this layer
+  char       *prefix;   // first `off` bytes of last key
+  uint32_t    prefix_cap;
+  mass_node  *border;   // border mass_node that holds last key, 0 means no hint
+}mass_cursor;
+
 mass_tree* new_mass_tree();
 void free_mass_tree(mass_tree *mt);
 int mass_tree_put(mass_tree *mt, const void *key, uint32_t len, const void *val);
+int mass_tree_upsert(mass_tree *mt, const void *key, uint32_t len, const void *val, void **old);
+int mass_tree_update(mass_tree *mt, const void *key, uint32_t len, const void *val, void **old);
 void* mass_tree_get(mass_tree *mt, const void *key, uint32_t len);
+int mass_tree_delete(mass_tree *mt, const void *key, uint32_t len);
+
+// return non-zero to stop the scan, `key` is only valid inside the callback
+typedef int (*mass_scan_callback)(void *arg, const void *key, uint32_t len, void *value);
+
+// visit at most `limit` keys (0 means no limit) that are not smaller (or not bigger for reverse scan)
+// than `start` in order, `start` can be 0 which means no bound
+uint32_t mass_tree_scan(mass_tree *mt, const void *start, uint32_t len, uint32_t limit, mass_scan_callback cb,
+  void *arg);
+uint32_t mass_tree_reverse_scan(mass_tree *mt, const void *start, uint32_t len, uint32_t limit,
+  mass_scan_callback cb, void *arg);
+void mass_tree_multi_get(mass_tree *mt, const void **keys, const uint32_t *lens, uint32_t n, void **values);
+
+// a `u64` mass tree only has one layer, keyslice is the whole key and value is stored in place of
+// key length and offset, a key is never copied, it's only accessed by functions with `u64` suffix
+mass_tree* new_mass_tree_u64();
+int mass_tree_put_u64(mass_tree *mt, uint64_t key, const void *val);
+int mass_tree_upsert_u64(mass_tree *mt, uint64_t key, const void *val, void **old);
+int mass_tree_update_u64(mass_tree *mt, uint64_t key, const void *val, void **old);
+void* mass_tree_get_u64(mass_tree *mt, uint64_t key);
+int mass_tree_delete_u64(mass_tree *mt, uint64_t key);
+
+mass_cursor* new_mass_cursor(mass_tree *mt);
+void free_mass_cursor(mass_cursor *c);
+int mass_cursor_put(mass_cursor *c, const void *key, uint32_t len, const void *val);
+void* mass_cursor_get(mass_cursor *c, const void *key, uint32_t len);
+
+// contention counters, they are cumulative since mt is created
+void mass_tree_get_stats(mass_tree *mt, mass_stats *stats);
 
 #ifdef Test
 
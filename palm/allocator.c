@@ -184,7 +184,7 @@ void* allocator_alloc_small(size_t size)
   allocator *a = get_thread_allocator();
 
   // 8 bytes alignment
-  size = (size + 8) & (~((size_t)8));
+  size = (size + 7) & (~((size_t)7));
 
   int success;
   void *ptr = block_alloc(a->small_curr, size, &success);
@@ -0,0 +1,433 @@
+/**
+ *    author:     UncP
+ *    date:    2026-10-17
+ *    license:    BSD-3
+**/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif // __linux__
+#ifdef Test
+#include <stdio.h>
+#endif
+
+#include "batch.h"
+
+static uint32_t batch_size = batch_min_size;
+
+#define batch_size_mask (~0xfff)
+
+void set_batch_size(uint32_t size)
+{
+  batch_size = size < batch_min_size ? batch_min_size : size > batch_max_size ? batch_max_size : size;
+  batch_size &= batch_size_mask;
+}
+
+uint32_t get_batch_size()
+{
+  return batch_size;
+}
+
+typedef uint32_t bindex_t;
+#define bindex_byte sizeof(bindex_t)
+
+#define get_ptr(b, off) ((char *)b->data + off)
+#define get_op(b, off)  ((uint32_t)(*(uint8_t *)(get_ptr(b, off) - sizeof(uint8_t))))
+#define get_len(b, off) ((uint32_t)(*(len_t *)get_ptr(b, off)))
+#define get_key(b, off) (get_ptr(b, off) + key_byte)
+#define get_val(b, off) ((void *)(*(val_t *)(get_key(b, off) + get_len(b, off))))
+#define batch_index(b)  ((bindex_t *)((char *)b + (b->size - (b->keys * bindex_byte))))
+
+/****** BATCH allocator ******/
+
+// batches are much larger than nodes and live as long as their owner, so they are mapped directly
+// instead of going through the node allocator, big batches are backed by huge pages if possible
+static batch* batch_alloc(uint32_t size)
+{
+#ifdef MAP_ANONYMOUS
+  void *buf = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#else
+  void *buf = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+#endif
+  assert(buf != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+  if (size >= ((uint32_t)2 << 20))
+    madvise(buf, size, MADV_HUGEPAGE);
+#endif
+  return (batch *)buf;
+}
+
+static void batch_dealloc(batch *b)
+{
+  munmap((void *)b, b->size);
+}
+
+/****** BATCH operation ******/
+
+batch* new_batch()
+{
+  batch *b = batch_alloc(batch_size);
+
+  b->keys = 0;
+  b->off  = 0;
+  b->size = batch_size;
+  b->sorted = 1;
+  b->scans = 0;
+  b->state = batch_done;
+
+  return b;
+}
+
+void free_batch(batch *b)
+{
+  batch_dealloc(b);
+}
+
+inline void batch_clear(batch *b)
+{
+  b->keys = 0;
+  b->off  = 0;
+  b->sorted = 1;
+  b->scans = 0;
+  b->state = batch_done;
+}
+
+// append an operation to batch, this function allows duplicate key,
+// index is not sorted until `batch_sort` is called
+static int batch_write(batch *b, uint32_t op, const void *key1, uint32_t len1, const void *val)
+{
+  bindex_t *index = batch_index(b) - 1;
+
+  // check if there is enough space
+  if (unlikely((char *)b->data + (b->off + sizeof(uint8_t) /* op */ + key_byte + len1 + value_bytes) > (char *)index))
+    return -1;
+
+  // set op type before kv
+  *((uint8_t *)(b->data + b->off)) = (uint8_t)op;
+  b->off += sizeof(uint8_t);
+
+  // index grows towards lower address, so the latest operation is always index[0]
+  index[0] = b->off;
+  b->sorted = 0;
+
+  *((len_t *)(b->data + b->off)) = (len_t)len1;
+  b->off += key_byte;
+  memcpy(b->data + b->off, key1, len1);
+  b->off += len1;
+  *((val_t *)(b->data + b->off)) = likely(val) ? *(val_t *)(&val) : 0;
+  b->off += value_bytes;
+
+  ++b->keys;
+
+  return 1;
+}
+
+int batch_add_write(batch *b, const void *key, uint32_t len, const void *val)
+{
+  return batch_write(b, Write, key, len, val);
+}
+
+int batch_add_read(batch *b, const void *key, uint32_t len)
+{
+  return batch_write(b, Read, key, len, 0);
+}
+
+// value of the deleted key is returned, 0 if there is no such key
+int batch_add_delete(batch *b, const void *key, uint32_t len)
+{
+  return batch_write(b, Delete, key, len, 0);
+}
+
+// `r` is filled when the batch is executed, it must not be touched until then
+int batch_add_scan(batch *b, const void *key, uint32_t len, scan_result *r)
+{
+  assert(r);
+  int ret = batch_write(b, Scan, key, len, (const void *)r);
+  if (ret == 1)
+    ++b->scans;
+  return ret;
+}
+
+/****** BATCH sort ******/
+
+// operations with the same key keep the order they are added in, since offset increases in that
+// order, operations are sorted by (key, offset)
+static inline int batch_compare(batch *b, bindex_t off1, bindex_t off2, uint32_t depth)
+{
+  int r = compare_key(get_key(b, off1) + depth, get_len(b, off1) - depth,
+    get_key(b, off2) + depth, get_len(b, off2) - depth);
+  return r ? r : (off1 < off2 ? -1 : +1);
+}
+
+static int compare_offset(const void *a, const void *b)
+{
+  bindex_t off1 = *(const bindex_t *)a, off2 = *(const bindex_t *)b;
+  return off1 < off2 ? -1 : off1 > off2 ? +1 : 0;
+}
+
+// key byte at `depth` plus 1, or 0 if key is not that long, so that shorter key comes first
+static inline uint32_t batch_byte_at(batch *b, bindex_t off, uint32_t depth)
+{
+  return depth < get_len(b, off) ? (uint32_t)(uint8_t)get_key(b, off)[depth] + 1 : 0;
+}
+
+#define radix_buckets 257
+#define radix_cutoff  32 // use insertion sort for small buckets
+
+static void insertion_sort(batch *b, bindex_t *index, uint32_t n, uint32_t depth)
+{
+  for (uint32_t i = 1; i < n; ++i) {
+    bindex_t off = index[i];
+    uint32_t j = i;
+    for (; j && batch_compare(b, index[j - 1], off, depth) > 0; --j)
+      index[j] = index[j - 1];
+    index[j] = off;
+  }
+}
+
+// permute `index` in place so that it is grouped by key byte at `depth` (american flag sort)
+static void radix_permute(batch *b, bindex_t *index, uint32_t depth, uint32_t *count)
+{
+  uint32_t next[radix_buckets], end[radix_buckets];
+  for (uint32_t c = 0, sum = 0; c < radix_buckets; ++c) {
+    next[c] = sum;
+    sum += count[c];
+    end[c] = sum;
+  }
+
+  for (uint32_t c = 0; c < radix_buckets; ++c) {
+    while (next[c] < end[c]) {
+      bindex_t off = index[next[c]];
+      uint32_t k = batch_byte_at(b, off, depth);
+      // move `off` to its bucket, and take the element there, until one belongs to bucket `c`
+      while (k != c) {
+        bindex_t tmp = index[next[k]];
+        index[next[k]++] = off;
+        off = tmp;
+        k = batch_byte_at(b, off, depth);
+      }
+      index[next[c]++] = off;
+    }
+  }
+}
+
+// msd radix sort on key bytes, all the keys in `index` have the same first `depth` bytes
+static void radix_sort(batch *b, bindex_t *index, uint32_t n, uint32_t depth)
+{
+  uint32_t count[radix_buckets];
+  for (;;) {
+    if (n < radix_cutoff) {
+      insertion_sort(b, index, n, depth);
+      return ;
+    }
+
+    memset(count, 0, sizeof(count));
+    for (uint32_t i = 0; i < n; ++i)
+      ++count[batch_byte_at(b, index[i], depth)];
+
+    // skip common prefix without recursion
+    if (count[0] == 0) {
+      uint32_t c = 1;
+      while (count[c] == 0) ++c;
+      if (count[c] == n) {
+        ++depth;
+        continue;
+      }
+    }
+    break;
+  }
+
+  radix_permute(b, index, depth, count);
+
+  // keys that end at `depth` are equal, order them by offset
+  if (count[0] > 1)
+    qsort(index, count[0], bindex_byte, compare_offset);
+
+  for (uint32_t c = 1, beg = count[0]; c < radix_buckets; beg += count[c], ++c)
+    if (count[c] > 1)
+      radix_sort(b, index + beg, count[c], depth + 1);
+}
+
+// sort operations by key, operations with the same key keep the order they are added in
+void batch_sort(batch *b)
+{
+  if (b->sorted) return ;
+  b->sorted = 1;
+
+  bindex_t *index = batch_index(b);
+  uint32_t n = b->keys;
+
+  // operations added in ascending order need only a reversal, since index grows downward
+  uint32_t i = 1;
+  while (i < n && batch_compare(b, index[i], index[i - 1], 0) < 0)
+    ++i;
+  if (i >= n) {
+    for (uint32_t j = 0; j < n / 2; ++j) {
+      bindex_t tmp = index[j];
+      index[j] = index[n - 1 - j];
+      index[n - 1 - j] = tmp;
+    }
+    return ;
+  }
+
+  radix_sort(b, index, n, 0);
+}
+
+/****** BATCH completion ******/
+
+// a waiter spins this many rounds before it sleeps, a small batch usually finishes soon
+#define batch_spins 512
+
+// called by the worker that finishes the batch, batch must not be touched after this since its owner
+// might reuse or free it right away
+void batch_set_done(batch *b)
+{
+  uint32_t *word = &b->state;
+  if (__atomic_exchange_n(word, batch_done, __ATOMIC_ACQ_REL) == batch_waiting) {
+#ifdef __linux__
+    // batch might be freed already, waking up a futex at a stale address is harmless
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+#endif // __linux__
+  }
+}
+
+int batch_is_done(batch *b)
+{
+  return __atomic_load_n(&b->state, __ATOMIC_ACQUIRE) == batch_done;
+}
+
+// wait until batch is done, return immediately if batch is not executed
+void batch_wait(batch *b)
+{
+  for (int i = 0; ; ++i) {
+    uint32_t state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+    if (state == batch_done)
+      return ;
+    if (i < batch_spins) {
+      __asm__ volatile("pause" ::: "memory");
+      continue;
+    }
+  #ifdef __linux__
+    // tell the worker that someone is sleeping, then sleep until state changes
+    if (state == batch_running && !__atomic_compare_exchange_n(&b->state, &state, batch_waiting,
+      0 /* weak */, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      continue;
+    syscall(SYS_futex, &b->state, FUTEX_WAIT_PRIVATE, batch_waiting, 0, 0, 0);
+  #else
+    sched_yield();
+  #endif // __linux__
+  }
+}
+
+// read an operation at index, batch must be sorted
+inline void batch_read_at(batch *b, uint32_t idx, uint32_t *op, void **key, uint32_t *len, void **val)
+{
+  // TODO: remove this
+  assert(idx < b->keys && b->sorted);
+  bindex_t *index = batch_index(b);
+  bindex_t off = index[idx];
+  *op  = get_op(b, off);
+  *key = (void *)get_key(b, off);
+  *len = get_len(b, off);
+  *val = (void *)(get_key(b, off) + get_len(b, off));
+}
+
+// get the value at index after batch is executed, batch must be sorted
+inline void* batch_get_value_at(batch *b, uint32_t idx)
+{
+  if (idx >= b->keys) return 0;
+  assert(b->sorted);
+  bindex_t *index = batch_index(b);
+  return get_val(b, index[idx]);
+}
+
+/****** SCAN result ******/
+
+void init_scan_result(scan_result *r, uint32_t max, void *buf, uint32_t size)
+{
+  r->max  = max;
+  r->size = size;
+  r->buf  = (char *)buf;
+  r->keys = 0;
+  r->off  = 0;
+}
+
+// return 0 if `r` can not hold more kv pairs
+int scan_result_append(scan_result *r, const void *key, uint32_t len, const void *val)
+{
+  if (r->keys == r->max || r->off + key_byte + len + value_bytes > r->size)
+    return 0;
+
+  *((len_t *)(r->buf + r->off)) = (len_t)len;
+  r->off += key_byte;
+  memcpy(r->buf + r->off, key, len);
+  r->off += len;
+  *((val_t *)(r->buf + r->off)) = *(val_t *)(&val);
+  r->off += value_bytes;
+
+  ++r->keys;
+  return 1;
+}
+
+// read the kv pair at `*off` and advance `*off`, return 0 if there is no more kv pair
+int scan_result_next(scan_result *r, uint32_t *off, const void **key, uint32_t *len, void **val)
+{
+  if (*off >= r->off)
+    return 0;
+
+  *len = (uint32_t)(*(len_t *)(r->buf + *off));
+  *key = (const void *)(r->buf + *off + key_byte);
+  *val = (void *)(*(val_t *)(r->buf + *off + key_byte + *len));
+  *off += key_byte + *len + value_bytes;
+  return 1;
+}
+
+#ifdef Test
+
+static void print_op(batch *b, bindex_t off)
+{
+  static const char *ops[] = {"r", "w", "d", "s"};
+  printf("%s %4u  %u  %lu  %lu\n", ops[get_op(b, off)], off, get_len(b, off),
+    *(uint64_t *)get_key(b, off), (val_t)get_val(b, off));
+}
+
+void batch_print(batch *b, int detail)
+{
+  assert(b);
+
+  printf("keys: %u    offset: %u  size: %u  scans: %u\n", b->keys, b->off, b->size, b->scans);
+
+  bindex_t *index = batch_index(b);
+  if (detail) {
+    for (uint32_t i = 0; i < b->keys; ++i)
+      print_op(b, index[i]);
+  } else {
+    if (b->keys > 0)
+      print_op(b, index[0]);
+    if (b->keys > 1)
+      print_op(b, index[b->keys - 1]);
+  }
+  printf("\n");
+}
+
+// verify that all keys in batch are in ascending order, duplicate keys are allowed
+void batch_validate(batch *b)
+{
+  assert(b && b->sorted);
+
+  bindex_t *index = batch_index(b);
+  for (uint32_t i = 1; i < b->keys; ++i)
+    assert(compare_key(get_key(b, index[i - 1]), get_len(b, index[i - 1]),
+      get_key(b, index[i]), get_len(b, index[i])) <= 0 && (compare_key(get_key(b, index[i - 1]),
+      get_len(b, index[i - 1]), get_key(b, index[i]), get_len(b, index[i])) || index[i - 1] < index[i]));
+}
+
+#endif /* Test */
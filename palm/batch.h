@@ -0,0 +1,102 @@
+/**
+ *    author:     UncP
+ *    date:    2026-10-17
+ *    license:    BSD-3
+**/
+
+/**
+ *   batch is a buffer of read & write & delete & scan operations, it is not a node, so its size is independent of
+ *   node size and it can hold millions of operations, key may be duplicated
+ *
+ *   layout of a batch in bytes:
+ *        keys      offset      size      sorted      scans      state
+ *     |     4     |     4     |     4     |     4     |     4     |     4     |    operations   |
+ *     |                                    operations                                          |
+ *     |                        operations                           |           index          |
+ *
+ *   layout of an operation:
+ *            op       key len                           ptr
+ *      |     1     |     1     |        key        |     8     |
+ *
+ *   index is an array of 32-bit offsets of operations, operations are appended in any order and
+ *   sorted by key only once when the batch is executed
+ *
+ *   a scan operation sees the tree after all the other operations in its batch are done, its result
+ *   is written to a `scan_result` provided by caller, `ptr` of a scan operation points to it
+ *
+ *   when a batch is done, results of its operations are ready and it can be refilled, its owner can poll
+ *   it with `batch_is_done` or wait for it with `batch_wait`, without waiting for the whole queue
+**/
+
+#ifndef _batch_h_
+#define _batch_h_
+
+#include <stdint.h>
+
+#include "node.h"
+
+#define batch_min_size (((uint32_t)1) << 12) //  4kb
+#define batch_max_size (((uint32_t)1) << 30) //  1gb
+
+// batch state, a batch is done unless it is queued or being executed by a palm tree
+#define batch_running 0
+#define batch_waiting 1 // batch is running and someone sleeps on it
+#define batch_done    2
+
+typedef struct batch
+{
+  uint32_t keys;    // number of operations
+  uint32_t off;     // current data offset
+  uint32_t size;    // size of this batch in bytes, batch keeps its size when `batch_size` changes
+  uint32_t sorted;  // whether index is sorted by key
+  uint32_t scans;   // number of scan operations
+  uint32_t state;   // whether the batch is done, also a futex word for `batch_wait`
+  char     data[0]; // to place all the operations & the index
+}batch;
+
+/**
+ *   result of a scan operation, kv pairs that are not smaller than the start key are written to `buf`
+ *   in ascending order, until there are `max` kv pairs or `buf` is full or there is no more key
+ *
+ *   layout of a kv pair in `buf`:
+ *        key len                           ptr
+ *     |     1     |        key        |     8     |
+**/
+typedef struct scan_result
+{
+  uint32_t  max;  // maximum number of kv pairs, set by caller
+  uint32_t  size; // size of `buf` in bytes, set by caller
+  char     *buf;  // kv pairs, provided by caller
+  uint32_t  keys; // number of kv pairs returned
+  uint32_t  off;  // bytes of `buf` used
+}scan_result;
+
+void init_scan_result(scan_result *r, uint32_t max, void *buf, uint32_t size);
+int scan_result_append(scan_result *r, const void *key, uint32_t len, const void *val);
+int scan_result_next(scan_result *r, uint32_t *off, const void **key, uint32_t *len, void **val);
+
+void set_batch_size(uint32_t size);
+uint32_t get_batch_size();
+
+batch* new_batch();
+void free_batch(batch *b);
+void batch_clear(batch *b);
+int batch_add_write(batch *b, const void *key, uint32_t len, const void *val);
+int batch_add_read(batch *b, const void *key, uint32_t len);
+int batch_add_delete(batch *b, const void *key, uint32_t len);
+int batch_add_scan(batch *b, const void *key, uint32_t len, scan_result *r);
+void batch_sort(batch *b);
+void batch_set_done(batch *b);
+int batch_is_done(batch *b);
+void batch_wait(batch *b);
+void batch_read_at(batch *b, uint32_t idx, uint32_t *op, void **key, uint32_t *len, void **val);
+void* batch_get_value_at(batch *b, uint32_t idx);
+
+#ifdef Test
+
+void batch_print(batch *b, int detail);
+void batch_validate(batch *b);
+
+#endif /* Test */
+
+#endif /* _batch_h_ */
@@ -9,126 +9,198 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sched.h>
+#ifdef __linux__
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif // __linux__
 
 #include "bounded_queue.h"
 
-bounded_queue* new_bounded_queue(int total)
+// sequence number of a slot that is free for position `pos`, or holds an element ready at `pos`,
+// they never collide so that the queue can have only 1 slot
+#define free_seq(pos)  ((pos) << 1)
+#define ready_seq(pos) (((pos) << 1) | 1)
+
+// a waiter spins this many rounds before it sleeps, since a busy producer usually comes back soon
+#define queue_spins 512
+
+// wait until `cond` holds, a waiter that sleeps on futex word `w` is woken up when `w` is bumped,
+// `w` must be bumped after anything in `cond` changes
+#define queue_wait(q, w, cond) {                                   \
+  for (int i = 0; !(cond); ++i) {                                  \
+    if (i < queue_spins) {                                         \
+      __asm__ volatile("pause" ::: "memory");                      \
+      continue;                                                    \
+    }                                                              \
+    __atomic_add_fetch(&(q)->w##_waiters, 1, __ATOMIC_SEQ_CST);    \
+    uint32_t value = __atomic_load_n(&(q)->w, __ATOMIC_SEQ_CST);   \
+    if (!(cond))                                                   \
+      queue_sleep(&(q)->w, value);                                 \
+    __atomic_sub_fetch(&(q)->w##_waiters, 1, __ATOMIC_SEQ_CST);    \
+  }                                                                \
+}
+
+static void queue_sleep(uint32_t *word, uint32_t value)
+{
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, 0, 0, 0);
+#else
+  (void)word;
+  (void)value;
+  sched_yield();
+#endif // __linux__
+}
+
+// bump futex word `word`, system call is only made when someone might be sleeping on it
+static void queue_wake(uint32_t *word, uint32_t *waiters)
+{
+  __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+  if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+#else
+  (void)waiters;
+#endif // __linux__
+}
+
+// queue depth is only limited by memory, but a producer should not refill a batch that might be
+// in the queue, so it needs at least `total + 1` batches
+bounded_queue* new_bounded_queue(int total, int consumers)
 {
   if (total <= 0) total = 1;
-  // we don't use a big queue to avoid too much batch memory
-  if (total >= 8) total = 8;
+  if (consumers <= 0) consumers = 1;
 
   void *q_buf;
   assert(posix_memalign(&q_buf, 64, sizeof(bounded_queue)) == 0);
   bounded_queue *q = (bounded_queue *)q_buf;
 
-  q->total = total;
-  q->head  = 0;
   q->tail  = 0;
-  q->size  = 0;
+  q->head  = 0;
+  q->ready = 0;
+  q->ready_waiters = 0;
+  q->released = 0;
+  q->released_waiters = 0;
   q->clear = 0;
-
-  void *array;
-  assert(posix_memalign(&array, 64, sizeof(void *) * q->total) == 0);
-  memset(array, 0, sizeof(void *) * q->total);
-  q->array = (void **)array;
-
-  assert(pthread_mutex_init(&q->mutex, 0) == 0);
-  assert(pthread_cond_init(&q->cond, 0) == 0);
+  q->total = total;
+  q->consumers = consumers;
+
+  void *slots;
+  assert(posix_memalign(&slots, 64, sizeof(queue_slot) * q->total) == 0);
+  q->slots = (queue_slot *)slots;
+  for (int i = 0; i < q->total; ++i) {
+    q->slots[i].seq = free_seq((uint64_t)i);
+    q->slots[i].element = 0;
+    q->slots[i].done = 0;
+  }
 
   return q;
 }
 
 void free_bounded_queue(bounded_queue *q)
 {
-  pthread_mutex_destroy(&q->mutex);
-  pthread_cond_destroy(&q->cond);
-
-  free((void *)q->array);
+  free((void *)q->slots);
 
   free((void *)q);
 }
 
-void bounded_queue_wait_empty(bounded_queue *q)
+static inline queue_slot* bounded_queue_get_slot(bounded_queue *q, uint64_t pos)
 {
-  pthread_mutex_lock(&q->mutex);
-
-  // wait until all the queue elements have been processed
-  while (q->size)
-    pthread_cond_wait(&q->cond, &q->mutex);
+  return &q->slots[pos % (uint64_t)q->total];
+}
 
-  pthread_mutex_unlock(&q->mutex);
+static inline uint64_t bounded_queue_get_seq(queue_slot *slot)
+{
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
 }
 
-void bounded_queue_clear(bounded_queue *q)
+static inline int bounded_queue_is_clear(bounded_queue *q)
 {
-  pthread_mutex_lock(&q->mutex);
+  return __atomic_load_n(&q->clear, __ATOMIC_ACQUIRE);
+}
 
-  // wait until all the queue elements have been processed
-  while (q->size)
-    pthread_cond_wait(&q->cond, &q->mutex);
+// wait until all the queue elements have been processed
+void bounded_queue_wait_empty(bounded_queue *q)
+{
+  queue_wait(q, released,
+    __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE));
+}
 
-  q->clear = 1;
-  pthread_cond_broadcast(&q->cond);
+void bounded_queue_clear(bounded_queue *q)
+{
+  bounded_queue_wait_empty(q);
 
-  pthread_mutex_unlock(&q->mutex);
+  __atomic_store_n(&q->clear, 1, __ATOMIC_RELEASE);
+  queue_wake(&q->ready, &q->ready_waiters);
+  queue_wake(&q->released, &q->released_waiters);
 }
 
 void bounded_queue_enqueue(bounded_queue *q, void *element)
 {
   assert(element);
 
-  pthread_mutex_lock(&q->mutex);
-
-  while (q->array[q->tail] && !q->clear)
-    pthread_cond_wait(&q->cond, &q->mutex);
-
-  if (!q->clear) {
-    q->array[q->tail++] = element;
-    ++q->size;
-    if (q->tail == q->total)
-      q->tail = 0;
-    // wake up all the workers
-    pthread_cond_broadcast(&q->cond);
+  queue_slot *slot;
+  uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  while (1) {
+    slot = bounded_queue_get_slot(q, pos);
+    uint64_t seq = bounded_queue_get_seq(slot);
+    if (seq == free_seq(pos)) {
+      // slot is free, try to claim this position
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1 /* weak */, __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED))
+        break;
+    } else if (seq < free_seq(pos)) {
+      // queue is full, wait until the last consumer releases this slot
+      queue_wait(q, released, bounded_queue_get_seq(slot) != seq || bounded_queue_is_clear(q));
+      if (bounded_queue_is_clear(q))
+        return ;
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    } else {
+      // another producer has claimed this position
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
   }
 
-  pthread_mutex_unlock(&q->mutex);
+  slot->element = element;
+  __atomic_store_n(&slot->seq, ready_seq(pos), __ATOMIC_RELEASE);
+
+  // wake up all the workers
+  queue_wake(&q->ready, &q->ready_waiters);
 }
 
-// return the element at `idx` but don't proceed `q->head`
-void* bounded_queue_get_at(bounded_queue *q, int *idx)
+// return the element at `pos` and advance `pos`, element stays in the queue until it is dequeued,
+// return 0 if queue is cleared
+void* bounded_queue_get_at(bounded_queue *q, uint64_t *pos)
 {
-  pthread_mutex_lock(&q->mutex);
-
-  while (!q->array[*idx] && !q->clear)
-    pthread_cond_wait(&q->cond, &q->mutex);
-
-  void *r;
-  if (!q->clear) {
-    r = q->array[*idx];
-    if (++(*idx) == q->total)
-      *idx = 0;
-  } else {
-    r = 0;
-  }
+  queue_slot *slot = bounded_queue_get_slot(q, *pos);
+  uint64_t seq = ready_seq(*pos);
 
-  pthread_mutex_unlock(&q->mutex);
-  return r;
-}
+  queue_wait(q, ready, bounded_queue_get_seq(slot) == seq || bounded_queue_is_clear(q));
 
-void bounded_queue_dequeue(bounded_queue *q)
-{
-  pthread_mutex_lock(&q->mutex);
+  if (bounded_queue_get_seq(slot) != seq)
+    return 0;
 
-  assert(q->array[q->head]);
+  ++(*pos);
+  return slot->element;
+}
 
-  q->array[q->head] = 0;
-  --q->size;
+// a consumer is done with the element at `pos`, the last one releases it
+void bounded_queue_dequeue(bounded_queue *q, uint64_t pos)
+{
+  queue_slot *slot = bounded_queue_get_slot(q, pos);
+  assert(bounded_queue_get_seq(slot) == ready_seq(pos));
 
-  if (++q->head == q->total)
-    q->head = 0;
+  if (__atomic_add_fetch(&slot->done, 1, __ATOMIC_ACQ_REL) != (uint32_t)q->consumers)
+    return ;
 
-  pthread_cond_signal(&q->cond);
+  slot->done = 0;
+  slot->element = 0;
+  // producer of position `pos + total` can use this slot now
+  __atomic_store_n(&slot->seq, free_seq(pos + (uint64_t)q->total), __ATOMIC_RELEASE);
+  // elements might be released out of order, but all of them are when `head` reaches `tail`
+  __atomic_add_fetch(&q->head, 1, __ATOMIC_RELEASE);
 
-  pthread_mutex_unlock(&q->mutex);
+  queue_wake(&q->released, &q->released_waiters);
 }
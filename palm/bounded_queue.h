@@ -7,29 +7,43 @@
 #ifndef _bounded_queue_h_
 #define _bounded_queue_h_
 
-#include <pthread.h>
+#include <stdint.h>
 
-typedef struct bounded_queue
-{
-  int total;
-  int head; // point to the slot which to enqueue
-  int tail; // point to the slot which to dequeue
-  int size;
-  int clear;
-
-  void **array;
+// a lock-free ring with per-slot sequence numbers, Reference: Bounded MPMC queue (Dmitry Vyukov)
+//
+// any thread can enqueue, every consumer visits every element in order with its own position,
+// and an element is released when all the consumers have dequeued it
 
-  pthread_mutex_t mutex;
+typedef struct queue_slot
+{
+  uint64_t seq;     // whether this slot is free for a position or has an element ready at a position
+  void    *element;
+  uint32_t done;    // number of consumers that have dequeued this element
+}__attribute__((aligned(64))) queue_slot;
 
-  pthread_cond_t  cond;
+typedef struct bounded_queue
+{
+  uint64_t tail __attribute__((aligned(64))); // next position to enqueue, written by producers
+  uint64_t head __attribute__((aligned(64))); // number of elements released
+
+  // futex words, bumped when an element is ready or released, so that waiters can sleep on them
+  uint32_t ready __attribute__((aligned(64)));
+  uint32_t ready_waiters;
+  uint32_t released;
+  uint32_t released_waiters;
+  int      clear;
+
+  int         total;
+  int         consumers;
+  queue_slot *slots;
 }bounded_queue;
 
-bounded_queue* new_bounded_queue(int total);
+bounded_queue* new_bounded_queue(int total, int consumers);
 void free_bounded_queue(bounded_queue *q);
 void bounded_queue_wait_empty(bounded_queue *q);
 void bounded_queue_clear(bounded_queue *q);
 void bounded_queue_enqueue(bounded_queue *q, void *element);
-void* bounded_queue_get_at(bounded_queue *q, int *idx);
-void bounded_queue_dequeue(bounded_queue *q);
+void* bounded_queue_get_at(bounded_queue *q, uint64_t *pos);
+void bounded_queue_dequeue(bounded_queue *q, uint64_t pos);
 
-#endif /* _bounded_queue_h_ */
\ No newline at end of file
+#endif /* _bounded_queue_h_ */
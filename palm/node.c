@@ -14,7 +14,6 @@
 #include "node.h"
 
 static uint32_t node_size  = node_min_size;
-static uint32_t batch_size = node_min_size;
 static uint32_t node_offset = 0;
 static uint32_t node_id = 0;
 
@@ -31,17 +30,6 @@ uint32_t get_node_size()
   return node_size;
 }
 
-void set_batch_size(uint32_t size)
-{
-  batch_size = size < node_min_size ? node_min_size : size > node_max_size ? node_max_size : size;
-  batch_size &= node_size_mask;
-}
-
-uint32_t get_batch_size()
-{
-  return batch_size;
-}
-
 // for blink node, `node_size` is not really node size
 void set_node_offset(uint32_t offset)
 {
@@ -55,7 +43,6 @@ void set_node_offset(uint32_t offset)
 #define get_key(n, off) (get_ptr(n, off) + key_byte)
 #define get_val(n, off) ((void *)(*(val_t *)(get_key(n, off) + get_len(n, off))))
 #define node_index(n)   ((index_t *)((char *)n + (node_size - node_offset - (n->keys * index_byte))))
-#define batch_index(n)   ((index_t *)((char *)n + (batch_size - (n->keys * index_byte))))
 #define get_key_info(n, off, key, len) \
   const void *key = get_key(n, off);   \
   uint32_t len = get_len(n, off);
@@ -78,11 +65,10 @@ int compare_key(const void *key1, uint32_t len1, const void *key2, uint32_t len2
 
 node* new_node(uint8_t type, uint8_t level)
 {
-  uint32_t size = likely(type < Batch) ? node_size : batch_size;
 #ifdef Allocator
-  node *n = (node *)allocator_alloc(size);
+  node *n = (node *)allocator_alloc(node_size);
 #else
-  node *n = (node *)malloc(size);
+  node *n = (node *)malloc(node_size);
 #endif
 
   node_init(n, type, level);
@@ -97,10 +83,7 @@ inline void node_init(node *n, uint8_t type, uint8_t level)
   n->pre   = 0;
   n->sopt  = 0;
   // multiple threads can be creating new node at the same time, increase node-id atomically
-  if (likely((type & Batch) == 0))
-    n->id = __atomic_fetch_add(&node_id, 1, __ATOMIC_RELAXED);
-  else
-    n->id = 0;
+  n->id = __atomic_fetch_add(&node_id, 1, __ATOMIC_RELAXED);
   n->keys  = 0;
   n->off   = 0;
   n->next  = 0;
@@ -134,7 +117,6 @@ void free_btree_node(node *n)
 
   if (n->level) {
     free_btree_node(n->first);
-    assert(n->keys);
     index_t *index = node_index(n);
     for (uint32_t i = 0; i < n->keys; ++i) {
       node *child = (node *)get_val(n, index[i]);
@@ -185,7 +167,8 @@ int node_not_include_key(node *n, const void *key, uint32_t len)
 
 node* node_descend(node *n, const void *key, uint32_t len)
 {
-  assert(n->level && n->keys && n->pre == 0);
+  // a branch node may have no key but the first child after its children are merged
+  assert(n->level && n->pre == 0);
   index_t *index = node_index(n);
 
   int first = 0, count = (int)n->keys;
@@ -513,12 +496,53 @@ inline int node_is_after_key(node *n, const void *key, uint32_t len)
 {
   assert(n->level == 0);
 
+  if (unlikely(n->keys == 0)) return 0;
+
   char     first[max_key_size];
   uint32_t flen;
   node_get_whole_key(n, 0, first, &flen);
   return compare_key(key, len, first, flen) < 0;
 }
 
+// index of the first key that is not smaller than `key`, `n->keys` if there is no such key
+uint32_t node_lower_bound(node *n, const void *key, uint32_t len)
+{
+  assert(n->level == 0);
+
+  if (n->pre) {
+    uint32_t min = len < n->pre ? len : n->pre;
+    int r = memcmp(key, n->data, min);
+    if (r) return r < 0 ? 0 : n->keys;
+    // `key` is a prefix of node prefix, so it is smaller than all the keys
+    if (len <= n->pre) return 0;
+  }
+
+  const void *key1 = (char *)key + n->pre;
+  uint32_t    len1 = len - n->pre;
+
+  uint32_t low = 0, high = n->keys;
+  index_t *index = node_index(n);
+  while (low < high) {
+    uint32_t mid = (low + high) / 2;
+
+    get_key_info(n, index[mid], key2, len2);
+
+    if (compare_key(key2, len2, key1, len1) < 0)
+      low  = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+// copy the whole key at index to `key` and return its value
+void* node_get_kv_at(node *n, uint32_t idx, char *key, uint32_t *len)
+{
+  assert(n->level == 0);
+  node_get_whole_key(n, idx, key, len);
+  return get_val(n, node_index(n)[idx]);
+}
+
 // for b link tree node only
 inline int node_need_move_right(node *n, const void *key, uint32_t len)
 {
@@ -708,90 +732,224 @@ int node_replace_key(node *n, const void *okey, uint32_t olen, const void *val,
   return 2;
 }
 
-/****** BATCH operation ******/
-
-#define get_op(n, off) ((uint32_t)(*(uint8_t *)(get_ptr(n, off) - sizeof(uint8_t))))
-
-batch* new_batch()
-{
-  return new_node(Batch, 0);
-}
-
-void free_batch(batch *b)
-{
-  free_node((node *)b);
-}
-
-inline void batch_clear(batch *b)
+// remove key from node, return its value, or its child if this is a branch node,
+// return 0 if there is no such key
+void* node_remove(node *n, const void *key, uint32_t len)
 {
-  b->keys = 0;
-  b->off  = 0;
-}
+  if (n->pre) { // compare with node prefix
+    assert(n->level == 0);
+    // TODO: remove this if we can handle key length <= prefix length
+    assert(len > n->pre);
+    if (compare_key(n->data, n->pre, key, n->pre))
+      return 0;
+  }
 
-// insert a kv into node, this function allows duplicate key
-static int batch_write(batch *b, uint32_t op, const void *key1, uint32_t len1, const void *val)
-{
-  int low = 0, high = (int)b->keys - 1;
-  index_t *index = batch_index(b);
+  const void *key1 = (char *)key + n->pre;
+  uint32_t    len1 = len - n->pre;
 
+  int low = 0, high = (int)n->keys - 1;
+  index_t *index = node_index(n);
   while (low <= high) {
     int mid = (low + high) / 2;
 
-    get_key_info(b, index[mid], key2, len2);
+    get_kv_info(n, index[mid], key2, len2, val);
 
     int r = compare_key(key2, len2, key1, len1);
-    if (r <= 0)
+    if (r == 0) {
+      // close the hole in place, it's much cheaper than `node_delete_range`
+      uint32_t off = index[mid], size = key_byte + len2 + value_bytes;
+      memmove(n->data + off, n->data + off + size, n->off - off - size);
+      n->off -= size;
+      memmove(&index[1], &index[0], mid * index_byte);
+      --n->keys;
+      index = node_index(n);
+      for (uint32_t i = 0; i < n->keys; ++i)
+        if (index[i] > off)
+          index[i] -= size;
+      // an empty node should accept any key
+      if (n->keys == 0) {
+        n->pre = 0;
+        n->off = 0;
+      }
+      return val;
+    } else if (r < 0) {
       low  = mid + 1;
-    else
+    } else {
       high = mid - 1;
+    }
   }
 
-  --index;
+  return 0;
+}
 
-  // check if there is enough space
-  if (unlikely((char *)b->data + (b->off + sizeof(uint8_t) /* op */ + key_byte + len1 + value_bytes) > (char *)index))
-    return -1;
+// remove the first key of branch node, its child becomes the first child, this happens when the
+// key before it is removed but that key has been promoted to upper level because of a split
+void node_remove_first(node *n, char *key, uint32_t *len)
+{
+  assert(n->level && n->keys && n->pre == 0);
 
-  // set op type before kv
-  *((uint8_t *)(b->data + b->off)) = (uint8_t)op;
-  b->off += sizeof(uint8_t);
+  index_t *index = node_index(n);
+  get_kv_info(n, index[0], k, l, v);
+  memcpy(key, k, l);
+  *len = l;
+  n->first = (node *)v;
+  node_delete_range(n, 0, 1);
+}
 
-  if (likely(low)) memmove(&index[0], &index[1], low * index_byte);
-  index[low] = b->off;
+// if `child` is a child of branch node `n` but not the first one, get its fence key and return 1,
+// else return 0
+int node_get_child_key(node *n, node *child, char *key, uint32_t *len)
+{
+  assert(n->level && n->pre == 0);
 
-  node_insert_kv(b, key1, len1, val);
+  index_t *index = node_index(n);
+  for (uint32_t i = 0; i < n->keys; ++i) {
+    get_kv_info(n, index[i], k, l, v);
+    if ((node *)v == child) {
+      // key is too long to be put in a fence
+      if (l > sizeof(((fence *)0)->key))
+        return 0;
+      memcpy(key, k, l);
+      *len = l;
+      return 1;
+    }
+  }
+  return 0;
+}
 
-  return 1;
+// node is under-full if less than 1/4 of its space is used
+int node_is_under_full(node *n)
+{
+  return (n->off + n->keys * index_byte) < ((node_size - node_offset - sizeof(node)) >> 2);
 }
 
-int batch_add_write(batch *b, const void *key, uint32_t len, const void *val)
+// whether kv pairs can be moved between 2 nodes without changing them, an empty node takes the
+// prefix of the other one
+static int node_share_prefix(node *left, node *right)
 {
-  return batch_write(b, Write, key, len, val);
+  if (left->level || right->keys == 0)
+    return 1;
+
+  if (left->keys == 0 && left->pre != right->pre) {
+    memcpy(left->data, right->data, right->pre);
+    left->pre = right->pre;
+    left->off = left->pre;
+  }
+
+  return left->pre == right->pre && !memcmp(left->data, right->data, left->pre);
 }
 
-int batch_add_read(batch *b, const void *key, uint32_t len)
+// append kv pairs in `right` [0, count) to `left`, `index` is `left` index with space reserved
+static void node_append_range(node *left, index_t *index, node *right, uint32_t count)
 {
-  return batch_write(b, Read, key, len, 0);
+  index_t *r_idx = node_index(right);
+  for (uint32_t i = 0; i < count; ++i) {
+    get_kv_info(right, r_idx[i], k, l, v);
+    index[left->keys] = left->off;
+    node_insert_kv(left, k, l, (const void *)v);
+  }
 }
 
-// read a kv at index
-inline void batch_read_at(batch *b, uint32_t idx, uint32_t *op, void **key, uint32_t *len, void **val)
+// move all the keys in `right` to `left`, `key` is the fence key of `right` in their parent, it
+// is only used for branch node, if there is not enough space or prefix conflict, return 0
+int node_merge(node *left, node *right, const void *key, uint32_t len)
 {
-  // TODO: remove this
-  assert(idx < b->keys);
-  index_t *index = batch_index(b);
-  get_kv_ptr(b, index[idx], k, l, v);
-  *op = get_op(b, index[idx]);
-  *key = (void *)k;
-  *len = l;
-  *val = (void *)v;
+  assert(left->level == right->level && left->next == right);
+
+  if (!node_share_prefix(left, right))
+    return 0;
+
+  // fence key comes down with the first child of `right` if this is a branch node
+  uint32_t moved = right->keys + (left->level ? 1 : 0);
+  uint32_t bytes = right->off - right->pre + moved * index_byte;
+  if (left->level)
+    bytes += key_byte + len + value_bytes;
+
+  index_t *l_idx = node_index(left);
+  if ((left->data + left->off + bytes) > (char *)l_idx)
+    return 0;
+
+  // all the keys moved are larger than keys in `left`, so reserve index space after them
+  index_t *n_idx = l_idx - moved;
+  memmove(n_idx, l_idx, left->keys * index_byte);
+
+  if (left->level) {
+    n_idx[left->keys] = left->off;
+    node_insert_kv(left, key, len, (const void *)right->first);
+  }
+  node_append_range(left, n_idx, right, right->keys);
+
+  left->next = right->next;
+  right->type |= Merged;
+  return 1;
 }
 
-inline void* batch_get_value_at(batch *b, uint32_t idx)
+// move keys from the head of `right` to `left` until they are about the same size, `okey` is
+// the fence key of `right` in their parent, new fence key is stored in `key`, return how many
+// keys we moved
+int node_redistribute(node *left, node *right, const void *okey, uint32_t olen, char *key, uint32_t *len)
 {
-  if (idx >= b->keys || b->keys == 0) return 0;
-  index_t *index = batch_index(b);
-  return get_val(b, index[idx]);
+  assert(left->level == right->level && left->next == right);
+
+  if (!node_share_prefix(left, right))
+    return 0;
+
+  uint32_t base = key_byte + value_bytes + index_byte;
+  uint32_t l_bytes = left->off - left->pre + left->keys * index_byte;
+  uint32_t r_bytes = right->off - right->pre + right->keys * index_byte;
+  uint32_t half = (l_bytes + r_bytes) / 2;
+
+  // keep at least 1 key in `right`
+  index_t *r_idx = node_index(right);
+  uint32_t moved = 0;
+  while (moved + 1 < right->keys) {
+    uint32_t bytes = base + get_len(right, r_idx[moved]);
+    if (l_bytes + bytes > half)
+      break;
+    l_bytes += bytes;
+    ++moved;
+  }
+  if (moved == 0)
+    return 0;
+
+  index_t *l_idx = node_index(left);
+  index_t *n_idx = l_idx - moved;
+
+  if (left->level == 0) {
+    // Reference: Prefix B-Trees
+    // new fence key is the shortest key larger than the last key moved and not larger than
+    // the first key left
+    get_key_info(right, r_idx[moved - 1], lkey, llen);
+    get_key_info(right, r_idx[moved], rkey, rlen);
+    const char *lk = (const char *)lkey, *rk = (const char *)rkey;
+    uint32_t i = 0;
+    while (i < llen && i < rlen && lk[i] == rk[i])
+      ++i;
+    assert(i < rlen);
+    if (right->pre + i + 1 > sizeof(((fence *)0)->key))
+      return 0;
+    memcpy(key, right->data, right->pre);
+    memcpy(key + right->pre, rk, i + 1);
+    *len = right->pre + i + 1;
+
+    memmove(n_idx, l_idx, left->keys * index_byte);
+    node_append_range(left, n_idx, right, moved);
+  } else {
+    // fence key comes down with the first child of `right`, and the last key moved goes up
+    memmove(n_idx, l_idx, left->keys * index_byte);
+    n_idx[left->keys] = left->off;
+    node_insert_kv(left, okey, olen, (const void *)right->first);
+    node_append_range(left, n_idx, right, moved - 1);
+
+    get_kv_info(right, r_idx[moved - 1], k, l, v);
+    assert(l <= sizeof(((fence *)0)->key));
+    memcpy(key, k, l);
+    *len = l;
+    right->first = (node *)v;
+  }
+
+  node_delete_range(right, 0, moved);
+  return moved;
 }
 
 inline void path_clear(path *p)
@@ -917,37 +1075,8 @@ void node_print(node *n, int detail)
   printf("%s\n", buf);
 }
 
-void batch_print(batch *b, int detail)
-{
-  assert(b);
-  int size = (float)node_size * 1.5;
-  char buf[size], *ptr = buf, *end = buf + size;
-
-  ptr += snprintf(ptr, end - ptr, "keys: %u  ", b->keys);
-  ptr += snprintf(ptr, end - ptr, "  offset: %u\n", b->off);
-
-  index_t *index = batch_index(b);
-  if (detail) {
-    for (uint32_t i = 0; i < b->keys; ++i) {
-      ptr += snprintf(ptr, end - ptr, "%s ", get_op(b, index[i]) == Write ? "w" : "r");
-      ptr = format_kv(ptr, end, b, index[i]);
-    }
-  } else {
-    if (b->keys > 0) {
-      ptr += snprintf(ptr, end - ptr, "%s ", get_op(b, index[0]) == Write ? "w" : "r");
-      ptr = format_kv(ptr, end, b, index[0]);
-    }
-    if (b->keys > 1) {
-      ptr += snprintf(ptr, end - ptr, "%s ", get_op(b, index[b->keys - 1]) == Write ? "w" : "r");
-      ptr = format_kv(ptr, end, b, index[b->keys - 1]);
-    }
-  }
-
-  printf("%s\n", buf);
-}
-
 // verify that all keys in node are in ascending order
-static void validate(node *n, int is_batch)
+void node_validate(node *n)
 {
   assert(n);
 
@@ -959,71 +1088,65 @@ static void validate(node *n, int is_batch)
 
   for (uint32_t i = 1; i < n->keys; ++i) {
     get_key_info(n, index[i], cur_key, cur_len);
-    if (is_batch == 0)
-      assert(compare_key(pre_key, pre_len, cur_key, cur_len) < 0);
-    else
-      assert(compare_key(pre_key, pre_len, cur_key, cur_len) <= 0);
+    assert(compare_key(pre_key, pre_len, cur_key, cur_len) < 0);
     pre_key = (char *)cur_key;
     pre_len = cur_len;
   }
 }
 
-void node_validate(node *n)
-{
-  validate(n, 0);
-}
-
-void batch_validate(batch *n)
-{
-  validate(n, 1);
-}
-
 // this function is used to verify that a b+tree node is validate
 // in the tree, it verifies 4 aspects:
 //   1. the key in this node is in ascending order
 //   2. the last key in this node is smaller than the first key in next node
-//   3. the first key in this node is larger than the last key in the first child
-//   4. the last key in this node is smaller than or equal the first key in the last child
+//   3. keys in every child are between the fence keys of that child in this node
+//   4. every child is linked to the next child, the last child is linked to the first child of next node
 void btree_node_validate(node *n)
 {
   if (n == 0) return ;
 
   node_validate(n);
 
-  if (n->keys == 0) return ; // node is empty
-
-  char first_key[max_key_size], last_key[max_key_size];
-  uint32_t first_len, last_len;
-  node_get_whole_key(n, 0, first_key, &first_len);
-  node_get_whole_key(n, n->keys - 1, last_key, &last_len);
+  char key[max_key_size], next_key[max_key_size];
+  uint32_t len, next_len;
 
   // validate the last key in this node is smaller than the first key in next node
-  if (n->next) {
-    char next_key[max_key_size];
-    uint32_t next_len;
+  if (n->keys && n->next && n->next->keys) {
+    node_get_whole_key(n, n->keys - 1, key, &len);
     node_get_whole_key(n->next, 0, next_key, &next_len);
-    int r = compare_key(last_key, last_len, next_key, next_len);
-    assert(r < 0);
+    assert(compare_key(key, len, next_key, next_len) < 0);
   }
 
-  if (n->level) {
-    assert(n->first != 0);
+  if (n->level == 0) {
+    assert(n->first == 0);
+    return ;
+  }
 
-    // validate that the first key in this node is larger than the last key in the first child
-    char child_last_key[max_key_size], child_first_key[max_key_size];
-    uint32_t child_last_len, child_first_len;
-    node_get_whole_key(n->first, n->first->keys - 1, child_last_key, &child_last_len);
-    assert(compare_key(child_last_key, child_last_len, first_key, first_len) < 0);
+  // a branch node may have no key but the first child after its children are merged
+  assert(n->first != 0);
+  index_t *index = node_index(n);
+  node *child = n->first;
+  for (uint32_t i = 0; i <= n->keys; ++i) {
+    assert(child->level + 1 == n->level && (child->type & Merged) == 0);
+
+    char child_key[max_key_size];
+    uint32_t child_len;
+    // validate that the first key in child is larger than or equal to its lower fence key
+    if (i && child->keys) {
+      node_get_whole_key(n, i - 1, key, &len);
+      node_get_whole_key(child, 0, child_key, &child_len);
+      assert(compare_key(key, len, child_key, child_len) <= 0);
+    }
 
-    // validate that the last key in this node is smaller than or equal the first key in the last child
-    index_t *index = node_index(n);
-    node *last_child = (node *)get_val(n, index[n->keys - 1]);
-    node_get_whole_key(last_child, 0, child_first_key, &child_first_len);
-    int r = compare_key(last_key, last_len, child_first_key, child_first_len);
-    assert(r <= 0); // equal is valid
+    node *next = i < n->keys ? (node *)get_val(n, index[i]) : (n->next ? n->next->first : 0);
+    // validate that the last key in child is smaller than its upper fence key
+    if (i < n->keys && child->keys) {
+      node_get_whole_key(n, i, key, &len);
+      node_get_whole_key(child, child->keys - 1, child_key, &child_len);
+      assert(compare_key(child_key, child_len, key, len) < 0);
+    }
 
-  } else {
-    assert(n->first == 0);
+    assert(child->next == next);
+    child = next;
   }
 }
 
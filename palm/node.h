@@ -35,11 +35,13 @@
 #define Branch (1 << 1)
 #define Leaf   (1 << 2)
 #define Blink  (1 << 3) // blink tree
-#define Batch  (1 << 4)
+#define Merged (1 << 4) // node is merged into its left sibling and will be freed
 
 // op type
-#define Read  0
-#define Write 1
+#define Read   0
+#define Write  1
+#define Delete 2
+#define Scan   3
 
 // do not fucking change it
 typedef uint64_t val_t;
@@ -81,8 +83,6 @@ typedef struct __attribute__ ((packed))  node
 
 void set_node_size(uint32_t size);
 uint32_t get_node_size();
-void set_batch_size(uint32_t size);
-uint32_t get_batch_size();
 int compare_key(const void *key1, uint32_t len1, const void *key2, uint32_t len2);
 
 node* new_node(uint8_t type, uint8_t level);
@@ -97,32 +97,22 @@ int node_adjust_few(node *left, node *right, char *okey, uint32_t *olen, char *k
 void node_adjust_many(node *new, node *left, node *right, char *okey, uint32_t *olen, char *key, uint32_t *len,
   char *nkey, uint32_t *nlen);
 int node_replace_key(node *n, const void *okey, uint32_t olen, const void *val, const void *key, uint32_t len);
+void* node_remove(node *n, const void *key, uint32_t len);
+void node_remove_first(node *n, char *key, uint32_t *len);
+int node_get_child_key(node *n, node *child, char *key, uint32_t *len);
+int node_is_under_full(node *n);
+int node_merge(node *left, node *right, const void *key, uint32_t len);
+int node_redistribute(node *left, node *right, const void *okey, uint32_t olen, char *key, uint32_t *len);
 void node_prefetch(node *n);
 int node_is_after_key(node *n, const void *key, uint32_t len);
+uint32_t node_lower_bound(node *n, const void *key, uint32_t len);
+void* node_get_kv_at(node *n, uint32_t idx, char *key, uint32_t *len);
 int node_need_move_right(node *n, const void *key, uint32_t len);
 
 void set_node_offset(uint32_t offset);
 void node_init(node *n, uint8_t type, uint8_t level);
 void node_insert_fence(node *old, node *new, void *next, char *pkey, uint32_t *plen);
 
-/**
- *   batch is a wrapper for node with some difference, key may be duplicated
- *
- *   layout of kv pair in batch:
- *            op       key len                           ptr
- *      |     1     |     1     |        key        |     8     |
-**/
-// TODO: different size for node and batch, batch size can be much larger than node size
-typedef node batch;
-
-batch* new_batch();
-void free_batch(batch *b);
-void batch_clear(batch *b);
-int batch_add_write(batch *b, const void *key, uint32_t len, const void *val);
-int batch_add_read(batch *b, const void *key, uint32_t len);
-void batch_read_at(batch *b, uint32_t idx, uint32_t *op, void **key, uint32_t *len, void **val);
-void* batch_get_value_at(batch *b, uint32_t idx);
-
 #define max_descend_depth 7 // should be enough levels for a b+ tree
 
 // the root to leaf descending path of one kv
@@ -143,6 +133,7 @@ uint32_t path_get_level(path *p);
 
 #define fence_insert  0
 #define fence_replace 1
+#define fence_delete  2
 
 typedef struct fence
 {
@@ -162,9 +153,7 @@ typedef struct fence
 
 uint32_t node_get_total_id();
 void node_print(node *n, int detail);
-void batch_print(batch *b, int detail);
 void node_validate(node *n);
-void batch_validate(batch *n);
 void btree_node_validate(node *n);
 int node_try_compression(node *n, const void *key, uint32_t len);
 float node_get_coverage(node *n);
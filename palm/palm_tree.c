@@ -21,6 +21,7 @@ static const char *stage_redis    = "redistribute work";
 static const char *stage_leaves   = "modify leaves";
 static const char *stage_branches = "modify braches";
 static const char *stage_root     = "modify root";
+static const char *stage_scan     = "scan leaves";
 
 static void do_palm_tree_execute(palm_tree *pt, batch *b, worker *w);
 
@@ -52,20 +53,19 @@ static void* run(void *arg)
   palm_tree *pt = j->pt;
   worker *w= j->wrk;
   bounded_queue *q = j->que;
-  int q_idx = 0;
+  uint64_t q_pos = 0;
 
   while (1) {
-    // TODO: optimization?
-    batch *bth = bounded_queue_get_at(q, &q_idx); // q_idx will be updated in the queue
+    batch *bth = bounded_queue_get_at(q, &q_pos); // q_pos will be updated in the queue
 
     if (likely(bth))
       do_palm_tree_execute(pt, bth, w);
     else
       break;
 
-    // let worker 0 do the dequeue
-    if (w->id == 0)
-      bounded_queue_dequeue(q);
+    // worker 0 might finish before others since synchronization is only between neighbours,
+    // so batch is released by the last worker
+    bounded_queue_dequeue(q, q_pos - 1);
   }
 
   free_thread_arg(j);
@@ -89,13 +89,14 @@ palm_tree* new_palm_tree(int worker_num, int queue_size)
     register_metric(i, stage_leaves, (void *)new_clock());
     register_metric(i, stage_branches, (void *)new_clock());
     register_metric(i, stage_root, (void *)new_clock());
+    register_metric(i, stage_scan, (void *)new_clock());
   }
 
   palm_tree *pt = (palm_tree *)malloc(sizeof(palm_tree));
   pt->root = new_node(Root, 0);
 
   pt->worker_num = worker_num;
-  pt->queue = new_bounded_queue(queue_size);
+  pt->queue = new_bounded_queue(queue_size, worker_num);
   pt->ids = (pthread_t *)malloc(sizeof(pthread_t) * pt->worker_num);
   pt->workers = (worker **)malloc(sizeof(worker *) * pt->worker_num);
 
@@ -143,9 +144,11 @@ void palm_tree_flush(palm_tree *pt)
   bounded_queue_wait_empty(pt->queue);
 }
 
-// put task batch in the queue
+// put task batch in the queue, batch is sorted here so that filling it only needs appending
 void palm_tree_execute(palm_tree *pt, batch *b)
 {
+  batch_sort(b);
+  b->state = batch_running;
   bounded_queue_enqueue(pt->queue, b);
 }
 
@@ -192,27 +195,50 @@ void palm_tree_validate(palm_tree *pt)
 
 #endif /* Test */
 
-// only processed by worker 0
+// only processed by worker 0, a big batch can split root into more nodes than a new root can hold,
+// so new levels are added until there is only one node at the top, if all the children of root are
+// merged into the first one, root is removed
 static void handle_root_split(palm_tree *pt, worker *w)
 {
   uint32_t number;
   fence *fences;
   worker_get_fences(w, pt->root->level, &fences, &number);
 
-  if (likely(number == 0)) return ;
+  while (number) {
+    node *new_root = new_node(Root, pt->root->level + 1);
+    // adjust old root type
+    pt->root->type = pt->root->level == 0 ? Leaf : Branch;
+    // set old root as new root's first child
+    new_root->first = pt->root;
 
-  node *new_root = new_node(Root, pt->root->level + 1);
-  // adjust old root type
-  pt->root->type = pt->root->level == 0 ? Leaf : Branch;
-  // set old root as new root's first child
-  new_root->first = pt->root;
+    // fences are in key order, when a node is full, the fence goes one level up and its child becomes
+    // the first child of a new node, fences for the level above are compacted in place
+    node *curr = new_root;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < number; ++i) {
+      int ret = node_insert(curr, fences[i].key, fences[i].len, fences[i].ptr);
+      if (likely(ret == 1)) continue;
+      assert(ret == -1);
+      node *new = new_node(Branch, curr->level);
+      new->first = fences[i].ptr;
+      curr->next = new;
+      curr = new;
+      fences[count] = fences[i];
+      fences[count].ptr = new;
+      ++count;
+    }
 
-  for (uint32_t i = 0; i < number; ++i) {
-    assert(node_insert(new_root, fences[i].key, fences[i].len, fences[i].ptr) == 1);
+    // replace old root
+    pt->root = new_root;
+    number = count;
   }
 
-  // replace old root
-  pt->root = new_root;
+  while (pt->root->level && pt->root->keys == 0) {
+    node *old_root = pt->root;
+    pt->root = old_root->first;
+    pt->root->type = Root;
+    worker_retire_node(w, old_root);
+  }
 }
 
 #ifdef Lazy
@@ -353,6 +379,9 @@ static void do_palm_tree_execute(palm_tree *pt, batch *b, worker *w)
 {
   worker_reset(w);
 
+  // batch can not be touched after the last synchronization, since its owner may reuse it once it is done
+  uint32_t scans = b->scans;
+
   // get root level here to prevent dead lock bug when promoting node modifications
   uint32_t root_level = pt->root->level;
   struct clock c = clock_get();
@@ -409,6 +438,21 @@ static void do_palm_tree_execute(palm_tree *pt, batch *b, worker *w)
     handle_root_split(pt, w); update_metric(w->id, stage_root, &c);
   }
 
-  // do a global synchronization, not really needed, but just make things consistent
+  // do a global synchronization, the tree is not modified by this batch after it
   worker_sync(w, level + 1, root_level); update_metric(w->id, stage_sync, &c);
+
+  /*  ---  Stage 5  --- */
+
+  // scans go across leaf nodes of all the workers, so they are executed when the whole batch is done,
+  // and no worker can start next batch until all the scans are done
+  if (scans) {
+    worker_execute_scans(w, b, pt->root); update_metric(w->id, stage_scan, &c);
+
+    // channel of `level` is not used by the synchronization right before or after this one
+    worker_sync(w, level, root_level); update_metric(w->id, stage_sync, &c);
+  }
+
+  // all the workers are done with this batch, notify its owner
+  if (w->id == 0)
+    batch_set_done(b);
 }
@@ -10,6 +10,7 @@
 #include <pthread.h>
 
 #include "node.h"
+#include "batch.h"
 #include "worker.h"
 #include "bounded_queue.h"
 
@@ -27,6 +28,9 @@ typedef struct palm_tree
 
 }palm_tree;
 
+// at most `queue_size` batches can be queued, a producer that keeps filling batches while earlier
+// ones are executed needs `queue_size + 1` of them, it waits for a batch with `batch_wait` before
+// refilling it, `palm_tree_flush` waits for all the queued batches
 palm_tree* new_palm_tree(int worker_num, int queue_size);
 void free_palm_tree(palm_tree *pt);
 void palm_tree_flush(palm_tree *pt);
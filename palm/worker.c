@@ -54,10 +54,10 @@ worker* new_worker(uint32_t id, uint32_t total)
   w->total = total;
 
   // we assume average key size is 16 bytes
-  // max path should be 128, 256, ...
-  uint32_t base = 128;
+  // max path should be 128, 256, ..., paths grow on demand so do not reserve too many for a big batch
+  uint32_t base = 128, limit = ((uint32_t)1) << 16;
   uint32_t max_path = (get_batch_size() / (16 * total)) & (~(base - 1));
-  w->max_path = max_path < base ? base : max_path;
+  w->max_path = max_path < base ? base : max_path > limit ? limit : max_path;
   w->cur_path = 0;
   w->beg_path = 0;
   w->tot_path = 0;
@@ -78,6 +78,10 @@ worker* new_worker(uint32_t id, uint32_t total)
   assert(posix_memalign(&fences, 64, sizeof(fence) * w->max_fence) == 0);
   w->fences[1] = (fence *)fences;
 
+  w->max_retired = 0;
+  w->cur_retired = 0;
+  w->retired = 0;
+
   w->prev = 0;
   w->next = 0;
 
@@ -91,8 +95,17 @@ worker* new_worker(uint32_t id, uint32_t total)
   return w;
 }
 
+static void worker_free_retired(worker *w)
+{
+  for (uint32_t i = 0; i < w->cur_retired; ++i)
+    free_node(w->retired[i]);
+  w->cur_retired = 0;
+}
+
 void free_worker(worker* w)
 {
+  worker_free_retired(w);
+  free((void *)w->retired);
   free((void *)w->fences[1]);
   free((void *)w->fences[0]);
   free((void *)w->paths);
@@ -113,6 +126,20 @@ void worker_reset(worker *w)
 
   w->cur_fence[0] = 0;
   w->cur_fence[1] = 0;
+
+  // nobody can access the nodes removed in last batch now
+  worker_free_retired(w);
+}
+
+// node removed from the tree may still be pointed by paths or fences in this batch, free it later
+void worker_retire_node(worker *w, node *n)
+{
+  if (unlikely(w->cur_retired == w->max_retired)) {
+    w->max_retired = w->max_retired ? w->max_retired * 2 : 4;
+    w->retired = (node **)realloc(w->retired, sizeof(node *) * w->max_retired);
+    assert(w->retired);
+  }
+  w->retired[w->cur_retired++] = n;
 }
 
 path* worker_get_new_path(worker *w)
@@ -192,6 +219,16 @@ static inline uint32_t worker_get_fence_number(worker *w, uint32_t level)
   return w->cur_fence[level % 2];
 }
 
+// whether this worker has a fence for node `n` to promote
+static int worker_has_fence(worker *w, uint32_t level, node *n)
+{
+  uint32_t idx = level % 2;
+  for (uint32_t i = 0; i < w->cur_fence[idx]; ++i)
+    if (w->fences[idx][i].ptr == n)
+      return 1;
+  return 0;
+}
+
 #ifdef BStar // B* node
 // only called when in level 0
 static inline fence* worker_get_last_insert_fence(worker *w)
@@ -535,6 +572,51 @@ static void worker_handle_leaf_node_split(worker *w, node **curr, path *cp, fenc
   // set_val(val, 1);
 }
 
+// merge `cn` with its next node if one of them is under-full, or move some keys from next node to
+// `cn` if they can not be merged and `cn` is under-full, fence key of next node in their parent is
+// deleted or replaced. this is done only if all of below situations are satisfied
+//   1. next node does not belong to next worker
+//   2. next node share the same parent with this node
+//   3. next node is not changed in the parent
+// nodes between `cn` and `w->my_last` either belong to this worker or are not touched by any worker
+static void worker_handle_under_full_node(worker *w, uint32_t level, path *cp, node *cn)
+{
+  // root has no parent
+  if (path_get_level(cp) <= level + 1)
+    return ;
+
+  node *parent = path_get_node_at_level(cp, level + 1);
+  int last = cn == w->my_last;
+  fence fnc;
+  fnc.pth = cp;
+
+  while (cn->next && !(last && w->next)) {
+    node *next = cn->next;
+    if (!node_is_under_full(cn) && !node_is_under_full(next))
+      return ;
+    if (!node_get_child_key(parent, next, fnc.okey, &fnc.olen) || worker_has_fence(w, level, next))
+      return ;
+
+    fnc.ptr = next; // store `next` for verification
+    if (node_merge(cn, next, fnc.okey, fnc.olen)) {
+      fnc.type = fence_delete;
+      memcpy(fnc.key, fnc.okey, fnc.olen);
+      fnc.len = fnc.olen;
+      worker_insert_fence(w, level, &fnc);
+      worker_retire_node(w, next);
+      last = next == w->my_last;
+      // `cn` may still be under-full, try its new next node
+      continue;
+    }
+
+    if (node_is_under_full(cn) && node_redistribute(cn, next, fnc.okey, fnc.olen, fnc.key, &fnc.len)) {
+      fnc.type = fence_replace;
+      worker_insert_fence(w, level, &fnc);
+    }
+    return ;
+  }
+}
+
 // process keys assigned to this worker in leaf nodes, worker has already obtained the path information
 void worker_execute_on_leaf_nodes(worker *w, batch *b)
 {
@@ -618,12 +700,63 @@ void worker_execute_on_leaf_nodes(worker *w, batch *b)
       default:
         assert(0);
       }
-    } else { // Read
+    } else if (op == Read) {
       set_val(val, (val_t)node_search(curr, key, len));
-    }
+    } else if (op == Delete) { // value of the key is returned
+      set_val(val, (val_t)node_remove(curr, key, len));
+    } // scan is executed after the whole batch is done
 
     pn = cn; // record previous node
   }
+
+  // nodes only shrink when all the keys are processed
+  pn = 0;
+  init_path_iter(&iter, w);
+  while ((cp = next_path(&iter))) {
+    node *cn = path_get_node_at_level(cp, 0);
+    if (cn != pn && (cn->type & Merged) == 0)
+      worker_handle_under_full_node(w, 0, cp, cn);
+    pn = cn;
+  }
+}
+
+// write kv pairs that are not smaller than `key` to `r`, starting from leaf node `n`
+static void worker_scan(node *n, const void *key, uint32_t len, scan_result *r)
+{
+  char     buf[max_key_size];
+  uint32_t blen;
+  uint32_t i = node_lower_bound(n, key, len);
+  for (; n; n = n->next, i = 0) {
+    for (; i < n->keys; ++i) {
+      void *val = node_get_kv_at(n, i, buf, &blen);
+      if (!scan_result_append(r, buf, blen, val))
+        return ;
+    }
+  }
+}
+
+// execute scan operations in keys this worker descended for, tree must not be modified by any worker,
+// so a scan can follow `next` pointers across leaf nodes that belong to other workers
+void worker_execute_scans(worker *w, batch *b, node *root)
+{
+  for (uint32_t i = 0; i < w->cur_path; ++i) {
+    uint32_t  op;
+    void    *key;
+    uint32_t len;
+    void    *val;
+    batch_read_at(b, path_get_kv_id(&w->paths[i]), &op, &key, &len, &val);
+    if (op != Scan) continue;
+
+    scan_result *r = (scan_result *)*(val_t *)val;
+    r->keys = 0;
+    r->off  = 0;
+
+    // descend again since the leaf node in path might have been split or merged
+    node *cur = root;
+    while (cur->level)
+      cur = node_descend(cur, key, len);
+    worker_scan(cur, key, len, r);
+  }
 }
 
 // this function does exactly the same work as `execute_on_leaf_nodes`,
@@ -673,6 +806,25 @@ void worker_execute_on_branch_nodes(worker *w, uint32_t level)
       } else {
         assert(r == 1);
       }
+    } else if (cf->type == fence_delete) {
+      void *child = node_remove(curr, cf->okey, cf->olen);
+      if (unlikely(child == 0)) {
+        // the key we are going to delete has been promoted to upper level due to a split, its child
+        // is the first child of `curr`, now the first key of `curr` will be promoted instead
+        assert(curr->first == cf->ptr);
+        fence f;
+        memcpy(&f, cf, sizeof(fence));
+        node_remove_first(curr, f.key, &f.len);
+        f.ptr = curr;
+        f.type = fence_replace;
+        uint32_t before = worker_get_fence_number(w, level);
+        worker_insert_fence(w, level, &f);
+        uint32_t after = worker_get_fence_number(w, level);
+        // make sure this fence key is replaced in fence info
+        assert(before == after);
+      } else {
+        assert(child == cf->ptr);
+      }
     }
 
     if (cf->type == fence_insert) {
@@ -704,6 +856,16 @@ void worker_execute_on_branch_nodes(worker *w, uint32_t level)
 
     pn = cn; // record previous node
   }
+
+  // nodes only shrink when all the fences are processed
+  pn = 0;
+  init_fence_iter(&iter, w, level);
+  while ((cf = next_fence(&iter))) {
+    node *cn = path_get_node_at_level(cf->pth, level);
+    if (cn != pn && (cn->type & Merged) == 0)
+      worker_handle_under_full_node(w, level, cf->pth, cn);
+    pn = cn;
+  }
 }
 
 void init_path_iter(path_iter *iter, worker *w)
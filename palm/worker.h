@@ -8,6 +8,7 @@
 #define _worker_h_
 
 #include "node.h"
+#include "batch.h"
 
 #define channel_size max_descend_depth + 1 // +2 is better but we want `channel_size` to be 8
 
@@ -47,6 +48,10 @@ typedef struct worker
                           // each of them are sorted according to the key
                           // this is a very cool optimization
 
+  uint32_t  max_retired; // maximum number of nodes this worker removes from the tree
+  uint32_t  cur_retired; // current number of nodes this worker removes from the tree
+  node    **retired;     // nodes removed from the tree, freed when next batch starts
+
   struct worker *prev; // previous worker with smaller id
   struct worker *next; // next worker with bigger id
 
@@ -69,9 +74,11 @@ void worker_switch_fence(worker *w, uint32_t level);
 void worker_get_fences(worker *w, uint32_t level, fence **fences, uint32_t *number);
 void worker_redistribute_work(worker *w, uint32_t level);
 void worker_reset(worker *w);
+void worker_retire_node(worker *w, node *n);
 void worker_sync(worker *w, uint32_t level, uint32_t root_level);
 void worker_execute_on_leaf_nodes(worker *w, batch *b);
 void worker_execute_on_branch_nodes(worker *w, uint32_t level);
+void worker_execute_scans(worker *w, batch *b, node *root);
 
 #ifdef Test
 
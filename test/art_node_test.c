@@ -0,0 +1,141 @@
+/**
+ *    author:     UncP
+ *    date:    2026-10-17
+ *    license:    BSD-3
+**/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "../art/art_node.h"
+
+static long long mstime()
+{
+  struct timeval tv;
+  long long ust;
+
+  gettimeofday(&tv, NULL);
+  ust = ((long long)tv.tv_sec)*1000000;
+  ust += tv.tv_usec;
+  return ust / 1000;
+}
+
+// create a node with `count` children at random bytes, `has` records which bytes have a child
+static art_node* new_test_node(int count, art_node **leaves, int *has)
+{
+  art_node *an = new_art_node();
+  assert(art_node_lock(an) == 0);
+
+  for (int i = 0; i < 256; ++i)
+    has[i] = 0;
+
+  for (int i = 0; i < count; ) {
+    unsigned char byte = (unsigned char)(rand() & 0xff);
+    if (has[byte])
+      continue;
+    art_node *new = 0;
+    assert(art_node_add_child(an, byte, leaves[byte], &new) == 0);
+    // node has grown, the new node is unlocked
+    if (new) {
+      an = new;
+      assert(art_node_lock(an) == 0);
+    }
+    has[byte] = 1;
+    ++i;
+  }
+
+  art_node_unlock(an);
+  return an;
+}
+
+static void validate_node(art_node *an, art_node **leaves, int *has)
+{
+  uint64_t version = art_node_get_version(an);
+
+  for (int i = 0; i < 256; ++i) {
+    art_node **child = art_node_find_child(an, version, (unsigned char)i);
+    if (has[i])
+      assert(child && *child == leaves[i]);
+    else
+      assert(child == 0);
+  }
+
+  unsigned char bytes[256];
+  art_node *children[256];
+  int count = art_node_get_children(an, version, bytes, children, 256);
+  int j = 0;
+  for (int i = 0; i < 256; ++i) {
+    if (!has[i]) continue;
+    assert(j < count && bytes[j] == i && children[j] == leaves[i]);
+    ++j;
+  }
+  assert(j == count);
+
+  // stop early
+  if (count > 1)
+    assert(art_node_get_children(an, version, bytes, children, count / 2) == count / 2);
+}
+
+static void bench_node(int count, art_node **leaves, int rounds)
+{
+  int has[256];
+  art_node *an = new_test_node(count, leaves, has);
+
+  art_node_set_avx2(0);
+  validate_node(an, leaves, has);
+  art_node_set_avx2(1);
+  validate_node(an, leaves, has);
+
+  uint64_t version = art_node_get_version(an);
+
+  unsigned char bytes[256];
+  art_node *children[256];
+
+  long long before = mstime();
+  uintptr_t sum = 0;
+  for (int r = 0; r < rounds; ++r)
+    for (int i = 0; i < 256; ++i)
+      sum += (uintptr_t)art_node_find_child(an, version, (unsigned char)i);
+  long long find = mstime() - before;
+
+  int total = 0;
+  art_node_set_avx2(0);
+  before = mstime();
+  for (int r = 0; r < rounds; ++r)
+    total += art_node_get_children(an, version, bytes, children, 256);
+  long long plain = mstime() - before;
+
+  art_node_set_avx2(1);
+  before = mstime();
+  for (int r = 0; r < rounds; ++r)
+    total += art_node_get_children(an, version, bytes, children, 256);
+  long long avx2 = mstime() - before;
+
+  assert(total == count * rounds * 2);
+  printf("children: %3d  find: %lld ms  get children: %lld ms (avx2: %lld ms)  %lu\n",
+    count, find, plain, avx2, (unsigned long)(sum & 1));
+}
+
+int main(int argc, char **argv)
+{
+  int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+  if (rounds <= 0) rounds = 1;
+
+  init_art_node();
+
+  art_node *leaves[256];
+  for (int i = 0; i < 256; ++i) {
+    unsigned char key = (unsigned char)i;
+    leaves[i] = new_art_leaf(&key, 1, 0);
+  }
+
+  // node4, node16, node48, sparse node48, node256 and sparse node256
+  int counts[] = {4, 16, 48, 20, 256, 60};
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+    bench_node(counts[i], leaves, rounds);
+
+  return 0;
+}
@@ -7,6 +7,7 @@
 #define _XOPEN_SOURCE 500
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -16,9 +17,6 @@
 #include <pthread.h>
 
 #include "../art/art.h"
-#ifdef Allocator
-#include "../palm/allocator.h"
-#endif // Allocator
 
 static long long mstime()
 {
@@ -81,14 +79,7 @@ static void* run(void *arg)
       }
 
       if (write) {
-        void *slice;
-        #ifdef Allocator
-          slice = allocator_alloc_small(len);
-        #else
-          slice = malloc(len);
-        #endif // Allocator
-        memcpy(slice, key, len);
-        assert(adaptive_radix_tree_put(art, slice, len) == 0);
+        assert(adaptive_radix_tree_put(art, key, len, (void *)3190) == 0);
       } else {
         void *value = adaptive_radix_tree_get(art, key, len);
         if (value == 0) {
@@ -97,8 +88,7 @@ static void* run(void *arg)
           buf[len] = 0;
           printf("%s\n", buf);
         }
-        assert(value);
-        assert(memcmp(value, key, len) == 0);
+        assert(value == (void *)3190);
       }
     }
   }
@@ -155,55 +145,529 @@ void test_adaptive_radix_tree_structure()
   {
   adaptive_radix_tree *art = new_adaptive_radix_tree();
 
-  char *key1 = malloc(16);
-  key1[0] = 5;
-  key1++;
-  memcpy((void *)key1, "hello\0", 6);
-  char *key2 = malloc(16);
-  key2[0] = 6;
-  key2++;
-  memcpy((void *)key2, "hello0\0", 7);
-  char *key3 = malloc(16);
-  key3[0] = 7;
-  key3++;
-  memcpy((void *)key3, "hello00", 8);
-
-  adaptive_radix_tree_put(art, key1, 5, 0);
-  adaptive_radix_tree_put(art, key2, 6, 0);
-  adaptive_radix_tree_put(art, key3, 7, 0);
-
-  assert(adaptive_radix_tree_get(art, key1, 5) == key1);
-  assert(adaptive_radix_tree_get(art, key2, 6) == key2);
-  assert(adaptive_radix_tree_get(art, key3, 7) == key3);
+  assert(adaptive_radix_tree_put(art, "hello", 5, (void *)1) == 0);
+  assert(adaptive_radix_tree_put(art, "hello0", 6, (void *)2) == 0);
+  assert(adaptive_radix_tree_put(art, "hello00", 7, (void *)3) == 0);
+
+  assert(adaptive_radix_tree_get(art, "hello", 5) == (void *)1);
+  assert(adaptive_radix_tree_get(art, "hello0", 6) == (void *)2);
+  assert(adaptive_radix_tree_get(art, "hello00", 7) == (void *)3);
+
+  free_adaptive_radix_tree(art);
+  }
+  {
+  adaptive_radix_tree *art = new_adaptive_radix_tree();
+
+  assert(adaptive_radix_tree_put(art, "hello00", 7, (void *)3) == 0);
+  assert(adaptive_radix_tree_put(art, "hello0", 6, (void *)2) == 0);
+  assert(adaptive_radix_tree_put(art, "hello", 5, (void *)1) == 0);
+
+  assert(adaptive_radix_tree_get(art, "hello00", 7) == (void *)3);
+  assert(adaptive_radix_tree_get(art, "hello0", 6) == (void *)2);
+  assert(adaptive_radix_tree_get(art, "hello", 5) == (void *)1);
 
   free_adaptive_radix_tree(art);
   }
   {
   adaptive_radix_tree *art = new_adaptive_radix_tree();
 
-  char *key1 = malloc(16);
-  key1[0] = 7;
-  key1++;
-  memcpy((void *)key1, "hello00\0", 8);
-  char *key2 = malloc(16);
-  key2[0] = 6;
-  key2++;
-  memcpy((void *)key2, "hello0\0", 7);
-  char *key3 = malloc(16);
-  key3[0] = 5;
-  key3++;
-  memcpy((void *)key3, "hello\0", 6);
-
-  adaptive_radix_tree_put(art, key1, 7, 0);
-  adaptive_radix_tree_put(art, key2, 6, 0);
-  adaptive_radix_tree_put(art, key3, 5, 0);
-
-  assert(adaptive_radix_tree_get(art, key1, 7) == key1);
-  assert(adaptive_radix_tree_get(art, key2, 6) == key2);
-  assert(adaptive_radix_tree_get(art, key3, 5) == key3);
+  // key is copied by art, and value of existed key is not changed by put
+  char key[6];
+  memcpy(key, "hello", 5);
+  assert(adaptive_radix_tree_put(art, key, 5, (void *)1) == 0);
+  memcpy(key, "world", 5);
+  assert(adaptive_radix_tree_put(art, "hello", 5, (void *)2) == 1);
+  assert(adaptive_radix_tree_get(art, "hello", 5) == (void *)1);
+  assert(adaptive_radix_tree_get(art, "world", 5) == 0);
+
+  void *old = 0;
+  assert(adaptive_radix_tree_update(art, "hello", 5, (void *)3, &old) == 0);
+  assert(old == (void *)1);
+  assert(adaptive_radix_tree_get(art, "hello", 5) == (void *)3);
+  assert(adaptive_radix_tree_update(art, "world", 5, (void *)4, 0) == 1);
+  assert(adaptive_radix_tree_get(art, "world", 5) == 0);
+
+  // keys with the same length and the same last 8 bytes have the same fingerprint
+  assert(adaptive_radix_tree_put(art, "a12345678", 9, (void *)5) == 0);
+  assert(adaptive_radix_tree_put(art, "b12345678", 9, (void *)6) == 0);
+  assert(adaptive_radix_tree_get(art, "c12345678", 9) == 0);
+  assert(adaptive_radix_tree_delete(art, "a12345678", 9) == 0);
+  assert(adaptive_radix_tree_get(art, "a12345678", 9) == 0);
+  assert(adaptive_radix_tree_get(art, "b12345678", 9) == (void *)6);
+  assert(adaptive_radix_tree_delete(art, "c12345678", 9) == 1);
+
+  // there is no contention without other threads
+  art_stats stats;
+  adaptive_radix_tree_get_stats(art, &stats);
+  assert(stats.lock_spins == 0 && stats.restarts == 0);
+
+  free_adaptive_radix_tree(art);
+  }
+}
+
+// key is prefixed by its length so that keys can be sorted without their lengths
+static char* new_test_key(int i, size_t *len)
+{
+  char buf[32];
+  *len = snprintf(buf, sizeof(buf), "%x%d", i * 2654435761u, i);
+  char *key = malloc(*len + 1);
+  key[0] = (char)*len;
+  memcpy(key + 1, buf, *len);
+  return key + 1;
+}
+
+struct keys_arg
+{
+  adaptive_radix_tree *art;
+  char **keys;
+  size_t *lens;
+  int id;
+  int thread_number;
+  int total_keys;
+};
+
+static void* run_delete(void *arg)
+{
+  struct keys_arg *da = (struct keys_arg *)arg;
+  // every thread deletes its own keys while keys of other threads stay intact
+  for (int i = da->id; i < da->total_keys; i += da->thread_number) {
+    assert(adaptive_radix_tree_delete(da->art, da->keys[i], da->lens[i]) == 0);
+    int j = (i + 1) % da->total_keys;
+    if ((j % da->thread_number) & 1)
+      assert(adaptive_radix_tree_get(da->art, da->keys[j], da->lens[j]) == (void *)(uintptr_t)(j + 1));
+  }
+  return (void *)da;
+}
+
+void test_adaptive_radix_tree_delete(int thread_number, int total_keys)
+{
+  adaptive_radix_tree *art = new_adaptive_radix_tree();
+
+  char **keys = malloc(sizeof(char *) * total_keys);
+  size_t *lens = malloc(sizeof(size_t) * total_keys);
+  for (int i = 0; i < total_keys; ++i) {
+    keys[i] = new_test_key(i, &lens[i]);
+    assert(adaptive_radix_tree_put(art, keys[i], lens[i], (void *)(uintptr_t)(i + 1)) == 0);
+  }
+
+  // delete a key that does not exist
+  size_t none_len;
+  char *none = new_test_key(total_keys, &none_len);
+  assert(adaptive_radix_tree_delete(art, none, none_len) == 1);
+
+  // delete half of the keys, keys with odd thread id are kept
+  int delete_threads = thread_number * 2;
+  pthread_t ids[delete_threads];
+  for (int i = 0; i < delete_threads; i += 2) {
+    struct keys_arg *da = malloc(sizeof(struct keys_arg));
+    da->art = art;
+    da->keys = keys;
+    da->lens = lens;
+    da->id = i;
+    da->thread_number = delete_threads;
+    da->total_keys = total_keys;
+    assert(pthread_create(&ids[i], 0, run_delete, (void *)da) == 0);
+  }
+  for (int i = 0; i < delete_threads; i += 2) {
+    struct keys_arg *da;
+    assert(pthread_join(ids[i], (void **)&da) == 0);
+    free(da);
+  }
+
+  art_stats stats;
+  adaptive_radix_tree_get_stats(art, &stats);
+  printf("delete  lock spins: %lu  restarts: %lu\n", (unsigned long)stats.lock_spins,
+    (unsigned long)stats.restarts);
+
+  for (int i = 0; i < total_keys; ++i) {
+    if ((i % delete_threads) & 1) {
+      assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == (void *)(uintptr_t)(i + 1));
+    } else {
+      assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == 0);
+      assert(adaptive_radix_tree_delete(art, keys[i], lens[i]) == 1);
+    }
+  }
+
+  // delete the rest so that every node shrinks and art becomes empty
+  for (int i = 0; i < total_keys; ++i)
+    if ((i % delete_threads) & 1)
+      assert(adaptive_radix_tree_delete(art, keys[i], lens[i]) == 0);
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == 0);
+
+  // art is still usable after all keys are deleted
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_put(art, keys[i], lens[i], (void *)(uintptr_t)(i + 1)) == 0);
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == (void *)(uintptr_t)(i + 1));
+
+  free_adaptive_radix_tree(art);
+}
+
+struct scan_arg
+{
+  const char *prev;
+  size_t prev_len;
+  int count;
+  int limit;
+};
+
+static int key_compare(const char *k1, size_t l1, const char *k2, size_t l2)
+{
+  int r = memcmp(k1, k2, l1 < l2 ? l1 : l2);
+  return r ? r : (int)l1 - (int)l2;
+}
+
+static int scan_check(void *arg, const void *key, size_t len, void *value)
+{
+  struct scan_arg *sa = (struct scan_arg *)arg;
+  assert(value);
+  if (sa->prev)
+    assert(key_compare(sa->prev, sa->prev_len, (const char *)key, len) < 0);
+  sa->prev = (const char *)key;
+  sa->prev_len = len;
+  return ++sa->count == sa->limit;
+}
+
+static int compare_key_ptr(const void *a, const void *b)
+{
+  const char *k1 = *(const char **)a, *k2 = *(const char **)b;
+  return key_compare(k1, (size_t)k1[-1], k2, (size_t)k2[-1]);
+}
+
+static void* run_put(void *arg)
+{
+  struct keys_arg *da = (struct keys_arg *)arg;
+  for (int i = da->id; i < da->total_keys; i += da->thread_number)
+    assert(adaptive_radix_tree_put(da->art, da->keys[i], da->lens[i], (void *)(uintptr_t)(i + 1)) == 0);
+  return (void *)da;
+}
+
+void test_adaptive_radix_tree_scan(int thread_number, int total_keys)
+{
+  adaptive_radix_tree *art = new_adaptive_radix_tree();
+
+  char **keys = malloc(sizeof(char *) * total_keys);
+  size_t *lens = malloc(sizeof(size_t) * total_keys);
+  for (int i = 0; i < total_keys; ++i)
+    keys[i] = new_test_key(i, &lens[i]);
+
+  // scan while other threads are inserting, keys must still be in order
+  pthread_t ids[thread_number];
+  for (int i = 0; i < thread_number; ++i) {
+    struct keys_arg *da = malloc(sizeof(struct keys_arg));
+    da->art = art;
+    da->keys = keys;
+    da->lens = lens;
+    da->id = i;
+    da->thread_number = thread_number;
+    da->total_keys = total_keys;
+    assert(pthread_create(&ids[i], 0, run_put, (void *)da) == 0);
+  }
+  for (int i = 0; i < 8; ++i) {
+    struct scan_arg sa = {0, 0, 0, 0};
+    assert(adaptive_radix_tree_scan(art, 0, 0, 0, 0, scan_check, &sa) == (size_t)sa.count);
+  }
+  for (int i = 0; i < thread_number; ++i) {
+    struct keys_arg *da;
+    assert(pthread_join(ids[i], (void **)&da) == 0);
+    free(da);
+  }
+
+  qsort(keys, total_keys, sizeof(char *), compare_key_ptr);
+  for (int i = 0; i < total_keys; ++i)
+    lens[i] = (size_t)keys[i][-1];
+
+  // full scan
+  struct scan_arg sa = {0, 0, 0, 0};
+  assert(adaptive_radix_tree_scan(art, 0, 0, 0, 0, scan_check, &sa) == (size_t)total_keys);
+  assert(sa.count == total_keys);
+
+  // range scan, `start` is included and `end` is excluded
+  int from = total_keys / 3, to = total_keys / 3 * 2;
+  memset(&sa, 0, sizeof(sa));
+  assert(adaptive_radix_tree_scan(art, keys[from], lens[from], keys[to], lens[to], scan_check, &sa) ==
+    (size_t)(to - from));
+  assert(key_compare(sa.prev, sa.prev_len, keys[to - 1], lens[to - 1]) == 0);
+
+  // scan stops when callback returns non-zero
+  memset(&sa, 0, sizeof(sa));
+  sa.limit = 10;
+  assert(adaptive_radix_tree_scan(art, keys[from], lens[from], 0, 0, scan_check, &sa) == 10);
+  if (from + 10 <= total_keys)
+    assert(key_compare(sa.prev, sa.prev_len, keys[from + 9], lens[from + 9]) == 0);
+
+  // prefix scan
+  for (int i = 0; i < total_keys; i += total_keys / 7 + 1) {
+    size_t plen = lens[i] < 2 ? lens[i] : 2;
+    int expect = 0;
+    for (int j = 0; j < total_keys; ++j)
+      if (lens[j] >= plen && memcmp(keys[j], keys[i], plen) == 0)
+        ++expect;
+    memset(&sa, 0, sizeof(sa));
+    assert(adaptive_radix_tree_prefix_scan(art, keys[i], plen, scan_check, &sa) == (size_t)expect);
+  }
+
+  free_adaptive_radix_tree(art);
+}
+
+// keys share long prefixes at different levels, like urls
+static char* new_url_key(int i, size_t *len)
+{
+  char buf[128];
+  *len = snprintf(buf, sizeof(buf), "https://www.example.com/%d/very/long/common/path/%d/%d", i % 3, i % 7, i);
+  char *key = malloc(*len + 1);
+  key[0] = (char)*len;
+  memcpy(key + 1, buf, *len);
+  return key + 1;
+}
+
+static int count_keys(void *arg, const void *key, size_t len, void *value)
+{
+  (void)key;
+  (void)len;
+  (void)value;
+  ++*(int *)arg;
+  return 0;
+}
+
+void test_adaptive_radix_tree_long_prefix(int thread_number, int total_keys)
+{
+  adaptive_radix_tree *art = new_adaptive_radix_tree();
+
+  char **keys = malloc(sizeof(char *) * total_keys);
+  size_t *lens = malloc(sizeof(size_t) * total_keys);
+  for (int i = 0; i < total_keys; ++i)
+    keys[i] = new_url_key(i, &lens[i]);
+
+  pthread_t ids[thread_number];
+  for (int i = 0; i < thread_number; ++i) {
+    struct keys_arg *da = malloc(sizeof(struct keys_arg));
+    da->art = art;
+    da->keys = keys;
+    da->lens = lens;
+    da->id = i;
+    da->thread_number = thread_number;
+    da->total_keys = total_keys;
+    assert(pthread_create(&ids[i], 0, run_put, (void *)da) == 0);
+  }
+  for (int i = 0; i < thread_number; ++i) {
+    struct keys_arg *da;
+    assert(pthread_join(ids[i], (void **)&da) == 0);
+    free(da);
+  }
+
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == (void *)(uintptr_t)(i + 1));
+
+  // keys that only differ from existing keys beyond the stored prefix
+  assert(adaptive_radix_tree_get(art, "https://www.example.com/0/very/long/common/path/0/0x", 52) == 0);
+  assert(adaptive_radix_tree_get(art, "https://www.example.com/0/very/long/commom/path/0/0", 51) == 0);
+  assert(adaptive_radix_tree_get(art, "https://www.example.com/0/very/long", 35) == 0);
+  assert(adaptive_radix_tree_delete(art, "https://www.example.com/0/very/long/commom/path/0/0", 51) == 1);
+
+  int count = 0;
+  const char *prefix = "https://www.example.com/1/very/long/common/path/";
+  adaptive_radix_tree_prefix_scan(art, prefix, strlen(prefix), count_keys, &count);
+  int expect = 0;
+  for (int i = 0; i < total_keys; ++i)
+    expect += i % 3 == 1;
+  assert(count == expect);
+
+  // deleting keys collapses nodes and merges their prefixes
+  for (int i = 0; i < total_keys; ++i)
+    if (i % 3)
+      assert(adaptive_radix_tree_delete(art, keys[i], lens[i]) == 0);
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == (i % 3 ? 0 : (void *)(uintptr_t)(i + 1)));
+  for (int i = 0; i < total_keys; ++i)
+    if (i % 3)
+      assert(adaptive_radix_tree_put(art, keys[i], lens[i], (void *)(uintptr_t)(i + 1)) == 0);
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == (void *)(uintptr_t)(i + 1));
+
+  free_adaptive_radix_tree(art);
+}
+
+// long keys share a prefix longer than 255 bytes, and they diverge at offsets beyond 255
+static char* new_long_key(int i, size_t *len)
+{
+  size_t common = 300 + (i % 5) * 200;
+  *len = common + 16;
+  char *key = malloc(*len + 1);
+  memset(key, 'k', common);
+  snprintf(key + common, 17, "%016x", i * 2654435761u);
+  return key;
+}
+
+void test_adaptive_radix_tree_long_key(int thread_number, int total_keys)
+{
+  adaptive_radix_tree *art = new_adaptive_radix_tree();
+
+  char **keys = malloc(sizeof(char *) * total_keys);
+  size_t *lens = malloc(sizeof(size_t) * total_keys);
+  for (int i = 0; i < total_keys; ++i)
+    keys[i] = new_long_key(i, &lens[i]);
+
+  pthread_t ids[thread_number];
+  for (int i = 0; i < thread_number; ++i) {
+    struct keys_arg *da = malloc(sizeof(struct keys_arg));
+    da->art = art;
+    da->keys = keys;
+    da->lens = lens;
+    da->id = i;
+    da->thread_number = thread_number;
+    da->total_keys = total_keys;
+    assert(pthread_create(&ids[i], 0, run_put, (void *)da) == 0);
+  }
+  for (int i = 0; i < thread_number; ++i) {
+    struct keys_arg *da;
+    assert(pthread_join(ids[i], (void **)&da) == 0);
+    free(da);
+  }
+
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == (void *)(uintptr_t)(i + 1));
+  // prefix of an existing key
+  assert(adaptive_radix_tree_get(art, keys[0], lens[0] - 1) == 0);
+
+  int count = 0;
+  assert(adaptive_radix_tree_scan(art, 0, 0, 0, 0, count_keys, &count) == (size_t)total_keys);
+  assert(count == total_keys);
+
+  for (int i = 0; i < total_keys; i += 2)
+    assert(adaptive_radix_tree_delete(art, keys[i], lens[i]) == 0);
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == (i % 2 ? (void *)(uintptr_t)(i + 1) : 0));
+
+  free_adaptive_radix_tree(art);
+}
+
+static void multi_get_check(adaptive_radix_tree *art, char **keys, size_t *lens, int total_keys, int batch,
+  int concurrent)
+{
+  void **values = malloc(sizeof(void *) * batch);
+  for (int i = 0; i < total_keys; i += batch) {
+    int n = total_keys - i < batch ? total_keys - i : batch;
+    adaptive_radix_tree_multi_get(art, (const void **)(keys + i), lens + i, n, values);
+    for (int j = 0; j < n; ++j) {
+      void *expect = (void *)(uintptr_t)(i + j + 1);
+      if (concurrent)
+        assert(values[j] == 0 || values[j] == expect);
+      else
+        assert(values[j] == adaptive_radix_tree_get(art, keys[i + j], lens[i + j]));
+    }
+  }
+  free(values);
+}
+
+void test_adaptive_radix_tree_multi_get(int thread_number, int total_keys)
+{
+  adaptive_radix_tree *art = new_adaptive_radix_tree();
+
+  char **keys = malloc(sizeof(char *) * total_keys);
+  size_t *lens = malloc(sizeof(size_t) * total_keys);
+  for (int i = 0; i < total_keys; ++i)
+    keys[i] = new_test_key(i, &lens[i]);
+
+  // empty art
+  multi_get_check(art, keys, lens, total_keys, 16, 0 /* concurrent */);
+
+  // multi get while other threads are putting
+  pthread_t ids[thread_number];
+  for (int i = 0; i < thread_number; ++i) {
+    struct keys_arg *da = malloc(sizeof(struct keys_arg));
+    da->art = art;
+    da->keys = keys;
+    da->lens = lens;
+    da->id = i;
+    da->thread_number = thread_number;
+    da->total_keys = total_keys;
+    assert(pthread_create(&ids[i], 0, run_put, (void *)da) == 0);
+  }
+  multi_get_check(art, keys, lens, total_keys, 64, 1 /* concurrent */);
+  for (int i = 0; i < thread_number; ++i) {
+    struct keys_arg *da;
+    assert(pthread_join(ids[i], (void **)&da) == 0);
+    free(da);
+  }
+
+  // batches smaller than, equal to and larger than the interleaved group
+  int batches[] = {1, 3, 8, 100};
+  for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); ++i)
+    multi_get_check(art, keys, lens, total_keys, batches[i], 0 /* concurrent */);
+
+  // half of the keys are missing, including prefixes of existing keys
+  for (int i = 0; i < total_keys; i += 2)
+    assert(adaptive_radix_tree_delete(art, keys[i], lens[i]) == 0);
+  for (int i = 0; i < total_keys; i += 3)
+    --lens[i];
+  multi_get_check(art, keys, lens, total_keys, 32, 0 /* concurrent */);
 
   free_adaptive_radix_tree(art);
+}
+
+static void bulk_load_check(char **keys, int total_keys, int thread_number)
+{
+  adaptive_radix_tree *art = new_adaptive_radix_tree();
+
+  qsort(keys, total_keys, sizeof(char *), compare_key_ptr);
+  size_t *lens = malloc(sizeof(size_t) * total_keys);
+  void **values = malloc(sizeof(void *) * total_keys);
+  for (int i = 0; i < total_keys; ++i) {
+    lens[i] = (size_t)keys[i][-1];
+    values[i] = (void *)(uintptr_t)(i + 1);
   }
+
+  assert(adaptive_radix_tree_bulk_load(art, (const void **)keys, lens, values, total_keys, thread_number) == 0);
+  // art is not empty
+  assert(adaptive_radix_tree_bulk_load(art, (const void **)keys, lens, values, total_keys, thread_number) == 1);
+
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == (void *)(uintptr_t)(i + 1));
+
+  struct scan_arg sa = {0, 0, 0, 0};
+  assert(adaptive_radix_tree_scan(art, 0, 0, 0, 0, scan_check, &sa) == (size_t)total_keys);
+
+  // loaded art works like any other art
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_put(art, keys[i], lens[i], 0) == 1);
+  for (int i = 0; i < total_keys; i += 2)
+    assert(adaptive_radix_tree_delete(art, keys[i], lens[i]) == 0);
+  for (int i = 0; i < total_keys; i += 2)
+    assert(adaptive_radix_tree_put(art, keys[i], lens[i], (void *)(uintptr_t)(i + 1)) == 0);
+  for (int i = 0; i < total_keys; ++i)
+    assert(adaptive_radix_tree_get(art, keys[i], lens[i]) == (void *)(uintptr_t)(i + 1));
+
+  free(values);
+  free(lens);
+  free_adaptive_radix_tree(art);
+}
+
+void test_adaptive_radix_tree_bulk_load(int thread_number, int total_keys)
+{
+  char **keys = malloc(sizeof(char *) * total_keys);
+  size_t len;
+
+  for (int i = 0; i < total_keys; ++i)
+    keys[i] = new_test_key(i, &len);
+  bulk_load_check(keys, total_keys, thread_number);
+
+  // some keys are prefixes of others
+  for (int i = 0; i < total_keys; ++i)
+    keys[i] = new_url_key(i, &len);
+  bulk_load_check(keys, total_keys, thread_number);
+
+  // duplicated keys, the first value wins
+  adaptive_radix_tree *art = new_adaptive_radix_tree();
+  const void *dup[] = {"a", "b", "b", "b", "c"};
+  size_t dup_lens[] = {1, 1, 1, 1, 1};
+  void *dup_values[] = {(void *)1, (void *)2, (void *)3, (void *)4, (void *)5};
+  assert(adaptive_radix_tree_bulk_load(art, dup, dup_lens, dup_values, 5, thread_number) == 0);
+  assert(adaptive_radix_tree_get(art, "b", 1) == (void *)2);
+  int count = 0;
+  assert(adaptive_radix_tree_scan(art, 0, 0, 0, 0, count_keys, &count) == 3);
+  free_adaptive_radix_tree(art);
 }
 
 int main(int argc, char **argv)
@@ -222,6 +686,12 @@ int main(int argc, char **argv)
 
   //test_adaptive_radix_tree(file, thread_number, total_keys);
   test_adaptive_radix_tree_structure();
+  test_adaptive_radix_tree_delete(thread_number, total_keys);
+  test_adaptive_radix_tree_scan(thread_number, total_keys);
+  test_adaptive_radix_tree_long_prefix(thread_number, total_keys);
+  test_adaptive_radix_tree_long_key(thread_number, total_keys);
+  test_adaptive_radix_tree_multi_get(thread_number, total_keys);
+  test_adaptive_radix_tree_bulk_load(thread_number, total_keys);
 
   return 0;
 }
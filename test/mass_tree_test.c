@@ -36,9 +36,31 @@ struct thread_arg
   mass_tree *mt;
   int file;
   int total_keys;
-  int write;
+  int write; // 1: put, 0: get, 2: multi get
 };
 
+#define multi_get_batch 32
+
+// keys in data file do not outlive their buffer, so value is a hash of the key that can be checked
+static void* key_value(const void *key, uint32_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (uint32_t i = 0; i < len; ++i)
+    h = (h ^ ((const unsigned char *)key)[i]) * 1099511628211ULL;
+  return (void *)(uintptr_t)(h | 1);
+}
+
+static void multi_get_check(mass_tree *mt, const void **keys, uint32_t *lens, int *n)
+{
+  void *values[multi_get_batch];
+  mass_tree_multi_get(mt, keys, lens, *n, values);
+  for (int i = 0; i < *n; ++i) {
+    assert(values[i]);
+    assert(values[i] == key_value(keys[i], lens[i]));
+  }
+  *n = 0;
+}
+
 static void* run(void *arg)
 {
   struct thread_arg *ta = (struct thread_arg *)arg;
@@ -60,6 +82,9 @@ static void* run(void *arg)
   char buf[block];
   int flag = 1;
   long long before = mstime();
+  const void *batch[multi_get_batch];
+  uint32_t lens[multi_get_batch];
+  int batched = 0;
   for (; (ptr = pread(fd, buf, block, curr)) > 0 && flag; curr += ptr) {
     while (--ptr && buf[ptr] != '\n' && buf[ptr] != '\0') buf[ptr] = '\0';
     if (ptr) buf[ptr++] = '\0';
@@ -80,15 +105,13 @@ static void* run(void *arg)
         break;
       }
 
-      if (write) {
-        void *slice;
-        #ifdef Allocator
-          slice = allocator_alloc_small(len);
-        #else
-          slice = malloc(len);
-        #endif // Allocator
-        memcpy(slice, key, len);
-        mass_tree_put(mt, slice, len, (const void *)3190);
+      if (write == 1) {
+        mass_tree_put(mt, key, len, key_value(key, len));
+      } else if (write == 2) {
+        batch[batched] = key;
+        lens[batched] = len;
+        if (++batched == multi_get_batch)
+          multi_get_check(mt, batch, lens, &batched);
       } else {
         void *value = mass_tree_get(mt, key, len);
         if (value == 0) {
@@ -98,9 +121,12 @@ static void* run(void *arg)
           printf("%s\n", buf);
         }
         assert(value);
-        assert(memcmp(value, key, len) == 0);
+        assert(value == key_value(key, len));
       }
     }
+    // keys live in `buf`, finish them before it's overwritten
+    if (batched)
+      multi_get_check(mt, batch, lens, &batched);
   }
 
   long long after = mstime();
@@ -149,7 +175,773 @@ void test_mass_tree(int file, int thread_number, int total_keys)
     free(ta);
   }
 
+  for (int i = 0; i < thread_number; ++i) {
+    struct thread_arg *ta = malloc(sizeof(struct thread_arg));
+    ta->mt = mt;
+    ta->file = i + file;
+    ta->total_keys = thread_keys;
+    ta->write = 2;
+    assert(pthread_create(&ids[i], 0, run, (void *)ta) == 0);
+  }
+
+  for (int i = 0; i < thread_number; ++i) {
+    struct thread_arg *ta;
+    assert(pthread_join(ids[i], (void **)&ta) == 0);
+    free(ta);
+  }
+
+  mass_stats stats;
+  mass_tree_get_stats(mt, &stats);
+  // readers wait only when there is a writer
+  assert(thread_number > 1 || (stats.lock_spins == 0 && stats.stable_waits == 0));
+  printf("lock spins: %lu  stable waits: %lu  stable spins: %lu  sleeps: %lu\n",
+    (unsigned long)stats.lock_spins, (unsigned long)stats.stable_waits, (unsigned long)stats.stable_spins,
+    (unsigned long)stats.sleeps);
+
+  free_mass_tree(mt);
+}
+
+struct delete_arg
+{
+  mass_tree *mt;
+  char **keys;
+  uint32_t *lens;
+  int begin;
+  int end;
+  int remove; // 1: delete, 0: get
+};
+
+// keys share several keyslices so that there are multiple layers
+static char* new_test_key(int i, uint32_t *len)
+{
+  char buf[64];
+  *len = snprintf(buf, sizeof(buf), "%08d%08d%d", i % 7, i % 131, i);
+  char *key = malloc(*len);
+  memcpy(key, buf, *len);
+  return key;
+}
+
+// value is the test key itself so that it can be checked
+static void put_test_key(mass_tree *mt, const char *key, uint32_t len)
+{
+  assert(mass_tree_put(mt, key, len, key) == 1);
+}
+
+static void* run_delete(void *arg)
+{
+  struct delete_arg *da = (struct delete_arg *)arg;
+  for (int i = da->begin; i < da->end; ++i) {
+    if (da->remove) {
+      assert(mass_tree_delete(da->mt, da->keys[i], da->lens[i]) == 1);
+      assert(mass_tree_get(da->mt, da->keys[i], da->lens[i]) == 0);
+    } else {
+      void *value = mass_tree_get(da->mt, da->keys[i], da->lens[i]);
+      assert(value && memcmp(value, da->keys[i], da->lens[i]) == 0);
+    }
+  }
+  return arg;
+}
+
+struct read_arg
+{
+  mass_tree *mt;
+  char **keys;
+  uint32_t *lens;
+  int total_keys;
+  int stop;
+  int step;         // 1 for forward scan, -1 for reverse scan
+  const char *last; // last key visited by scan
+  uint32_t last_len;
+};
+
+// a visited key might be deleted later, but its value must be the key, and keys are in order
+static int read_check(void *arg, const void *key, uint32_t len, void *value)
+{
+  struct read_arg *ra = (struct read_arg *)arg;
+  assert(value && memcmp(value, key, len) == 0);
+  if (ra->last) {
+    int r = memcmp(ra->last, key, ra->last_len < len ? ra->last_len : len);
+    if (r == 0)
+      r = ra->last_len < len ? -1 : ra->last_len > len;
+    assert(ra->step > 0 ? r < 0 : r > 0);
+  }
+  ra->last = value;
+  ra->last_len = len;
+  return 0;
+}
+
+// get, multi-get and scan keys that are being deleted, until `stop` is set
+static void* run_read(void *arg)
+{
+  struct read_arg *ra = (struct read_arg *)arg;
+  const void *keys[16];
+  void *values[16];
+  for (int i = 0; !__atomic_load_n(&ra->stop, __ATOMIC_ACQUIRE); i = (i + 16) % ra->total_keys) {
+    int n = ra->total_keys - i < 16 ? ra->total_keys - i : 16;
+    for (int j = 0; j < n; ++j) {
+      void *value = mass_tree_get(ra->mt, ra->keys[i + j], ra->lens[i + j]);
+      assert(value == 0 || memcmp(value, ra->keys[i + j], ra->lens[i + j]) == 0);
+      keys[j] = ra->keys[i + j];
+    }
+    mass_tree_multi_get(ra->mt, keys, ra->lens + i, n, values);
+    for (int j = 0; j < n; ++j)
+      assert(values[j] == 0 || memcmp(values[j], ra->keys[i + j], ra->lens[i + j]) == 0);
+
+    ra->last = 0;
+    ra->step = 1;
+    mass_tree_scan(ra->mt, ra->keys[i], ra->lens[i], 64, read_check, ra);
+    ra->last = 0;
+    ra->step = -1;
+    mass_tree_reverse_scan(ra->mt, ra->keys[i], ra->lens[i], 64, read_check, ra);
+  }
+  return arg;
+}
+
+// delete half of the keys while the other half is read, then delete all and put them back
+void test_mass_tree_delete(int thread_number, int total_keys)
+{
+  mass_tree *mt = new_mass_tree(thread_number);
+
+  char **keys = malloc(sizeof(char *) * total_keys);
+  uint32_t *lens = malloc(sizeof(uint32_t) * total_keys);
+  for (int i = 0; i < total_keys; ++i) {
+    keys[i] = new_test_key(i, &lens[i]);
+    put_test_key(mt, keys[i], lens[i]);
+  }
+  mass_tree_validate(mt);
+
+  int thread_keys = total_keys / thread_number;
+  pthread_t ids[thread_number];
+  struct delete_arg args[thread_number];
+  for (int i = 0; i < thread_number; ++i) {
+    args[i].mt = mt;
+    args[i].keys = keys;
+    args[i].lens = lens;
+    args[i].begin = i * thread_keys;
+    args[i].end = i == thread_number - 1 ? total_keys : (i + 1) * thread_keys;
+    args[i].remove = (i & 1) == 0;
+    assert(pthread_create(&ids[i], 0, run_delete, (void *)&args[i]) == 0);
+  }
+  for (int i = 0; i < thread_number; ++i)
+    assert(pthread_join(ids[i], 0) == 0);
+
+  mass_tree_validate(mt);
+  for (int i = 0; i < thread_number; ++i) {
+    for (int j = args[i].begin; j < args[i].end; ++j) {
+      void *value = mass_tree_get(mt, keys[j], lens[j]);
+      if (args[i].remove) {
+        assert(value == 0);
+        assert(mass_tree_delete(mt, keys[j], lens[j]) == 0);
+      } else {
+        assert(value && memcmp(value, keys[j], lens[j]) == 0);
+      }
+    }
+  }
+
+  // delete the rest concurrently while they are read, every layer except the first one should be collapsed
+  pthread_t reader;
+  struct read_arg ra = {mt, keys, lens, total_keys, 0, 1, 0, 0};
+  assert(pthread_create(&reader, 0, run_read, (void *)&ra) == 0);
+  for (int i = 0; i < thread_number; ++i) {
+    args[i].remove = 1 - args[i].remove;
+    if (args[i].remove)
+      assert(pthread_create(&ids[i], 0, run_delete, (void *)&args[i]) == 0);
+  }
+  for (int i = 0; i < thread_number; ++i)
+    if (args[i].remove)
+      assert(pthread_join(ids[i], 0) == 0);
+  __atomic_store_n(&ra.stop, 1, __ATOMIC_RELEASE);
+  assert(pthread_join(reader, 0) == 0);
+
+  mass_tree_validate(mt);
+  for (int i = 0; i < total_keys; ++i)
+    assert(mass_tree_get(mt, keys[i], lens[i]) == 0);
+
+  // tree still works after it's emptied
+  for (int i = 0; i < total_keys; ++i)
+    put_test_key(mt, keys[i], lens[i]);
+  mass_tree_validate(mt);
+  for (int i = 0; i < total_keys; ++i) {
+    void *value = mass_tree_get(mt, keys[i], lens[i]);
+    assert(value && memcmp(value, keys[i], lens[i]) == 0);
+    free(keys[i]);
+  }
+
+  free(keys);
+  free(lens);
+  free_mass_tree(mt);
+  printf("delete test passed\n");
+}
+
+// delete and put back one key many times, suffix bag must not grow with it
+void test_mass_tree_bag()
+{
+  mass_tree *mt = new_mass_tree(1);
+
+  char keys[10][32];
+  uint32_t len = 0;
+  for (int i = 0; i < 10; ++i) {
+    len = snprintf(keys[i], sizeof(keys[i]), "%08d-a-long-key-suffix", i);
+    put_test_key(mt, keys[i], len);
+  }
+
+  for (int i = 0; i < 1000000; ++i) {
+    assert(mass_tree_delete(mt, keys[3], len) == 1);
+    put_test_key(mt, keys[3], len);
+  }
+
+  // root is the only border mass_node, its bag only needs to hold suffixes of 10 keys
+  assert(mass_node_get_bag_size(mt->root) <= 1024);
+  mass_tree_validate(mt);
+
   free_mass_tree(mt);
+  printf("bag test passed\n");
+}
+
+// write `k` in big endian so that keys are in the order of numbers
+static void set_u64_key(char *key, uint64_t k)
+{
+  for (int i = sizeof(uint64_t) - 1; i >= 0; --i, k >>= 8)
+    key[i] = (char)(k & 0xff);
+}
+
+// key `i` of churn test, `layers` means keys are test keys that have several layers,
+// otherwise they are 8 byte keys in the order of `i`
+static uint32_t churn_key(char *key, int i, int layers)
+{
+  if (layers)
+    return snprintf(key, 32, "%08d%08d%d", i % 7, i % 131, i);
+  set_u64_key(key, (uint64_t)i);
+  return sizeof(uint64_t);
+}
+
+// put key `i` and delete key `i - window` again and again, mass_nodes emptied by the delete must be
+// reclaimed, so the tree does not grow with the number of operations
+void test_mass_tree_churn(int window)
+{
+  for (int layers = 0; layers < 2; ++layers) {
+    mass_tree *mt = new_mass_tree(1);
+    char key[32];
+    uint32_t len;
+    for (int i = 0; i < window; ++i) {
+      len = churn_key(key, i, layers);
+      assert(mass_tree_put(mt, key, len, (void *)(uint64_t)(i + 1)) == 1);
+    }
+    uint32_t nodes = mass_node_get_node_count(mt->root);
+
+    int rounds = 40;
+    for (int i = window; i < window * (rounds + 1); ++i) {
+      len = churn_key(key, i, layers);
+      assert(mass_tree_put(mt, key, len, (void *)(uint64_t)(i + 1)) == 1);
+      len = churn_key(key, i - window, layers);
+      assert(mass_tree_delete(mt, key, len) == 1);
+      if ((i % window) == 0) {
+        assert(mass_node_get_node_count(mt->root) <= 2 * nodes);
+        mass_tree_validate(mt);
+      }
+    }
+
+    for (int i = 0; i < window * (rounds + 1); ++i) {
+      len = churn_key(key, i, layers);
+      void *value = mass_tree_get(mt, key, len);
+      assert(i < window * rounds ? value == 0 : value == (void *)(uint64_t)(i + 1));
+    }
+    free_mass_tree(mt);
+  }
+  printf("churn test passed\n");
+}
+
+static int compare_test_key(const char *k1, uint32_t l1, const char *k2, uint32_t l2)
+{
+  int r = memcmp(k1, k2, l1 < l2 ? l1 : l2);
+  if (r)
+    return r;
+  return l1 < l2 ? -1 : l1 > l2;
+}
+
+static char **sort_keys;
+static uint32_t *sort_lens;
+
+static int compare_test_key_index(const void *a, const void *b)
+{
+  int i = *(const int *)a, j = *(const int *)b;
+  return compare_test_key(sort_keys[i], sort_lens[i], sort_keys[j], sort_lens[j]);
+}
+
+struct scan_arg
+{
+  char **keys;    // keys expected in order
+  uint32_t *lens;
+  int next;       // index of next expected key
+  int step;       // 1 for forward scan, -1 for reverse scan
+  const char *last;
+  uint32_t last_len;
+  int strict;     // whether every visited key must be expected
+  int total;      // number of expected keys, only needed if not strict
+};
+
+static int scan_check(void *arg, const void *key, uint32_t len, void *value)
+{
+  struct scan_arg *sa = (struct scan_arg *)arg;
+  assert(memcmp(value, key, len) == 0);
+  if (sa->last) {
+    int r = compare_test_key(sa->last, sa->last_len, key, len);
+    assert(sa->step > 0 ? r < 0 : r > 0);
+  }
+  // `key` is only valid inside callback, while `value` is the test key
+  sa->last = value;
+  sa->last_len = len;
+  if (sa->strict) {
+    assert(compare_test_key(sa->keys[sa->next], sa->lens[sa->next], key, len) == 0);
+    sa->next += sa->step;
+  } else if (sa->next >= 0 && sa->next < sa->total && compare_test_key(sa->keys[sa->next], sa->lens[sa->next], key, len) == 0) {
+    sa->next += sa->step;
+  }
+  return 0;
+}
+
+struct churn_arg
+{
+  mass_tree *mt;
+  char **keys;
+  uint32_t *lens;
+  int total_keys;
+  int thread;
+  int thread_number;
+  int rounds;
+};
+
+// put and delete odd keys, even keys are never touched
+static void* run_churn(void *arg)
+{
+  struct churn_arg *ca = (struct churn_arg *)arg;
+  for (int r = 0; r < ca->rounds; ++r) {
+    for (int i = ca->thread * 2 + 1; i < ca->total_keys; i += ca->thread_number * 2)
+      assert(mass_tree_delete(ca->mt, ca->keys[i], ca->lens[i]) == 1);
+    for (int i = ca->thread * 2 + 1; i < ca->total_keys; i += ca->thread_number * 2)
+      put_test_key(ca->mt, ca->keys[i], ca->lens[i]);
+  }
+  return arg;
+}
+
+void test_mass_tree_scan(int thread_number, int total_keys)
+{
+  mass_tree *mt = new_mass_tree(thread_number);
+
+  char **keys = malloc(sizeof(char *) * total_keys);
+  uint32_t *lens = malloc(sizeof(uint32_t) * total_keys);
+  for (int i = 0; i < total_keys; ++i) {
+    keys[i] = new_test_key(i, &lens[i]);
+    put_test_key(mt, keys[i], lens[i]);
+  }
+
+  // keys in order
+  int *order = malloc(sizeof(int) * total_keys);
+  for (int i = 0; i < total_keys; ++i)
+    order[i] = i;
+  sort_keys = keys;
+  sort_lens = lens;
+  qsort(order, total_keys, sizeof(int), compare_test_key_index);
+  char **sorted = malloc(sizeof(char *) * total_keys);
+  uint32_t *sorted_lens = malloc(sizeof(uint32_t) * total_keys);
+  for (int i = 0; i < total_keys; ++i) {
+    sorted[i] = keys[order[i]];
+    sorted_lens[i] = lens[order[i]];
+  }
+
+  struct scan_arg sa = {sorted, sorted_lens, 0, 1, 0, 0, 1, total_keys};
+  assert(mass_tree_scan(mt, 0, 0, 0, scan_check, &sa) == (uint32_t)total_keys);
+  assert(sa.next == total_keys);
+
+  sa = (struct scan_arg){sorted, sorted_lens, total_keys - 1, -1, 0, 0, 1, total_keys};
+  assert(mass_tree_reverse_scan(mt, 0, 0, 0, scan_check, &sa) == (uint32_t)total_keys);
+  assert(sa.next == -1);
+
+  for (int k = 0; k < 1000; ++k) {
+    int i = rand() % total_keys;
+    uint32_t limit = rand() % 100 + 1;
+
+    // start from an existing key
+    sa = (struct scan_arg){sorted, sorted_lens, i, 1, 0, 0, 1, total_keys};
+    uint32_t expect = (uint32_t)(total_keys - i) < limit ? (uint32_t)(total_keys - i) : limit;
+    assert(mass_tree_scan(mt, sorted[i], sorted_lens[i], limit, scan_check, &sa) == expect);
+    sa = (struct scan_arg){sorted, sorted_lens, i, -1, 0, 0, 1, total_keys};
+    expect = (uint32_t)(i + 1) < limit ? (uint32_t)(i + 1) : limit;
+    assert(mass_tree_reverse_scan(mt, sorted[i], sorted_lens[i], limit, scan_check, &sa) == expect);
+
+    // start from a key right after an existing key, or a prefix of it
+    char start[64];
+    uint32_t len = sorted_lens[i];
+    memcpy(start, sorted[i], len);
+    if (k & 1)
+      start[len++] = '0';
+    else
+      len = rand() % len;
+    // last key that is smaller than `start`
+    int j = i;
+    for (; j >= 0 && compare_test_key(sorted[j], sorted_lens[j], start, len) >= 0; --j)
+      ;
+    int first = j + 1;
+    // `start` might be an existing key as well
+    if (first < total_keys && compare_test_key(sorted[first], sorted_lens[first], start, len) == 0)
+      j = first;
+    sa = (struct scan_arg){sorted, sorted_lens, first, 1, 0, 0, 1, total_keys};
+    uint32_t visited = mass_tree_scan(mt, start, len, limit, scan_check, &sa);
+    assert(visited == ((uint32_t)(total_keys - first) < limit ? (uint32_t)(total_keys - first) : limit));
+    sa = (struct scan_arg){sorted, sorted_lens, j, -1, 0, 0, 1, total_keys};
+    visited = mass_tree_reverse_scan(mt, start, len, limit, scan_check, &sa);
+    assert(visited == ((uint32_t)(j + 1) < limit ? (uint32_t)(j + 1) : limit));
+  }
+
+  // scan while odd keys are deleted and put back, even keys must all be visited in order
+  int stable = 0;
+  for (int i = 0; i < total_keys; ++i)
+    if ((order[i] & 1) == 0)
+      ++stable;
+  char **evens = malloc(sizeof(char *) * stable);
+  uint32_t *even_lens = malloc(sizeof(uint32_t) * stable);
+  for (int i = 0, j = 0; i < total_keys; ++i) {
+    if ((order[i] & 1) == 0) {
+      evens[j] = keys[order[i]];
+      even_lens[j++] = lens[order[i]];
+    }
+  }
+
+  pthread_t ids[thread_number];
+  struct churn_arg args[thread_number];
+  for (int i = 0; i < thread_number; ++i) {
+    args[i] = (struct churn_arg){mt, keys, lens, total_keys, i, thread_number, 3};
+    assert(pthread_create(&ids[i], 0, run_churn, (void *)&args[i]) == 0);
+  }
+  for (int k = 0; k < 4; ++k) {
+    sa = (struct scan_arg){evens, even_lens, 0, 1, 0, 0, 0, stable};
+    mass_tree_scan(mt, 0, 0, 0, scan_check, &sa);
+    assert(sa.next == stable);
+    sa = (struct scan_arg){evens, even_lens, stable - 1, -1, 0, 0, 0, stable};
+    mass_tree_reverse_scan(mt, 0, 0, 0, scan_check, &sa);
+    assert(sa.next == -1);
+  }
+  for (int i = 0; i < thread_number; ++i)
+    assert(pthread_join(ids[i], 0) == 0);
+
+  mass_tree_validate(mt);
+  for (int i = 0; i < total_keys; ++i)
+    free(keys[i]);
+  free(keys);
+  free(lens);
+  free(order);
+  free(sorted);
+  free(sorted_lens);
+  free(evens);
+  free(even_lens);
+  free_mass_tree(mt);
+  printf("scan test passed\n");
+}
+
+struct update_arg
+{
+  mass_tree *mt;
+  char **keys;
+  uint32_t *lens;
+  int total_keys;
+  int thread;
+  int thread_number;
+};
+
+#define test_value(i, round) ((void *)(uintptr_t)((uint64_t)(round) * 100000000 + (i) + 1))
+
+// odd threads update their keys through several rounds, even threads read them
+static void* run_update(void *arg)
+{
+  struct update_arg *ua = (struct update_arg *)arg;
+  for (int round = 1; round <= 3; ++round) {
+    for (int i = ua->thread; i < ua->total_keys; i += ua->thread_number) {
+      if (ua->thread & 1) {
+        void *old;
+        assert(mass_tree_update(ua->mt, ua->keys[i], ua->lens[i], test_value(i, round), &old) == 1);
+        assert(old == test_value(i, round - 1));
+      } else {
+        void *value = mass_tree_get(ua->mt, ua->keys[i ^ 1], ua->lens[i ^ 1]);
+        // the key might be updated by any round
+        uint64_t v = (uint64_t)(uintptr_t)value;
+        assert(v && v % 100000000 == (uint64_t)(i ^ 1) + 1);
+      }
+    }
+  }
+  return arg;
+}
+
+void test_mass_tree_update(int thread_number, int total_keys)
+{
+  mass_tree *mt = new_mass_tree(thread_number);
+
+  // need pairs of reader and writer
+  if (thread_number & 1)
+    ++thread_number;
+  total_keys -= total_keys % 2;
+
+  char **keys = malloc(sizeof(char *) * total_keys);
+  uint32_t *lens = malloc(sizeof(uint32_t) * total_keys);
+  for (int i = 0; i < total_keys; ++i) {
+    keys[i] = new_test_key(i, &lens[i]);
+    assert(mass_tree_put(mt, keys[i], lens[i], test_value(i, 0)) == 1);
+  }
+
+  pthread_t ids[thread_number];
+  struct update_arg args[thread_number];
+  for (int i = 0; i < thread_number; ++i) {
+    args[i] = (struct update_arg){mt, keys, lens, total_keys, i, thread_number};
+    assert(pthread_create(&ids[i], 0, run_update, (void *)&args[i]) == 0);
+  }
+  for (int i = 0; i < thread_number; ++i)
+    assert(pthread_join(ids[i], 0) == 0);
+
+  for (int i = 0; i < total_keys; ++i) {
+    void *value = mass_tree_get(mt, keys[i], lens[i]);
+    // keys of odd threads are updated 3 times
+    assert(value == test_value(i, ((i % thread_number) & 1) ? 3 : 0));
+
+    // put does not change value of an existed key, upsert does
+    assert(mass_tree_put(mt, keys[i], lens[i], test_value(i, 5)) == 0);
+    void *old;
+    assert(mass_tree_upsert(mt, keys[i], lens[i], test_value(i, 4), &old) == 0);
+    assert(old == value);
+    assert(mass_tree_get(mt, keys[i], lens[i]) == test_value(i, 4));
+  }
+
+  // update a key that does not exist, then upsert it
+  char key[64];
+  uint32_t len = snprintf(key, sizeof(key), "%08d%08dx", 1, 1);
+  assert(mass_tree_update(mt, key, len, test_value(0, 1), 0) == 0);
+  assert(mass_tree_get(mt, key, len) == 0);
+  assert(mass_tree_upsert(mt, key, len, test_value(0, 1), 0) == 1);
+  assert(mass_tree_get(mt, key, len) == test_value(0, 1));
+
+  // values survive a layer collapse
+  for (int i = 0; i < total_keys; ++i)
+    if (i % 131)
+      assert(mass_tree_delete(mt, keys[i], lens[i]) == 1);
+  for (int i = 0; i < total_keys; i += 131)
+    assert(mass_tree_get(mt, keys[i], lens[i]) == test_value(i, 4));
+  mass_tree_validate(mt);
+
+  for (int i = 0; i < total_keys; ++i)
+    free(keys[i]);
+  free(keys);
+  free(lens);
+  free_mass_tree(mt);
+  printf("update test passed\n");
+}
+
+struct cursor_arg
+{
+  mass_tree *mt;
+  char **keys;    // keys in order
+  uint32_t *lens;
+  int begin;
+  int end;
+};
+
+// put a range of sorted keys through a cursor, then read them back while every third key is deleted
+static void* run_cursor(void *arg)
+{
+  struct cursor_arg *ca = (struct cursor_arg *)arg;
+  mass_cursor *c = new_mass_cursor(ca->mt);
+  for (int i = ca->begin; i < ca->end; ++i)
+    assert(mass_cursor_put(c, ca->keys[i], ca->lens[i], ca->keys[i]) == 1);
+  for (int i = ca->begin; i < ca->end; ++i)
+    assert(mass_cursor_put(c, ca->keys[i], ca->lens[i], 0) == 0);
+
+  for (int i = ca->begin; i < ca->end; ++i) {
+    if (i % 3 == 0) {
+      assert(mass_tree_delete(ca->mt, ca->keys[i], ca->lens[i]) == 1);
+      assert(mass_cursor_get(c, ca->keys[i], ca->lens[i]) == 0);
+    } else {
+      assert(mass_cursor_get(c, ca->keys[i], ca->lens[i]) == ca->keys[i]);
+    }
+  }
+  // reverse order
+  for (int i = ca->end - 1; i >= ca->begin; --i) {
+    void *value = mass_cursor_get(c, ca->keys[i], ca->lens[i]);
+    assert(i % 3 == 0 ? value == 0 : value == ca->keys[i]);
+  }
+  free_mass_cursor(c);
+  return arg;
+}
+
+void test_mass_tree_cursor(int thread_number, int total_keys)
+{
+  mass_tree *mt = new_mass_tree(thread_number);
+
+  char **keys = malloc(sizeof(char *) * total_keys);
+  uint32_t *lens = malloc(sizeof(uint32_t) * total_keys);
+  int *order = malloc(sizeof(int) * total_keys);
+  for (int i = 0; i < total_keys; ++i) {
+    keys[i] = new_test_key(i, &lens[i]);
+    order[i] = i;
+  }
+  sort_keys = keys;
+  sort_lens = lens;
+  qsort(order, total_keys, sizeof(int), compare_test_key_index);
+  char **sorted = malloc(sizeof(char *) * total_keys);
+  uint32_t *sorted_lens = malloc(sizeof(uint32_t) * total_keys);
+  for (int i = 0; i < total_keys; ++i) {
+    sorted[i] = keys[order[i]];
+    sorted_lens[i] = lens[order[i]];
+  }
+
+  int thread_keys = total_keys / thread_number;
+  pthread_t ids[thread_number];
+  struct cursor_arg args[thread_number];
+  for (int i = 0; i < thread_number; ++i) {
+    int end = i == thread_number - 1 ? total_keys : (i + 1) * thread_keys;
+    args[i] = (struct cursor_arg){mt, sorted, sorted_lens, i * thread_keys, end};
+    assert(pthread_create(&ids[i], 0, run_cursor, (void *)&args[i]) == 0);
+  }
+  for (int i = 0; i < thread_number; ++i)
+    assert(pthread_join(ids[i], 0) == 0);
+
+  mass_tree_validate(mt);
+  mass_cursor *c = new_mass_cursor(mt);
+  for (int i = 0; i < total_keys; ++i) {
+    void *value = mass_tree_get(mt, sorted[i], sorted_lens[i]);
+    assert(i % 3 == 0 ? value == 0 : value == sorted[i]);
+    // keys in random order
+    int j = rand() % total_keys;
+    value = mass_cursor_get(c, sorted[j], sorted_lens[j]);
+    assert(j % 3 == 0 ? value == 0 : value == sorted[j]);
+  }
+  free_mass_cursor(c);
+
+  for (int i = 0; i < total_keys; ++i)
+    free(keys[i]);
+  free(keys);
+  free(lens);
+  free(order);
+  free(sorted);
+  free(sorted_lens);
+  free_mass_tree(mt);
+  printf("cursor test passed\n");
+}
+
+// split border mass_node of a cursor hint around 256 times, its 8 bit split version wraps around,
+// keys that have moved to other mass_nodes must not be searched or put there
+void test_mass_tree_cursor_split()
+{
+  // number of puts that splits the leftmost border mass_node once when keys are put in descending order
+  int step = max_key_count - (max_key_count + 1) / 2;
+  for (int puts = 255 * step; puts <= 258 * step; ++puts) {
+    mass_tree *mt = new_mass_tree();
+    mass_cursor *c1 = new_mass_cursor(mt), *c2 = new_mass_cursor(mt);
+    char key[sizeof(uint64_t)], high[sizeof(uint64_t)];
+    set_u64_key(key, (uint64_t)1 << 40);
+    assert(mass_cursor_put(c1, key, sizeof(uint64_t), (void *)1) == 1);
+    assert(mass_cursor_get(c2, key, sizeof(uint64_t)) == (void *)1);
+    set_u64_key(high, (uint64_t)1 << 63);
+    assert(mass_tree_put(mt, high, sizeof(uint64_t), (void *)2) == 1);
+
+    for (int i = puts; i > 0; --i) {
+      set_u64_key(key, ((uint64_t)1 << 40) + i);
+      assert(mass_tree_put(mt, key, sizeof(uint64_t), (void *)1) == 1);
+    }
+
+    assert(mass_cursor_get(c2, high, sizeof(uint64_t)) == (void *)2);
+    set_u64_key(key, (uint64_t)1 << 62);
+    assert(mass_cursor_put(c1, key, sizeof(uint64_t), (void *)3) == 1);
+    assert(mass_tree_get(mt, key, sizeof(uint64_t)) == (void *)3);
+    mass_tree_validate(mt);
+
+    free_mass_cursor(c1);
+    free_mass_cursor(c2);
+    free_mass_tree(mt);
+  }
+  printf("cursor split test passed\n");
+}
+
+struct u64_arg
+{
+  mass_tree *mt;
+  int total_keys;
+  int thread;
+  int thread_number;
+};
+
+// odd multiplier spreads keys over the whole 64 bit space without collision
+#define u64_key(i) ((uint64_t)(i) * 0x9e3779b97f4a7c15)
+
+// put keys of this thread, then delete odd ones while even ones are read and updated
+static void* run_u64(void *arg)
+{
+  struct u64_arg *ua = (struct u64_arg *)arg;
+  for (int i = ua->thread; i < ua->total_keys; i += ua->thread_number)
+    assert(mass_tree_put_u64(ua->mt, u64_key(i), test_value(i, 0)) == 1);
+  for (int i = ua->thread; i < ua->total_keys; i += ua->thread_number) {
+    if (i & 1) {
+      assert(mass_tree_delete_u64(ua->mt, u64_key(i)) == 1);
+      assert(mass_tree_get_u64(ua->mt, u64_key(i)) == 0);
+    } else {
+      void *old;
+      assert(mass_tree_get_u64(ua->mt, u64_key(i)) == test_value(i, 0));
+      assert(mass_tree_update_u64(ua->mt, u64_key(i), test_value(i, 1), &old) == 1);
+      assert(old == test_value(i, 0));
+    }
+  }
+  return arg;
+}
+
+void test_mass_tree_u64(int thread_number, int total_keys)
+{
+  mass_tree *mt = new_mass_tree_u64();
+
+  pthread_t ids[thread_number];
+  struct u64_arg args[thread_number];
+  for (int i = 0; i < thread_number; ++i) {
+    args[i] = (struct u64_arg){mt, total_keys, i, thread_number};
+    assert(pthread_create(&ids[i], 0, run_u64, (void *)&args[i]) == 0);
+  }
+  for (int i = 0; i < thread_number; ++i)
+    assert(pthread_join(ids[i], 0) == 0);
+
+  mass_tree_validate(mt);
+  for (int i = 0; i < total_keys; ++i) {
+    void *value = mass_tree_get_u64(mt, u64_key(i));
+    if (i & 1) {
+      assert(value == 0);
+      assert(mass_tree_delete_u64(mt, u64_key(i)) == 0);
+      assert(mass_tree_update_u64(mt, u64_key(i), test_value(i, 2), 0) == 0);
+      assert(mass_tree_upsert_u64(mt, u64_key(i), test_value(i, 2), 0) == 1);
+    } else {
+      assert(value == test_value(i, 1));
+      assert(mass_tree_put_u64(mt, u64_key(i), test_value(i, 3)) == 0);
+      void *old;
+      assert(mass_tree_upsert_u64(mt, u64_key(i), test_value(i, 2), &old) == 0);
+      assert(old == test_value(i, 1));
+    }
+  }
+  for (int i = 0; i < total_keys; ++i)
+    assert(mass_tree_get_u64(mt, u64_key(i)) == test_value(i, 2));
+
+  // smallest and biggest keys
+  assert(mass_tree_put_u64(mt, ~(uint64_t)0, test_value(0, 4)) == 1);
+  assert(mass_tree_get_u64(mt, ~(uint64_t)0) == test_value(0, 4));
+  assert(mass_tree_get_u64(mt, 0) == test_value(0, 2));
+  mass_tree_validate(mt);
+
+  // tree still works after it's emptied
+  assert(mass_tree_delete_u64(mt, ~(uint64_t)0) == 1);
+  for (int i = 0; i < total_keys; ++i)
+    assert(mass_tree_delete_u64(mt, u64_key(i)) == 1);
+  mass_tree_validate(mt);
+  for (int i = 0; i < total_keys; ++i) {
+    assert(mass_tree_get_u64(mt, u64_key(i)) == 0);
+    assert(mass_tree_put_u64(mt, u64_key(i), test_value(i, 0)) == 1);
+  }
+  for (int i = 0; i < total_keys; ++i)
+    assert(mass_tree_get_u64(mt, u64_key(i)) == test_value(i, 0));
+  mass_tree_validate(mt);
+
+  free_mass_tree(mt);
+  printf("u64 test passed\n");
 }
 
 int main(int argc, char **argv)
@@ -167,5 +959,26 @@ int main(int argc, char **argv)
 
   test_mass_tree(file, thread_number, total_keys);
 
+  test_mass_tree_delete(thread_number, total_keys);
+
+  test_mass_tree_bag();
+
+  test_mass_tree_churn(10000);
+
+  test_mass_tree_scan(thread_number, total_keys);
+
+  test_mass_tree_update(thread_number, total_keys);
+
+  test_mass_tree_cursor(thread_number, total_keys);
+
+  test_mass_tree_cursor_split();
+
+  test_mass_tree_u64(thread_number, total_keys);
+
+  // keyslice search falls back to binary search without avx2
+  mass_node_set_avx2(0);
+  test_mass_tree_delete(thread_number, total_keys);
+  test_mass_tree_scan(thread_number, total_keys);
+
   return 0;
 }
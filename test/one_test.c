@@ -113,18 +113,15 @@ static void* run(void *arg)
     break;
     case MASS: {
       for (int i = 0; i < keys; ++i) {
-        uint64_t *key = (*alloc)(8);
-        *key = rng_next(&r);
-        mass_tree_put(ta->tree.mt, key, 8, 0);
+        uint64_t key = rng_next(&r);
+        mass_tree_put(ta->tree.mt, &key, 8, (void *)3190);
       }
     }
     break;
     case ART: {
       for (int i = 0; i < keys; ++i) {
-        char *key = (*alloc)(16);
-        key[0] = 8;
-        *(uint64_t *)(key + 1)= rng_next(&r);
-        assert(adaptive_radix_tree_put(ta->tree.art, (const void *)(key + 1), 8) == 0);
+        uint64_t key = rng_next(&r);
+        assert(adaptive_radix_tree_put(ta->tree.art, &key, 8, (void *)3190) == 0);
       }
     }
     break;
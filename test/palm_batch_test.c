@@ -10,7 +10,7 @@
 #include <assert.h>
 #include <string.h>
 
-#include "../palm/node.h"
+#include "../palm/batch.h"
 
 #define key_buf(k, l)                \
   uint32_t len = l;                  \
@@ -22,10 +22,18 @@ void test_set_batch_size()
 {
   printf("test set batch size\n");
 
-  set_batch_size(node_min_size + 1);
-  assert(get_batch_size() == node_min_size);
-  set_batch_size(node_max_size + 1);
-  assert(get_batch_size() == node_max_size);
+  set_batch_size(batch_min_size + 1);
+  assert(get_batch_size() == batch_min_size);
+  set_batch_size(batch_max_size + 1);
+  assert(get_batch_size() == batch_max_size);
+
+  // batch size is independent of node size
+  set_node_size(node_min_size);
+  set_batch_size(node_max_size << 4);
+  assert(get_batch_size() == (node_max_size << 4));
+  assert(get_node_size() == node_min_size);
+
+  set_batch_size(batch_min_size);
 }
 
 void test_new_batch()
@@ -80,6 +88,7 @@ void test_batch_write()
   key[3] = '0';
 
   assert(b->keys == 11);
+  batch_sort(b);
   batch_validate(b);
 
   free_batch(b);
@@ -99,6 +108,7 @@ void test_batch_write()
   }
 
   assert(b->keys == 50);
+  batch_sort(b);
   batch_validate(b);
 
   free_batch(b);
@@ -122,6 +132,8 @@ void test_batch_read()
     key[len - i - 1] = '0';
   }
 
+  batch_sort(b);
+
   uint32_t op;
   char *key2;
   uint32_t len2;
@@ -138,6 +150,89 @@ void test_batch_read()
   free_batch(b);
 }
 
+void test_large_batch()
+{
+  printf("test large batch\n");
+
+  set_batch_size(32 << 20);
+
+  batch *b = new_batch();
+
+  // far more operations than a 16-bit index can address, keys are inserted in descending order
+  // so that each of them goes to the front of the index
+  uint32_t total = 1000000;
+  for (uint32_t i = total; i; --i) {
+    uint64_t key = __builtin_bswap64(i); // big endian, so that memcmp order is numeric order
+    assert(batch_add_write(b, &key, sizeof(key), (void *)(uint64_t)i) == 1);
+  }
+
+  assert(b->keys == total);
+  assert(b->off > (1 << 16));
+  batch_sort(b);
+  for (uint32_t i = 0; i < total; ++i)
+    assert((uint64_t)batch_get_value_at(b, i) == i + 1);
+  batch_validate(b);
+
+  // random keys with common prefixes and duplicates
+  batch_clear(b);
+  char key[16];
+  for (uint32_t i = 0; i < total; ++i) {
+    uint32_t len = rand() % sizeof(key) + 1;
+    for (uint32_t j = 0; j < len; ++j)
+      key[j] = j < 4 ? 'a' : 'a' + rand() % 3;
+    assert(batch_add_write(b, key, len, (void *)(uint64_t)i) == 1);
+  }
+  batch_sort(b);
+  batch_validate(b);
+
+  // batch keeps its size
+  set_batch_size(batch_min_size);
+  assert(b->size == (32 << 20));
+
+  free_batch(b);
+}
+
+void test_batch_sort()
+{
+  printf("test batch sort\n");
+
+  key_buf(key, 10);
+
+  batch *b = new_batch();
+
+  // operations on the same key keep the order they are added in
+  srand(time(NULL));
+  for (uint32_t i = 0; i < 100; ++i) {
+    key[0] = '0' + rand() % 3;
+    assert(batch_add_write(b, key, len, (void *)(uint64_t)i) == 1);
+  }
+  batch_sort(b);
+  batch_validate(b);
+
+  uint32_t op, len2;
+  void *key2, *val;
+  for (uint32_t i = 1; i < b->keys; ++i) {
+    batch_read_at(b, i - 1, &op, &key2, &len2, &val);
+    char pre = *(char *)key2;
+    batch_read_at(b, i, &op, &key2, &len2, &val);
+    if (pre == *(char *)key2)
+      assert((uint64_t)batch_get_value_at(b, i - 1) < (uint64_t)batch_get_value_at(b, i));
+  }
+
+  // keys added in order
+  batch_clear(b);
+  for (uint32_t i = 0; i < 100; ++i) {
+    key[0] = '0' + i / 10;
+    key[1] = '0' + i % 10;
+    assert(batch_add_write(b, key, len, (void *)(uint64_t)i) == 1);
+  }
+  batch_sort(b);
+  for (uint32_t i = 0; i < b->keys; ++i)
+    assert((uint64_t)batch_get_value_at(b, i) == i);
+
+  free_batch(b);
+}
+
 void test_print_batch()
 {
   printf("test print batch\n");
@@ -157,6 +252,7 @@ void test_print_batch()
     key[idx] = '0';
   }
 
+  batch_sort(b);
   batch_print(b, 0);
   batch_print(b, 1);
 
@@ -170,6 +266,8 @@ int main()
   test_batch_clear();
   test_batch_write();
   test_batch_read();
+  test_batch_sort();
+  test_large_batch();
   test_print_batch();
 
   return 0;
@@ -0,0 +1,95 @@
+/**
+ *    author:     UncP
+ *    date:    2026-10-17
+ *    license:    BSD-3
+**/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "../palm/bounded_queue.h"
+
+static bounded_queue *queue;
+static int producers, consumers, elements;
+
+// element is `producer * elements + i + 1`, so that it is never 0
+static void* produce(void *arg)
+{
+  uintptr_t id = (uintptr_t)arg;
+  for (int i = 0; i < elements; ++i)
+    bounded_queue_enqueue(queue, (void *)(id * elements + i + 1));
+  return 0;
+}
+
+// every consumer sees every element, and elements of one producer in order
+static void* consume(void *arg)
+{
+  (void)arg;
+  int *last = (int *)malloc(sizeof(int) * producers);
+  for (int i = 0; i < producers; ++i)
+    last[i] = -1;
+
+  uint64_t pos = 0;
+  long count = 0;
+  void *element;
+  while ((element = bounded_queue_get_at(queue, &pos))) {
+    uintptr_t e = (uintptr_t)element - 1;
+    int producer = (int)(e / elements), i = (int)(e % elements);
+    assert(producer < producers && i > last[producer]);
+    last[producer] = i;
+    ++count;
+    bounded_queue_dequeue(queue, pos - 1);
+  }
+
+  for (int i = 0; i < producers; ++i)
+    assert(last[i] == elements - 1);
+  free((void *)last);
+  return (void *)count;
+}
+
+static void test_bounded_queue(int total)
+{
+  printf("test bounded queue with %d slot(s)\n", total);
+
+  queue = new_bounded_queue(total, consumers);
+
+  pthread_t ids[producers + consumers];
+  for (int i = 0; i < consumers; ++i)
+    assert(pthread_create(&ids[i], 0, consume, 0) == 0);
+  for (int i = 0; i < producers; ++i)
+    assert(pthread_create(&ids[consumers + i], 0, produce, (void *)(uintptr_t)i) == 0);
+
+  for (int i = 0; i < producers; ++i)
+    assert(pthread_join(ids[consumers + i], 0) == 0);
+
+  // wait for consumers to release all the elements, then wake them up
+  bounded_queue_clear(queue);
+  assert(queue->head == queue->tail && queue->tail == (uint64_t)producers * elements);
+
+  for (int i = 0; i < consumers; ++i) {
+    void *count;
+    assert(pthread_join(ids[i], &count) == 0);
+    assert((long)count == (long)producers * elements);
+  }
+
+  free_bounded_queue(queue);
+}
+
+int main(int argc, char **argv)
+{
+  producers = argc > 1 ? atoi(argv[1]) : 2;
+  consumers = argc > 2 ? atoi(argv[2]) : 3;
+  elements  = argc > 3 ? atoi(argv[3]) : 20000;
+  if (producers <= 0) producers = 1;
+  if (consumers <= 0) consumers = 1;
+  if (elements <= 0) elements = 1;
+
+  test_bounded_queue(1);
+  test_bounded_queue(3);
+  test_bounded_queue(64);
+
+  return 0;
+}
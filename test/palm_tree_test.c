@@ -34,24 +34,45 @@ static long long mstime()
   return ust / 1000;
 }
 
-void test_palm_tree()
+static int found;
+
+static int batch_add(batch *b, uint32_t op, const void *key, uint32_t len)
 {
-  palm_tree *pt = new_palm_tree(thread_number, queue_size);
-  batch *batches[queue_size + 1];
-  for (int i = 0; i < queue_size + 1; ++i)
-    batches[i] = new_batch();
+  switch (op) {
+  case Write:  return batch_add_write(b, key, len, (void *)value);
+  case Read:   return batch_add_read(b, key, len);
+  case Delete: return batch_add_delete(b, key, len);
+  default:     assert(0);
+  }
+}
 
-  char file_name[32];
-  memset(file_name, 0, 32);
-  memcpy(file_name, "./data/", 7);
-  memcpy(file_name + 7, file_str, strlen(file_str));
+// every key exists
+static void check_value(batch *b)
+{
+  for (uint32_t j = 0; j < b->keys; ++j)
+    assert((uint64_t)batch_get_value_at(b, j) == value);
+}
+
+// some keys are deleted
+static void count_value(batch *b)
+{
+  for (uint32_t j = 0; j < b->keys; ++j) {
+    uint64_t v = (uint64_t)batch_get_value_at(b, j);
+    assert(v == value || v == 0);
+    found += v == value;
+  }
+}
+
+// do `op` for the first `total_keys` keys in the file, skip one key in every `skip` keys if `skip` is not 0,
+// `check` is called for each batch after it is executed, return how many keys are iterated
+static int run(palm_tree *pt, batch **batches, int fd, uint32_t op, int skip, void (*check)(batch *))
+{
+  for (int i = 0; i < queue_size + 1; ++i)
+    batch_clear(batches[i]);
 
-  int fd = open(file_name, O_RDONLY);
-  assert(fd > 0);
   int block = 65536, curr = 0, ptr = 0, count = 0;
   char buf[block];
   int flag = 1;
-  long long before = mstime();
   int idx = 0;
   batch *cb = batches[idx];
   for (; (ptr = pread(fd, buf, block, curr)) > 0 && flag; curr += ptr) {
@@ -74,12 +95,18 @@ void test_palm_tree()
         break;
       }
 
-      if (batch_add_write(cb, key, len, (void *)value) == -1) {
+      if (skip && (count % skip) == 0)
+        continue;
+
+      if (batch_add(cb, op, key, len) == -1) {
         palm_tree_execute(pt, cb);
         idx = idx == queue_size ? 0 : idx + 1;
         cb = batches[idx];
+        // batch might still be in the queue, its results are ready once it is done
+        batch_wait(cb);
+        if (check) check(cb);
         batch_clear(cb);
-        assert(batch_add_write(cb, key, len, (void *)value) == 1);
+        assert(batch_add(cb, op, key, len) == 1);
       }
     }
   }
@@ -88,67 +115,137 @@ void test_palm_tree()
   palm_tree_execute(pt, cb);
   palm_tree_flush(pt);
 
-  long long after = mstime();
-  printf("\033[31mtotal: %d\033[0m\n\033[32mput time: %.4f  s\033[0m\n", total_keys, (float)(after - before) / 1000);
-  show_metric();
+  if (check)
+    for (int i = 0; i < queue_size + 1; ++i)
+      check(batches[i]);
 
-  for (int i = 0; i < queue_size + 1; ++i)
-    batch_clear(batches[i]);
+  return count > total_keys ? total_keys : count;
+}
 
-  // palm_tree_validate(pt);
+// scan all the keys in one operation, then scan from every `step` keys with a small limit, and compare
+// results of them
+static void test_scan(palm_tree *pt, batch *b, int expect)
+{
+  const uint32_t kv_size = key_byte + max_key_size + value_bytes;
+  const int limit = 16, step = 97;
 
-  curr = 0;
-  flag = 1;
-  count = 0;
-  before = mstime();
-  for (; (ptr = pread(fd, buf, block, curr)) > 0 && flag; curr += ptr) {
-    while (--ptr && buf[ptr] != '\n' && buf[ptr] != '\0') buf[ptr] = '\0';
-    if (ptr) buf[ptr++] = '\0';
-    else break;
-    for (int i = 0; i < ptr; ++i) {
-      char *key = buf + i, *tmp = key;
-      uint32_t len = 0;
-      while (tmp[len] != '\0' && tmp[len] != '\n')
-        ++len;
-      tmp[len] = '\0';
-      i += len;
+  uint32_t size = (uint32_t)(expect + 1) * kv_size;
+  char *all = (char *)malloc(size);
+  scan_result whole;
+  init_scan_result(&whole, expect + 1, all, size);
 
-      if (count && (count % 1000000) == 0)
-        printf("%d\n", count);
+  batch_clear(b);
+  assert(batch_add_scan(b, "", 0, &whole) == 1);
+  palm_tree_execute(pt, b);
+  palm_tree_flush(pt);
+  assert(whole.keys == (uint32_t)expect);
 
-      if (count++ == total_keys) {
-        flag = 0;
+  // offset of each kv pair in `all`, keys are in ascending order
+  uint32_t *offs = (uint32_t *)malloc(sizeof(uint32_t) * (expect + 1));
+  const void *key, *pkey = 0;
+  uint32_t len, plen = 0, off = 0;
+  void *val;
+  int n = 0;
+  for (; offs[n] = off, scan_result_next(&whole, &off, &key, &len, &val); ++n) {
+    assert((uint64_t)val == value);
+    assert(!pkey || compare_key(pkey, plen, key, len) < 0);
+    pkey = key;
+    plen = len;
+  }
+  assert(n == expect);
+
+  int number = (expect + step - 1) / step;
+  scan_result *results = (scan_result *)malloc(sizeof(scan_result) * (number + 1));
+  char *bufs = (char *)malloc(limit * kv_size * (number + 1));
+  for (int i = 0; i < number; ++i)
+    init_scan_result(&results[i], limit, bufs + i * limit * kv_size, limit * kv_size);
+
+  for (int i = 0; i < expect;) {
+    batch_clear(b);
+    int first = i;
+    for (; i < expect; i += step) {
+      off = offs[i];
+      assert(scan_result_next(&whole, &off, &key, &len, &val));
+      if (batch_add_scan(b, key, len, &results[i / step]) == -1)
         break;
-      }
+    }
+    assert(i > first);
+    palm_tree_execute(pt, b);
+    batch_wait(b);
 
-      if (batch_add_read(cb, key, len) == -1) {
-        palm_tree_execute(pt, cb);
-        idx = idx == queue_size ? 0 : idx + 1;
-        cb = batches[idx];
-        for (uint32_t j = 0; j < cb->keys; ++j)
-          assert((uint64_t)batch_get_value_at(cb, j) == value);
-        batch_clear(cb);
-        assert(batch_add_read(cb, key, len) == 1);
-      }
+    for (int j = first; j < i; j += step) {
+      scan_result *r = &results[j / step];
+      int keys = expect - j < limit ? expect - j : limit;
+      assert(r->keys == (uint32_t)keys);
+      assert(r->off == offs[j + keys] - offs[j]);
+      assert(memcmp(r->buf, all + offs[j], r->off) == 0);
     }
   }
 
-  // finish remained work
-  palm_tree_execute(pt, cb);
-  palm_tree_flush(pt);
+  free((void *)bufs);
+  free((void *)results);
+  free((void *)offs);
+  free((void *)all);
+}
 
-  for (int i = 0; i < queue_size + 1; ++i) {
-    cb = batches[i];
-    for (uint32_t j = 0; j < cb->keys; ++j)
-      assert((uint64_t)batch_get_value_at(cb, j) == value);
-  }
+void test_palm_tree()
+{
+  palm_tree *pt = new_palm_tree(thread_number, queue_size);
+  batch *batches[queue_size + 1];
+  for (int i = 0; i < queue_size + 1; ++i)
+    batches[i] = new_batch();
+
+  char file_name[32];
+  memset(file_name, 0, 32);
+  memcpy(file_name, "./data/", 7);
+  memcpy(file_name + 7, file_str, strlen(file_str));
+
+  int fd = open(file_name, O_RDONLY);
+  assert(fd > 0);
 
+  long long before = mstime();
+  int keys = run(pt, batches, fd, Write, 0, 0);
+  long long after = mstime();
+  printf("\033[31mtotal: %d\033[0m\n\033[32mput time: %.4f  s\033[0m\n", total_keys, (float)(after - before) / 1000);
+  show_metric();
+
+  palm_tree_validate(pt);
+
+  before = mstime();
+  run(pt, batches, fd, Read, 0, check_value);
   after = mstime();
   printf("\033[34mget time: %.4f  s\033[0m\n", (float)(after - before) / 1000);
+  show_metric();
 
-  close(fd);
+  before = mstime();
+  test_scan(pt, batches[0], keys);
+  after = mstime();
+  printf("\033[36mscan time: %.4f  s\033[0m\n", (float)(after - before) / 1000);
 
-  show_metric();
+  // delete 3 keys in every 4 keys, so that most of the nodes are merged
+  before = mstime();
+  run(pt, batches, fd, Delete, 4, check_value);
+  after = mstime();
+  printf("\033[35mdelete time: %.4f  s\033[0m\n", (float)(after - before) / 1000);
+
+  palm_tree_validate(pt);
+
+  found = 0;
+  run(pt, batches, fd, Read, 0, count_value);
+  assert(found == keys / 4);
+  test_scan(pt, batches[0], found);
+
+  // delete the others
+  run(pt, batches, fd, Delete, 0, count_value);
+
+  palm_tree_validate(pt);
+
+  found = 0;
+  run(pt, batches, fd, Read, 0, count_value);
+  assert(found == 0);
+  test_scan(pt, batches[0], 0);
+
+  close(fd);
 
   for (int i = 0; i < queue_size + 1; ++i)
     free_batch(batches[i]);
@@ -0,0 +1,174 @@
+/**
+ *    author:     UncP
+ *    date:    2026-10-17
+ *    license:    BSD-3
+**/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "epoch.h"
+
+#define likely(x)   (__builtin_expect(!!(x), 1))
+#define unlikely(x) (__builtin_expect(!!(x), 0))
+
+// try to advance global epoch when a thread has retired this many pointers
+#define epoch_threshold 64
+
+#define is_active(state) ((state) & 1)
+#define get_epoch(state) ((state) >> 1)
+
+static pthread_key_t key;
+static int initialized = 0;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t global_epoch = 0;
+static epoch_record *records = 0;
+
+// a record is never freed, it's released when its thread exits and adopted by the next new thread,
+// so are the pointers that have not been released yet
+static void release_epoch_record(void *arg)
+{
+  epoch_record *rec = (epoch_record *)arg;
+  rec->depth = 0;
+  __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&rec->used, 0, __ATOMIC_RELEASE);
+}
+
+void init_epoch()
+{
+  pthread_mutex_lock(&mutex);
+  if (initialized == 0) {
+    assert(pthread_key_create(&key, release_epoch_record) == 0);
+    initialized = 1;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+static epoch_record* new_epoch_record()
+{
+  // try to adopt a record released by an exited thread
+  epoch_record *rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+  for (; rec; rec = rec->next) {
+    uint32_t used = 0;
+    if (__atomic_load_n(&rec->used, __ATOMIC_RELAXED) == 0 &&
+        __atomic_compare_exchange_n(&rec->used, &used, 1, 0 /* weak */, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return rec;
+  }
+
+  assert(posix_memalign((void **)&rec, 64, sizeof(epoch_record)) == 0);
+  rec->state = 0;
+  rec->depth = 0;
+  rec->used  = 1;
+  for (int i = 0; i < 3; ++i) {
+    rec->epoch[i] = 0;
+    rec->limbo[i] = 0;
+  }
+  rec->count = 0;
+
+  epoch_record *head = __atomic_load_n(&records, __ATOMIC_RELAXED);
+  do {
+    rec->next = head;
+  } while (!__atomic_compare_exchange_n(&records, &head, rec, 1 /* weak */, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  return rec;
+}
+
+static inline epoch_record* get_thread_record()
+{
+  epoch_record *rec = (epoch_record *)pthread_getspecific(key);
+  if (unlikely(rec == 0)) {
+    rec = new_epoch_record();
+    assert(pthread_setspecific(key, (void *)rec) == 0);
+  }
+  return rec;
+}
+
+void epoch_enter()
+{
+  epoch_record *rec = get_thread_record();
+  if (rec->depth++)
+    return ;
+
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+  // must be visible before we read any shared pointer
+  __atomic_store_n(&rec->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit()
+{
+  epoch_record *rec = get_thread_record();
+  assert(rec->depth);
+  if (--rec->depth)
+    return ;
+
+  __atomic_store_n(&rec->state, rec->state & ~(uint64_t)1, __ATOMIC_RELEASE);
+}
+
+// global epoch can only advance when all the active threads have observed current epoch
+static void epoch_try_advance()
+{
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+  epoch_record *rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+  for (; rec; rec = rec->next) {
+    uint64_t state = __atomic_load_n(&rec->state, __ATOMIC_SEQ_CST);
+    if (is_active(state) && get_epoch(state) != epoch)
+      return ;
+  }
+
+  __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0 /* weak */, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static void epoch_release_limbo(epoch_record *rec, int i)
+{
+  retired *cur = rec->limbo[i];
+  while (cur) {
+    retired *next = cur->next;
+    cur->release(cur->ptr);
+    free((void *)cur);
+    --rec->count;
+    cur = next;
+  }
+  rec->limbo[i] = 0;
+}
+
+// pointers retired in epoch `e` can be released once global epoch reaches `e + 2`
+static void epoch_reclaim(epoch_record *rec)
+{
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < 3; ++i)
+    if (rec->limbo[i] && rec->epoch[i] + 2 <= epoch)
+      epoch_release_limbo(rec, i);
+}
+
+// require: `ptr` is no longer reachable from the index
+void epoch_retire(void *ptr, void (*release)(void *))
+{
+  epoch_record *rec = get_thread_record();
+
+  // the epoch must be read after `ptr` is unlinked, a thread that still sees `ptr`
+  // entered its critical section no later than this epoch
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+  int i = (int)(epoch % 3);
+  // this limbo list is filled at least 3 epochs ago, it's safe to release
+  if (rec->limbo[i] && rec->epoch[i] != epoch)
+    epoch_release_limbo(rec, i);
+  rec->epoch[i] = epoch;
+
+  retired *r = (retired *)malloc(sizeof(retired));
+  r->ptr = ptr;
+  r->release = release;
+  r->next = rec->limbo[i];
+  rec->limbo[i] = r;
+
+  if (unlikely(++rec->count >= epoch_threshold)) {
+    epoch_try_advance();
+    epoch_reclaim(rec);
+  }
+}
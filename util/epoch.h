@@ -0,0 +1,43 @@
+/**
+ *    author:     UncP
+ *    date:    2026-10-17
+ *    license:    BSD-3
+**/
+
+#ifndef _epoch_h_
+#define _epoch_h_
+
+#include <stdint.h>
+
+// epoch based memory reclamation, Reference: Practical lock-freedom (Keir Fraser)
+//
+// a thread must call `epoch_enter` before it touches any shared node and `epoch_exit` when it's done,
+// a node that has been unlinked from the index is handed to `epoch_retire`, and it's released only after
+// every thread that might still hold a reference to it has left its critical section
+
+typedef struct retired
+{
+  void  *ptr;
+  void (*release)(void *);
+
+  struct retired *next;
+}retired;
+
+typedef struct epoch_record
+{
+  uint64_t state;       // (epoch << 1) | active
+  uint32_t depth;       // critical section nesting depth
+  uint32_t used;        // whether this record is owned by a thread
+  uint64_t epoch[3];    // epoch when each limbo list is filled
+  retired *limbo[3];    // retired pointers waiting to be released
+  uint32_t count;       // number of retired pointers in all limbo lists
+
+  struct epoch_record *next;
+}__attribute__((aligned(64))) epoch_record;
+
+void init_epoch();
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr, void (*release)(void *));
+
+#endif /* _epoch_h_ */